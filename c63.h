@@ -42,8 +42,21 @@
 #define HUFF_AC_SIZE 11
 
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
+/*
+*   The planes of the reconstruction are surrounded by a border of
+*   REF_BORDER() pixels, and their rows are REF_STRIDE() bytes apart. Once
+*   the frame is a reference, extend_frame() fills the border with copies of
+*   the edge pixels, so a motion vector may point out of the frame. The luma
+*   border covers the widest search range, ME_MAX_RANGE, and the chroma
+*   border half of it.
+*/
+#define FRAME_BORDER 128
+#define REF_BORDER(c) ((c) == Y_COMPONENT ? FRAME_BORDER : FRAME_BORDER / 2)
+#define REF_STRIDE(cm, c) ((cm)->padw[c] + 2 * REF_BORDER(c))
+
 struct yuv
 {
   uint8_t *Y;
@@ -61,11 +74,51 @@ struct dct
 typedef struct yuv yuv_t;
 typedef struct dct dct_t;
 
+/* Sparse form of the quantized residuals of a plane, one entry per 8x8 block
+   in the order the blocks are stored in struct dct. Bit i of nonzero is set
+   when coefficient i (zig-zag order) is nonzero, last is the index of the
+   last nonzero coefficient + 1 (0 for an all-zero block), and start is where
+   the nonzero coefficients of the block begin in coeffs. */
+struct sparse_plane
+{
+  uint8_t *last;
+  uint64_t *nonzero;
+  uint32_t *start;
+};
+
+struct sparse_residuals
+{
+  struct sparse_plane plane[COLOR_COMPONENTS];
+
+  int16_t *coeffs;    // Nonzero coefficients of all blocks, packed
+  uint32_t ncoeffs;   // Number of coefficients in use
+};
+
 struct entropy_ctx
 {
   FILE *fp;
-  unsigned int bit_buffer;
+  uint64_t bit_buffer;
   unsigned int bit_buffer_width;
+
+  // coded bytes of the writer, for fp or in a buffer of the caller, see io.c
+  uint8_t *buf;
+  size_t len;
+  size_t cap;
+  int fixed;
+
+  // coded bytes of the reader, from a mapping or a read buffer, see io.c
+  int in_fd;
+  uint8_t *in_buf;
+  size_t in_map_size;         // size of the mapping, 0 for a read buffer
+  const uint8_t *in;
+  const uint8_t *in_end;
+  int in_eof;
+
+  // marker the reader has run into at the end of the scan, 0 if none
+  uint8_t marker;
+
+  // DC predictors of the frame being written, see write_frame_rows()
+  int16_t prev_DC[COLOR_COMPONENTS];
 };
 
 struct macroblock
@@ -77,13 +130,21 @@ struct macroblock
 struct frame
 {
   yuv_t *orig;        // Original input image
-  yuv_t *recons;      // Reconstructed image
+  yuv_t *recons;      // Reconstructed image, REF_STRIDE() wide
   yuv_t *predicted;   // Predicted frame from intra-prediction
 
+  uint8_t *recons_buf;  // the planes of recons with their borders
+  int extended;         // the borders are filled, see extend_frame()
+
   dct_t *residuals;   // Difference between original image and predicted frame
+  struct sparse_residuals *sparse;  // Sparse residuals, NULL if not used
 
   struct macroblock *mbs[COLOR_COMPONENTS];
   int keyframe;
+
+  // mbs or residuals are in memory of the caller, see create_frame_in()
+  int borrowed_mbs;
+  int borrowed_residuals;
 };
 
 struct c63_common
@@ -98,6 +159,11 @@ struct c63_common
   uint8_t qp;                         // Quality parameter
 
   int me_search_range;
+  int me_mode;                        // enum me_mode, see me.h
+  int me_in_frame;                    // vectors stay in the frame
+  struct me_seeds *seeds;             // of ME_FAST, see me.c
+  struct me_pyramid *pyramid;         // of ME_PYRAMID, see me.c
+  struct me_sums *sums;               // of ME_EXACT, see me.c
 
   uint8_t quanttbl[COLOR_COMPONENTS][64];
 
@@ -17,8 +17,8 @@ int frequencies[2][12];
 /* Start of Image (SOI) marker, contains no payload. */
 static void write_SOI(struct c63_common *cm)
 {
-  put_byte(cm->e_ctx.fp, JPEG_DEF_MARKER);
-  put_byte(cm->e_ctx.fp, JPEG_SOI_MARKER);
+  put_byte(&cm->e_ctx, JPEG_DEF_MARKER);
+  put_byte(&cm->e_ctx, JPEG_SOI_MARKER);
 }
 
 /* Define Quatization Tables (DQT) marker, contains the tables as payload. */
@@ -26,24 +26,24 @@ static void write_DQT(struct c63_common *cm)
 {
   int16_t size = 2 + (3 * 64 + 1);
 
-  put_byte(cm->e_ctx.fp, JPEG_DEF_MARKER);
-  put_byte(cm->e_ctx.fp, JPEG_DQT_MARKER);
+  put_byte(&cm->e_ctx, JPEG_DEF_MARKER);
+  put_byte(&cm->e_ctx, JPEG_DQT_MARKER);
 
   /* Length of segment */
-  put_byte(cm->e_ctx.fp, size >> 8);
-  put_byte(cm->e_ctx.fp, size & 0xff);
+  put_byte(&cm->e_ctx, size >> 8);
+  put_byte(&cm->e_ctx, size & 0xff);
 
   /* Quatization table for Y component */
-  put_byte(cm->e_ctx.fp, Y_COMPONENT);
-  put_bytes(cm->e_ctx.fp, cm->quanttbl[Y_COMPONENT], 64);
+  put_byte(&cm->e_ctx, Y_COMPONENT);
+  put_bytes(&cm->e_ctx, cm->quanttbl[Y_COMPONENT], 64);
 
   /* Quantization table for U component */
-  put_byte(cm->e_ctx.fp, U_COMPONENT);
-  put_bytes(cm->e_ctx.fp, cm->quanttbl[U_COMPONENT], 64);
+  put_byte(&cm->e_ctx, U_COMPONENT);
+  put_bytes(&cm->e_ctx, cm->quanttbl[U_COMPONENT], 64);
 
   /* Quantization table for V component */
-  put_byte(cm->e_ctx.fp, V_COMPONENT);
-  put_bytes(cm->e_ctx.fp, cm->quanttbl[V_COMPONENT], 64);
+  put_byte(&cm->e_ctx, V_COMPONENT);
+  put_bytes(&cm->e_ctx, cm->quanttbl[V_COMPONENT], 64);
 }
 
 /* Start of Frame (SOF) marker with baseline DCT (aka SOF0). */
@@ -51,38 +51,38 @@ static void write_SOF0(struct c63_common *cm)
 {
   int16_t size = 8 + 3 * COLOR_COMPONENTS + 1;
 
-  put_byte(cm->e_ctx.fp, JPEG_DEF_MARKER);
-  put_byte(cm->e_ctx.fp, JPEG_SOF_MARKER);
+  put_byte(&cm->e_ctx, JPEG_DEF_MARKER);
+  put_byte(&cm->e_ctx, JPEG_SOF_MARKER);
 
   /* Lenght of segment */
-  put_byte(cm->e_ctx.fp, size >> 8);
-  put_byte(cm->e_ctx.fp, size & 0xff);
+  put_byte(&cm->e_ctx, size >> 8);
+  put_byte(&cm->e_ctx, size & 0xff);
 
   /* Precision */
-  put_byte(cm->e_ctx.fp, 8);
+  put_byte(&cm->e_ctx, 8);
 
   /* Width and height */
-  put_byte(cm->e_ctx.fp, cm->height >> 8);
-  put_byte(cm->e_ctx.fp, cm->height & 0xff);
-  put_byte(cm->e_ctx.fp, cm->width >> 8);
-  put_byte(cm->e_ctx.fp, cm->width & 0xff);
+  put_byte(&cm->e_ctx, cm->height >> 8);
+  put_byte(&cm->e_ctx, cm->height & 0xff);
+  put_byte(&cm->e_ctx, cm->width >> 8);
+  put_byte(&cm->e_ctx, cm->width & 0xff);
 
-  put_byte(cm->e_ctx.fp, COLOR_COMPONENTS);
+  put_byte(&cm->e_ctx, COLOR_COMPONENTS);
 
-  put_byte(cm->e_ctx.fp, 1); /* Component id */
-  put_byte(cm->e_ctx.fp, 0x22); /* hor | ver sampling factor */
-  put_byte(cm->e_ctx.fp, 0); /* Quant. tbl. id */
+  put_byte(&cm->e_ctx, 1); /* Component id */
+  put_byte(&cm->e_ctx, 0x22); /* hor | ver sampling factor */
+  put_byte(&cm->e_ctx, 0); /* Quant. tbl. id */
 
-  put_byte(cm->e_ctx.fp, 2); /* Component id */
-  put_byte(cm->e_ctx.fp, 0x11); /* hor | ver sampling factor */
-  put_byte(cm->e_ctx.fp, 1); /* Quant. tbl. id */
+  put_byte(&cm->e_ctx, 2); /* Component id */
+  put_byte(&cm->e_ctx, 0x11); /* hor | ver sampling factor */
+  put_byte(&cm->e_ctx, 1); /* Quant. tbl. id */
 
-  put_byte(cm->e_ctx.fp, 3); /* Component id */
-  put_byte(cm->e_ctx.fp, 0x11); /* hor | ver sampling factor */
-  put_byte(cm->e_ctx.fp, 2); /* Quant. tbl. id */
+  put_byte(&cm->e_ctx, 3); /* Component id */
+  put_byte(&cm->e_ctx, 0x11); /* hor | ver sampling factor */
+  put_byte(&cm->e_ctx, 2); /* Quant. tbl. id */
 
   /* Is this a keyframe or not? */
-  put_byte(cm->e_ctx.fp, cm->curframe->keyframe);
+  put_byte(&cm->e_ctx, cm->curframe->keyframe);
 }
 
 static void write_DHT_HTS(struct c63_common *cm, uint8_t id, uint8_t *numlength,
@@ -93,9 +93,9 @@ static void write_DHT_HTS(struct c63_common *cm, uint8_t id, uint8_t *numlength,
 
   for (i = 0; i < 16; ++i) { n += numlength[i]; }
 
-  put_byte(cm->e_ctx.fp, id);
-  put_bytes(cm->e_ctx.fp, numlength, 16);
-  put_bytes(cm->e_ctx.fp, data, n);
+  put_byte(&cm->e_ctx, id);
+  put_bytes(&cm->e_ctx, numlength, 16);
+  put_bytes(&cm->e_ctx, data, n);
 }
 
 /* Define Huffman Table (DHT) marker, the payload is the Huffman table
@@ -104,12 +104,12 @@ static void write_DHT(struct c63_common *cm)
 {
   int16_t size = 0x01A2; /* 2 + n*(17+mi); */
 
-  put_byte(cm->e_ctx.fp, JPEG_DEF_MARKER);
-  put_byte(cm->e_ctx.fp, JPEG_DHT_MARKER);
+  put_byte(&cm->e_ctx, JPEG_DEF_MARKER);
+  put_byte(&cm->e_ctx, JPEG_DHT_MARKER);
 
   /* Length of segment */
-  put_byte(cm->e_ctx.fp, size >> 8);
-  put_byte(cm->e_ctx.fp, size & 0xff);
+  put_byte(&cm->e_ctx, size >> 8);
+  put_byte(&cm->e_ctx, size & 0xff);
 
   /* Write the four huffman table specifications */
   /* DC table 0 */
@@ -128,32 +128,32 @@ static void write_SOS(struct c63_common *cm)
 {
   int16_t size = 6 + 2 * COLOR_COMPONENTS;
 
-  put_byte(cm->e_ctx.fp, JPEG_DEF_MARKER);
-  put_byte(cm->e_ctx.fp, JPEG_SOS_MARKER);
+  put_byte(&cm->e_ctx, JPEG_DEF_MARKER);
+  put_byte(&cm->e_ctx, JPEG_SOS_MARKER);
 
   /* Length of the segment */
-  put_byte(cm->e_ctx.fp, size >> 8);
-  put_byte(cm->e_ctx.fp, size & 0xff);
+  put_byte(&cm->e_ctx, size >> 8);
+  put_byte(&cm->e_ctx, size & 0xff);
 
-  put_byte(cm->e_ctx.fp, COLOR_COMPONENTS);
+  put_byte(&cm->e_ctx, COLOR_COMPONENTS);
 
-  put_byte(cm->e_ctx.fp, 1); /* Component id */
-  put_byte(cm->e_ctx.fp, 0x00); /* DC | AC huff tbl */
-  put_byte(cm->e_ctx.fp, 2); /* Component id */
-  put_byte(cm->e_ctx.fp, 0x11); /* DC | AC huff tbl */
-  put_byte(cm->e_ctx.fp, 3); /* Component id */
-  put_byte(cm->e_ctx.fp, 0x11); /* DC | AC huff tbl */
+  put_byte(&cm->e_ctx, 1); /* Component id */
+  put_byte(&cm->e_ctx, 0x00); /* DC | AC huff tbl */
+  put_byte(&cm->e_ctx, 2); /* Component id */
+  put_byte(&cm->e_ctx, 0x11); /* DC | AC huff tbl */
+  put_byte(&cm->e_ctx, 3); /* Component id */
+  put_byte(&cm->e_ctx, 0x11); /* DC | AC huff tbl */
 
-  put_byte(cm->e_ctx.fp, 0); /* ss, first AC */
-  put_byte(cm->e_ctx.fp, 63); /* se, last AC */
-  put_byte(cm->e_ctx.fp, 0); /* ah | al */
+  put_byte(&cm->e_ctx, 0); /* ss, first AC */
+  put_byte(&cm->e_ctx, 63); /* se, last AC */
+  put_byte(&cm->e_ctx, 0); /* ah | al */
 }
 
 /* End of Image (EOI) marker, contains no payload. */
 static void write_EOI(struct c63_common *cm)
 {
-  put_byte(cm->e_ctx.fp, JPEG_DEF_MARKER);
-  put_byte(cm->e_ctx.fp, JPEG_EOI_MARKER);
+  put_byte(&cm->e_ctx, JPEG_DEF_MARKER);
+  put_byte(&cm->e_ctx, JPEG_EOI_MARKER);
 }
 
 static inline uint8_t bit_width(int16_t i)
@@ -169,6 +169,62 @@ static inline uint8_t bit_width(int16_t i)
 }
 
 
+/* Write the residuals of block b from the sparse form. Produces the same bits
+   as the dense path in write_block(), but only visits nonzero coefficients:
+   a run of zeros before a coefficient is the distance between set bits. */
+static void write_sparse_residuals(struct c63_common *cm, uint32_t b,
+    int16_t *prev_DC, int32_t cc, int channel)
+{
+  struct sparse_plane *plane = &cm->curframe->sparse->plane[channel];
+  int16_t *coeffs = &cm->curframe->sparse->coeffs[plane->start[b]];
+  uint64_t nonzero = plane->nonzero[b];
+  uint32_t prev = 0;
+
+  /* Calculate DC component, and write to stream */
+  int16_t dc_coeff = (nonzero & 1) ? *coeffs++ : 0;
+  int16_t dc = dc_coeff - *prev_DC;
+  *prev_DC = dc_coeff;
+
+  uint8_t size = bit_width(dc);
+  put_bits(&cm->e_ctx, DCVLC[cc][size],DCVLC_Size[cc][size]);
+
+  if(dc < 0) { dc = dc - 1; }
+  put_bits(&cm->e_ctx, dc, size);
+
+  /* Put the nonzero ac-coefficients */
+  nonzero &= ~1ULL;
+
+  while (nonzero)
+  {
+    uint32_t i = __builtin_ctzll(nonzero);
+    uint32_t num_ac = i - prev - 1;
+    int16_t ac = *coeffs++;
+
+    nonzero &= nonzero - 1;
+    prev = i;
+
+    while (num_ac >= 16)
+    {
+      put_bits(&cm->e_ctx, ACVLC[cc][15][0], ACVLC_Size[cc][15][0]);
+      num_ac -= 16;
+    }
+
+    size = bit_width(ac);
+    put_bits(&cm->e_ctx, ACVLC[cc][num_ac][size],
+        ACVLC_Size[cc][num_ac][size]);
+
+    if(ac < 0) { --ac; }
+
+    put_bits(&cm->e_ctx, ac, size);
+  }
+
+  /* Put end of block marker */
+  if(plane->last[b] < 64)
+  {
+    put_bits(&cm->e_ctx, ACVLC[cc][0][0], ACVLC_Size[cc][0][0]);
+  }
+}
+
 static void write_block(struct c63_common *cm, int16_t *in_data, uint32_t width,
     uint32_t height, uint32_t uoffset, uint32_t voffset, int16_t *prev_DC,
     int32_t cc, int channel)
@@ -228,6 +284,14 @@ static void write_block(struct c63_common *cm, int16_t *in_data, uint32_t width,
 
   /* Write residuals */
 
+  if (cm->curframe->sparse)
+  {
+    /* Same block index as the linear layout below, i.e. offset / 64 */
+    write_sparse_residuals(cm, (voffset/8) * (width/8) + uoffset/8, prev_DC,
+        cc, channel);
+    return;
+  }
+
   /* Residuals stored linear in memory */
   int16_t *block = &in_data[uoffset * 8 + voffset * width];
 
@@ -317,9 +381,12 @@ static void write_interleaved_data_MCU(struct c63_common *cm, int16_t *dct,
   }
 }
 
-static void write_interleaved_data(struct c63_common *cm)
+/* Write the MCU rows top to bottom, the DC predictors carry over between
+   calls */
+static void write_interleaved_data(struct c63_common *cm, uint32_t top,
+    uint32_t bottom)
 {
-  int16_t prev_DC[3] = {0, 0, 0};
+  int16_t *prev_DC = cm->e_ctx.prev_DC;
   uint32_t u, v;
 
   /* Set up which huffman tables we want to use */
@@ -329,10 +396,9 @@ static void write_interleaved_data(struct c63_common *cm)
 
   /* Find the number of MCU's for the intensity */
   uint32_t ublocks = (uint32_t) (ceil(cm->ypw/(float)(8.0f*YX)));
-  uint32_t vblocks = (uint32_t) (ceil(cm->yph/(float)(8.0f*YY)));
 
   /* Write the MCU's interleaved */
-  for(v = 0; v < vblocks; ++v)
+  for(v = top; v < bottom; ++v)
   {
     for(u = 0; u < ublocks; ++u)
     {
@@ -344,11 +410,28 @@ static void write_interleaved_data(struct c63_common *cm)
           cm->vph, VX, VY, u, v, &prev_DC[2], vhtbl, 2);
     }
   }
+}
 
-  flush_bits(&cm->e_ctx);
+/* Number of MCU rows of a frame, each covers 16 luma rows */
+uint32_t write_frame_mcu_rows(struct c63_common *cm)
+{
+  return (uint32_t) (ceil(cm->yph/(float)(8.0f*YY)));
 }
 
 void write_frame(struct c63_common *cm)
+{
+  write_frame_header(cm);
+  write_frame_rows(cm, 0, write_frame_mcu_rows(cm));
+  write_frame_trailer(cm);
+}
+
+/*
+*   write_frame() in parts, so a frame can be written while its rows are
+*   still arriving: the header, then MCU rows top to bottom in order, then
+*   the trailer. The frame must not change between the calls, except for
+*   rows not written yet.
+*/
+void write_frame_header(struct c63_common *cm)
 {
   /* Write headers */
 
@@ -363,8 +446,20 @@ void write_frame(struct c63_common *cm)
   /* Start of Scan */
   write_SOS(cm);
 
-  write_interleaved_data(cm);
+  memset(cm->e_ctx.prev_DC, 0, sizeof(cm->e_ctx.prev_DC));
+}
+
+void write_frame_rows(struct c63_common *cm, uint32_t top, uint32_t bottom)
+{
+  write_interleaved_data(cm, top, bottom);
+}
+
+void write_frame_trailer(struct c63_common *cm)
+{
+  flush_bits(&cm->e_ctx);
 
   /* End Of Image */
   write_EOI(cm);
+
+  flush_output(&cm->e_ctx);
 }
@@ -6,4 +6,12 @@
 // Declaration
 void write_frame(struct c63_common *cm);
 
+uint32_t write_frame_mcu_rows(struct c63_common *cm);
+
+void write_frame_header(struct c63_common *cm);
+
+void write_frame_rows(struct c63_common *cm, uint32_t top, uint32_t bottom);
+
+void write_frame_trailer(struct c63_common *cm);
+
 #endif  /* C63_WRITE_H_ */
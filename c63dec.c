@@ -1,108 +1,126 @@
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "c63.h"
 #include "c63_write.h"
 #include "common.h"
+#include "index.h"
 #include "io.h"
 #include "me.h"
 #include "tables.h"
 
-/* Decode VLC token */
-static uint8_t get_vlc_token(struct entropy_ctx *c, uint16_t *table,
-    uint8_t *table_sz, int tablelen)
+/*
+*   VLC tokens are decoded with lookup tables built from the code tables.
+*   The next VLC_FAST_BITS bits of the stream index fast, which holds the
+*   token and the length of its code for codes that short, and 0 for the
+*   start of a longer code. Longer codes are looked for among slow.
+*/
+#define VLC_FAST_BITS 9
+#define VLC_MAX_BITS 16
+#define VLC_MAX_TOKENS (HUFF_AC_ZERO * HUFF_AC_SIZE)
+
+struct vlc_lut
+{
+  uint16_t fast[1 << VLC_FAST_BITS];    // token << 5 | code length
+  int nslow;
+  uint16_t slow_code[VLC_MAX_TOKENS];
+  uint8_t slow_size[VLC_MAX_TOKENS];
+  uint8_t slow_token[VLC_MAX_TOKENS];
+};
+
+static struct vlc_lut dc_lut[2];
+static struct vlc_lut ac_lut[2];
+static struct vlc_lut mv_lut;
+
+/*
+*   Build the lookup table of the n codes of codes and sizes, the token of
+*   code i is i. Tokens of size 0 do not exist.
+*/
+static void build_vlc_lut(struct vlc_lut *lut, const uint16_t *codes,
+    const uint8_t *sizes, int n)
 {
-  int i, n;
-  uint16_t bits = 0;
+  int i, j;
+
+  memset(lut, 0, sizeof(*lut));
 
-  for (n = 1; n <= 16; ++n)
+  for (i = 0; i < n; ++i)
   {
-    bits <<= 1;
-    bits |= get_bits(c, 1);
+    int size = sizes[i];
+    uint16_t code = codes[i] & ((1 << size) - 1);
 
-    /* See if this string matches a token in VLC table */
-    for (i = 0; i < tablelen; ++i)
+    if (size == 0) { continue; }
+
+    if (size <= VLC_FAST_BITS)
     {
-      if (table_sz[i] < n)
-      {
-        /* Too small token. */
-        continue;
-      }
+      // every index that starts with the code, the first token wins
+      int shift = VLC_FAST_BITS - size;
 
-      if (table_sz[i] == n)
+      for (j = 0; j < 1 << shift; ++j)
       {
-        if (bits == (table[i] & ((1 << n) - 1)))
-        {
-          /* Found it */
-          return i;
-        }
+        uint16_t *entry = &lut->fast[code << shift | j];
+        if (*entry == 0) { *entry = i << 5 | size; }
       }
     }
+    else
+    {
+      lut->slow_code[lut->nslow] = code;
+      lut->slow_size[lut->nslow] = size;
+      lut->slow_token[lut->nslow] = i;
+      ++lut->nslow;
+    }
   }
-
-  fprintf(stdout, "VLC token not found.\n");
-  exit(EXIT_FAILURE);
 }
 
-/* Decode AC VLC token.
-   Optimized VLC decoder that takes advantage of the increasing order
-   of our ACVLC_Size table. Does not work with a general table, so use the
-   unoptimized get_vlc_token. A better approach would be to use an index table.
- */
-static uint8_t get_vlc_token_ac(struct entropy_ctx *c,
-    uint16_t table[HUFF_AC_ZERO][HUFF_AC_SIZE],
-    uint8_t table_sz[HUFF_AC_ZERO][HUFF_AC_SIZE])
+static void init_vlc_luts(void)
 {
-  int n, x, y;
-  uint16_t bits = 0;
+  int cc;
 
-  for (n = 1; n <= 16; ++n)
+  for (cc = 0; cc < 2; ++cc)
   {
-    bits <<= 1;
-    bits |= get_bits(c, 1);
+    build_vlc_lut(&dc_lut[cc], DCVLC[cc], DCVLC_Size[cc],
+                  ARRAY_SIZE(DCVLC[cc]));
 
-    uint16_t mask = (1 << n) - 1;
+    // AC tokens are num_zero * HUFF_AC_SIZE + size, the index in the table
+    build_vlc_lut(&ac_lut[cc], &ACVLC[cc][0][0], &ACVLC_Size[cc][0][0],
+                  HUFF_AC_ZERO * HUFF_AC_SIZE);
+  }
 
-    for (x = 1; x < HUFF_AC_SIZE; ++x)
-    {
-      for (y = 0; y < HUFF_AC_ZERO; ++y)
-      {
-        if (table_sz[y][x] < n)
-        {
-          continue;
-        }
-        else if (table_sz[y][x] > n)
-        {
-          break;
-        }
-        else if (bits == (table[y][x] & mask))
-        {
-          /* Found it */
-          return y*HUFF_AC_SIZE + x;
-        }
-      }
+  build_vlc_lut(&mv_lut, MVVLC, MVVLC_Size, ARRAY_SIZE(MVVLC));
+}
 
-      if (table_sz[x][0] > n) { break; }
-    }
+/* Decode VLC token */
+static uint8_t get_vlc_token(struct entropy_ctx *c, const struct vlc_lut *lut)
+{
+  uint16_t bits = peek_bits(c, VLC_MAX_BITS);
+  uint16_t entry = lut->fast[bits >> (VLC_MAX_BITS - VLC_FAST_BITS)];
+  int i;
 
-    /* Check if it's a special token (bitsize 0) */
-    for (y = 0; y < HUFF_AC_ZERO; y += (HUFF_AC_ZERO-1))
+  if (entry)
+  {
+    skip_bits(c, entry & 0x1f);
+    return entry >> 5;
+  }
+
+  for (i = 0; i < lut->nslow; ++i)
+  {
+    if (bits >> (VLC_MAX_BITS - lut->slow_size[i]) == lut->slow_code[i])
     {
-      if (table_sz[y][0] == n && bits == (table[y][0] & mask))
-      {
-        /* Found it */
-        return y*HUFF_AC_SIZE;
-      }
+      skip_bits(c, lut->slow_size[i]);
+      return lut->slow_token[i];
     }
   }
 
-  printf("VLC token not found (ac).\n");
+  fprintf(stdout, "VLC token not found.\n");
   exit(EXIT_FAILURE);
 }
 
@@ -144,11 +162,11 @@ static void read_block(struct c63_common *cm, int16_t *out_data, uint32_t width,
     else
     {
       int16_t val;
-      size = get_vlc_token(&cm->e_ctx, MVVLC, MVVLC_Size, ARRAY_SIZE(MVVLC));
+      size = get_vlc_token(&cm->e_ctx, &mv_lut);
       val = get_bits(&cm->e_ctx, size);
       mb->mv_x = extend_sign(val, size);
 
-      size = get_vlc_token(&cm->e_ctx, MVVLC, MVVLC_Size, ARRAY_SIZE(MVVLC));
+      size = get_vlc_token(&cm->e_ctx, &mv_lut);
       val = get_bits(&cm->e_ctx, size);
       mb->mv_y = extend_sign(val, size);
     }
@@ -161,8 +179,7 @@ static void read_block(struct c63_common *cm, int16_t *out_data, uint32_t width,
   memset(block, 0, 64 * sizeof(int16_t));
 
   /* Decode DC */
-  size =
-    get_vlc_token(&cm->e_ctx, DCVLC[cc], DCVLC_Size[cc], ARRAY_SIZE(DCVLC[cc]));
+  size = get_vlc_token(&cm->e_ctx, &dc_lut[cc]);
 
   int16_t dc = get_bits(&cm->e_ctx, size);
 
@@ -174,7 +191,7 @@ static void read_block(struct c63_common *cm, int16_t *out_data, uint32_t width,
   /* Decode AC RLE */
   for (i = 1; i < 64; ++i)
   {
-    uint16_t token = get_vlc_token_ac(&cm->e_ctx, ACVLC[cc], ACVLC_Size[cc]);
+    uint16_t token = get_vlc_token(&cm->e_ctx, &ac_lut[cc]);
 
     num_zero = token / 11;
     size = token % 11;
@@ -255,12 +272,12 @@ void parse_dqt(struct c63_common *cm)
 {
   int i;
   // Size is not being used ATM, but we might want to use it in future version.
-  uint16_t size = (get_byte(cm->e_ctx.fp) << 8) | get_byte(cm->e_ctx.fp);
+  uint16_t size = (get_byte(&cm->e_ctx) << 8) | get_byte(&cm->e_ctx);
   (void)size;  // Don't warn us about unused variable.
 
   for (i = 0; i < 3; ++i)
   {
-    int idx = get_byte(cm->e_ctx.fp);
+    int idx = get_byte(&cm->e_ctx);
 
     if (idx != i)
     {
@@ -268,7 +285,7 @@ void parse_dqt(struct c63_common *cm)
       exit(EXIT_FAILURE);
     }
 
-    read_bytes(cm->e_ctx.fp, cm->quanttbl[i], 64);
+    read_bytes(&cm->e_ctx, cm->quanttbl[i], 64);
   }
 }
 
@@ -276,22 +293,22 @@ void parse_dqt(struct c63_common *cm)
 void parse_sos(struct c63_common *cm)
 {
   uint16_t size;
-  size = (get_byte(cm->e_ctx.fp) << 8) | get_byte(cm->e_ctx.fp);
+  size = (get_byte(&cm->e_ctx) << 8) | get_byte(&cm->e_ctx);
 
   /* Don't care currently */
 
   uint8_t buf[size];
-  read_bytes(cm->e_ctx.fp, buf, size-2);
+  read_bytes(&cm->e_ctx, buf, size-2);
 }
 
 // Baseline DCT
 void parse_sof0(struct c63_common *cm)
 {
   // Size is not being used ATM, but we might want to use it in future version.
-  uint16_t size = (get_byte(cm->e_ctx.fp) << 8) | get_byte(cm->e_ctx.fp);
+  uint16_t size = (get_byte(&cm->e_ctx) << 8) | get_byte(&cm->e_ctx);
   (void)size;  // Don't warn us about unused variable.
 
-  uint8_t precision = get_byte(cm->e_ctx.fp);
+  uint8_t precision = get_byte(&cm->e_ctx);
 
   if (precision != 8)
   {
@@ -299,12 +316,12 @@ void parse_sof0(struct c63_common *cm)
     exit(EXIT_FAILURE);
   }
 
-  uint16_t height = (get_byte(cm->e_ctx.fp) << 8) | get_byte(cm->e_ctx.fp);
-  uint16_t width = (get_byte(cm->e_ctx.fp) << 8) | get_byte(cm->e_ctx.fp);
+  uint16_t height = (get_byte(&cm->e_ctx) << 8) | get_byte(&cm->e_ctx);
+  uint16_t width = (get_byte(&cm->e_ctx) << 8) | get_byte(&cm->e_ctx);
 
   // Discard subsampling info. We assume 4:2:0
   uint8_t buf[10];
-  read_bytes(cm->e_ctx.fp, buf, 10);
+  read_bytes(&cm->e_ctx, buf, 10);
 
   /* First frame? */
   if (cm->framenum == 0)
@@ -331,26 +348,26 @@ void parse_sof0(struct c63_common *cm)
   cm->curframe = create_frame(cm, 0);
 
   /* Is this a keyframe */
-  cm->curframe->keyframe = get_byte(cm->e_ctx.fp);
+  cm->curframe->keyframe = get_byte(&cm->e_ctx);
 }
 
 // Define Huffman tables
 void parse_dht(struct c63_common *cm)
 {
   uint16_t size;
-  size = (get_byte(cm->e_ctx.fp) << 8) | get_byte(cm->e_ctx.fp);
+  size = (get_byte(&cm->e_ctx) << 8) | get_byte(&cm->e_ctx);
 
   // XXX: Should be handeled properly. However, we currently only use static
   // tables
   uint8_t buf[size];
-  read_bytes(cm->e_ctx.fp, buf, size-2);
+  read_bytes(&cm->e_ctx, buf, size-2);
 }
 
 int parse_c63_frame(struct c63_common *cm)
 {
   // SOI
-  if (get_byte(cm->e_ctx.fp) != JPEG_DEF_MARKER ||
-      get_byte(cm->e_ctx.fp) != JPEG_SOI_MARKER)
+  if (get_byte(&cm->e_ctx) != JPEG_DEF_MARKER ||
+      get_byte(&cm->e_ctx) != JPEG_SOI_MARKER)
   {
     fprintf(stderr, "Not an JPEG file\n");
     exit(EXIT_FAILURE);
@@ -358,18 +375,29 @@ int parse_c63_frame(struct c63_common *cm)
 
   while(1)
   {
-    int c;
-    c = get_byte(cm->e_ctx.fp);
-
-    if (c == 0) { c = get_byte(cm->e_ctx.fp); }
+    uint8_t marker;
 
-    if (c != JPEG_DEF_MARKER)
+    if (cm->e_ctx.marker)
     {
-      fprintf(stderr, "Expected marker.\n");
-      exit(EXIT_FAILURE);
+      // the bit reader has read up to the marker after the scan
+      marker = cm->e_ctx.marker;
+      cm->e_ctx.marker = 0;
     }
+    else
+    {
+      int c;
+      c = get_byte(&cm->e_ctx);
+
+      if (c == 0) { c = get_byte(&cm->e_ctx); }
 
-    uint8_t marker = get_byte(cm->e_ctx.fp);
+      if (c != JPEG_DEF_MARKER)
+      {
+        fprintf(stderr, "Expected marker.\n");
+        exit(EXIT_FAILURE);
+      }
+
+      marker = get_byte(&cm->e_ctx);
+    }
 
     if (marker == JPEG_DQT_MARKER)
     {
@@ -403,33 +431,605 @@ int parse_c63_frame(struct c63_common *cm)
   return 1;
 }
 
+/*
+*   Y4M output, the stream header goes before the first frame. c63 does not
+*   record a frame rate, so Y4M_FPS is assumed.
+*/
+#define Y4M_FPS "30:1"
+
+static int y4m = 0;
+static int y4m_header_written = 0;
+
+static void write_y4m_frame_header(int width, int height, FILE *fout)
+{
+  if (!y4m_header_written)
+  {
+    fprintf(fout, "YUV4MPEG2 W%d H%d F" Y4M_FPS " Ip A1:1 C420jpeg\n",
+            width, height);
+    y4m_header_written = 1;
+  }
+
+  fputs("FRAME\n", fout);
+}
+
+/* The image of the decoded frame that is written, and its row strides */
+static yuv_t *output_image(struct c63_common *cm, uint32_t *stride)
+{
+  int c;
+
+#ifndef C63_PRED
+  /* Write result */
+  for (c = 0; c < COLOR_COMPONENTS; ++c) { stride[c] = REF_STRIDE(cm, c); }
+  return cm->curframe->recons;
+#else
+  /* To dump the predicted frames, use this instead */
+  for (c = 0; c < COLOR_COMPONENTS; ++c) { stride[c] = cm->padw[c]; }
+  return cm->curframe->predicted;
+#endif
+}
+
+/* Decode the parsed frame, and write it to fout unless that is NULL */
 void decode_c63_frame(struct c63_common *cm, FILE *fout)
 {
+  uint32_t stride[COLOR_COMPONENTS];
+  yuv_t *image;
+
   /* Motion Compensation */
   if (!cm->curframe->keyframe) { c63_motion_compensate(cm); }
 
   /* Decode residuals */
   dequantize_idct(cm->curframe->residuals->Ydct, cm->curframe->predicted->Y,
-      cm->ypw, cm->yph, cm->curframe->recons->Y, cm->quanttbl[0]);
+      cm->ypw, cm->yph, cm->curframe->recons->Y, REF_STRIDE(cm, Y_COMPONENT),
+      cm->quanttbl[0]);
   dequantize_idct(cm->curframe->residuals->Udct, cm->curframe->predicted->U,
-      cm->upw, cm->uph, cm->curframe->recons->U, cm->quanttbl[1]);
+      cm->upw, cm->uph, cm->curframe->recons->U, REF_STRIDE(cm, U_COMPONENT),
+      cm->quanttbl[1]);
   dequantize_idct(cm->curframe->residuals->Vdct, cm->curframe->predicted->V,
-      cm->vpw, cm->vph, cm->curframe->recons->V, cm->quanttbl[2]);
-
-#ifndef C63_PRED
-  /* Write result */
-  dump_image(cm->curframe->recons, cm->width, cm->height, fout);
-#else
-  /* To dump the predicted frames, use this instead */
-  dump_image(cm->curframe->predicted, cm->width, cm->height, fout);
-#endif
+      cm->vpw, cm->vph, cm->curframe->recons->V, REF_STRIDE(cm, V_COMPONENT),
+      cm->quanttbl[2]);
 
   ++cm->framenum;
+
+  if (!fout) { return; }
+
+  if (y4m) { write_y4m_frame_header(cm->width, cm->height, fout); }
+
+  image = output_image(cm, stride);
+  dump_image(image, stride, cm->width, cm->height, fout);
+}
+
+/*
+*   The frame index of input, from its sidecar file, or scanned and saved
+*   there for the next time when there is none or it is stale.
+*/
+static void get_index(struct c63_index *idx, struct entropy_ctx *c,
+    const char *input, FILE *log)
+{
+  char *path = index_path(input);
+
+  if (!c->in_map_size)
+  {
+    fprintf(stderr, "Indexing and seeking need an input file\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (index_load(idx, path, c->in_fd) == 0)
+  {
+    free(path);
+    return;
+  }
+
+  if (index_scan(idx, c->in_buf, c->in_map_size) < 0)
+  {
+    fprintf(stderr, "No frames found in %s\n", input);
+    exit(EXIT_FAILURE);
+  }
+
+  fprintf(log, "Indexed %u frames\n", idx->frames);
+
+  if (index_save(idx, path, c->in_fd) < 0)
+  {
+    fprintf(stderr, "Could not write index %s\n", path);
+  }
+
+  free(path);
+}
+
+/*
+*   Parallel decoding, c63dec -j. A keyframe resets prediction, so every
+*   GOP decodes on its own. Threads take the GOPs in order, each with its
+*   own c63_common reading the shared mapping of the input, and put the
+*   frames into a reorder ring of REORDER_FRAMES slots per thread, which the
+*   main thread writes out in order. Frame f goes to slot f % nslots once
+*   frame f - nslots is written, so the thread with the next frame to be
+*   written always has room for it.
+*/
+#define REORDER_FRAMES 4
+#define MAX_THREADS 64
+
+struct parallel_decode
+{
+  const struct entropy_ctx *input;
+  const struct c63_index *idx;
+  uint32_t start;             // first frame written
+  uint32_t next_gop;          // first frame of the GOP taken next
+
+  uint32_t nslots;
+  uint8_t **slot;             // decoded frames, allocated as needed
+  int *ready;                 // the slot holds its frame
+  uint32_t next_out;          // next frame written
+  int width;
+  int height;
+  size_t frame_size;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+/* Put decoded frame f into its slot of the reorder ring */
+static void put_reorder_frame(struct parallel_decode *pd,
+    struct c63_common *cm, uint32_t f)
+{
+  uint32_t s = f % pd->nslots;
+  size_t ysize = cm->width * cm->height;
+  uint32_t stride[COLOR_COMPONENTS];
+  yuv_t *image = output_image(cm, stride);
+
+  pthread_mutex_lock(&pd->lock);
+  while (f >= pd->next_out + pd->nslots)
+  {
+    pthread_cond_wait(&pd->cond, &pd->lock);
+  }
+
+  if (!pd->slot[s])
+  {
+    pd->width = cm->width;
+    pd->height = cm->height;
+    pd->frame_size = ysize + 2 * (ysize / 4);
+    pd->slot[s] = malloc(pd->frame_size);
+    if (!pd->slot[s])
+    {
+      perror("malloc");
+      exit(EXIT_FAILURE);
+    }
+  }
+  pthread_mutex_unlock(&pd->lock);
+
+  pack_image(image, stride, cm->width, cm->height, pd->slot[s]);
+
+  pthread_mutex_lock(&pd->lock);
+  pd->ready[s] = 1;
+  pthread_cond_broadcast(&pd->cond);
+  pthread_mutex_unlock(&pd->lock);
+}
+
+static void *decode_gops(void *arg)
+{
+  struct parallel_decode *pd = arg;
+  const struct c63_index *idx = pd->idx;
+  struct c63_common *cm = calloc(1, sizeof(*cm));
+
+  if (!cm)
+  {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  pthread_mutex_lock(&pd->lock);
+  while (pd->next_gop < idx->frames)
+  {
+    uint32_t first = pd->next_gop;
+    uint32_t end = first + 1;
+    uint32_t f;
+
+    while (end < idx->frames && !idx->entries[end].keyframe) { ++end; }
+    pd->next_gop = end;
+    pthread_mutex_unlock(&pd->lock);
+
+    // a reader of its own over the mapping, which stays the main thread's
+    cm->e_ctx = *pd->input;
+    seek_input(&cm->e_ctx, idx->entries[first].offset);
+
+    for (f = first; f < end; ++f)
+    {
+      parse_c63_frame(cm);
+      decode_c63_frame(cm, NULL);
+
+      if (f >= pd->start) { put_reorder_frame(pd, cm, f); }
+    }
+
+    pthread_mutex_lock(&pd->lock);
+  }
+  pthread_mutex_unlock(&pd->lock);
+
+  destroy_frame(cm->refframe);
+  destroy_frame(cm->curframe);
+  free(cm);
+
+  return NULL;
+}
+
+/* Decode the frames from start on with nthreads threads, and write them */
+static void decode_parallel(struct entropy_ctx *input,
+    const struct c63_index *idx, uint32_t start, int nthreads, FILE *fout,
+    FILE *log)
+{
+  struct parallel_decode pd;
+  pthread_t thread[MAX_THREADS];
+  uint32_t f;
+  int i, err;
+
+  memset(&pd, 0, sizeof(pd));
+  pd.input = input;
+  pd.idx = idx;
+  pd.start = start;
+  pd.next_gop = index_keyframe_before(idx, start);
+  pd.next_out = start;
+  pd.nslots = REORDER_FRAMES * nthreads;
+  pd.slot = calloc(pd.nslots, sizeof(*pd.slot));
+  pd.ready = calloc(pd.nslots, sizeof(*pd.ready));
+
+  if (!pd.slot || !pd.ready)
+  {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  pthread_mutex_init(&pd.lock, NULL);
+  pthread_cond_init(&pd.cond, NULL);
+
+  for (i = 0; i < nthreads; ++i)
+  {
+    err = pthread_create(&thread[i], NULL, decode_gops, &pd);
+    if (err)
+    {
+      fprintf(stderr, "pthread_create: %s\n", strerror(err));
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  for (f = start; f < idx->frames; ++f)
+  {
+    uint32_t s = f % pd.nslots;
+
+    pthread_mutex_lock(&pd.lock);
+    while (!pd.ready[s]) { pthread_cond_wait(&pd.cond, &pd.lock); }
+    pthread_mutex_unlock(&pd.lock);
+
+    fprintf(log, "Decoding frame %u\n", f);
+
+    if (y4m) { write_y4m_frame_header(pd.width, pd.height, fout); }
+
+    write_bytes(fout, pd.slot[s], pd.frame_size);
+
+    pthread_mutex_lock(&pd.lock);
+    pd.ready[s] = 0;
+    ++pd.next_out;
+    pthread_cond_broadcast(&pd.cond);
+    pthread_mutex_unlock(&pd.lock);
+  }
+
+  for (i = 0; i < nthreads; ++i) { pthread_join(thread[i], NULL); }
+
+  pthread_mutex_destroy(&pd.lock);
+  pthread_cond_destroy(&pd.cond);
+
+  for (f = 0; f < pd.nslots; ++f) { free(pd.slot[f]); }
+  free(pd.slot);
+  free(pd.ready);
+}
+
+/*
+*   Pipelined decoding, c63dec -p. An entropy decode thread parses frame
+*   N + 1 while frame N is reconstructed. It hands the parsed frames over
+*   through a single producer, single consumer ring of PIPELINE_DEPTH frames
+*   that takes no lock, only the acquire and release of its head and tail.
+*   The main thread then reconstructs each frame on a pool of threads, one
+*   MCU row at a time, and writes it. A frame stays the reference of the
+*   next one, and is freed after that.
+*/
+#define PIPELINE_DEPTH 4
+#define PIPELINE_SPIN 1024
+
+struct pipeline_frame
+{
+  struct frame *frame;
+  uint8_t quanttbl[COLOR_COMPONENTS][64];
+};
+
+struct pipeline
+{
+  struct c63_common *cm;      // of the entropy decode thread
+
+  struct pipeline_frame ring[PIPELINE_DEPTH];
+  uint32_t head;              // next frame taken, by the main thread
+  uint32_t tail;              // next frame put, by the entropy decode thread
+  int done;                   // no more frames are put
+};
+
+/* Wait for the other end of the ring, spinning a while before yielding */
+static void pipeline_wait(unsigned int *polls)
+{
+  if (++*polls > PIPELINE_SPIN) { sched_yield(); }
+}
+
+static void *entropy_decode(void *arg)
+{
+  struct pipeline *p = arg;
+  struct c63_common *cm = p->cm;
+  uint32_t tail = 0;
+
+  while (!end_of_input(&cm->e_ctx))
+  {
+    struct pipeline_frame *pf = &p->ring[tail % PIPELINE_DEPTH];
+    unsigned int polls = 0;
+
+    parse_c63_frame(cm);
+
+    while (tail - __atomic_load_n(&p->head, __ATOMIC_ACQUIRE) ==
+           PIPELINE_DEPTH)
+    {
+      pipeline_wait(&polls);
+    }
+
+    // the frame is the main thread's now, parse_sof0() makes the next one
+    pf->frame = cm->curframe;
+    memcpy(pf->quanttbl, cm->quanttbl, sizeof(pf->quanttbl));
+    cm->curframe = NULL;
+
+    __atomic_store_n(&p->tail, ++tail, __ATOMIC_RELEASE);
+  }
+
+  __atomic_store_n(&p->done, 1, __ATOMIC_RELEASE);
+
+  return NULL;
+}
+
+/*
+*   Threads reconstructing a frame, cm holds it and its reference. The MCU
+*   rows, bands, are taken from next_band. A thread that was late to the
+*   previous frame may take a band of the next one, which the release of
+*   next_band makes safe, and it counts it for that frame.
+*/
+struct recon_pool
+{
+  struct c63_common *cm;
+  const struct pipeline_frame *pf;
+  uint32_t bands;
+  uint32_t next_band;
+  uint32_t bands_done;
+  uint64_t generation;        // of the frame, the workers wait for a new one
+  int quit;
+
+  int nthreads;
+  pthread_t thread[MAX_THREADS];
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+static void reconstruct_band(struct recon_pool *rp, uint32_t band)
+{
+  struct c63_common *cm = rp->cm;
+  const struct pipeline_frame *pf = rp->pf;
+  struct frame *f = cm->curframe;
+  int top = 2 * band;
+  int bottom = MIN(top + 2, cm->mb_rows);
+
+  if (!f->keyframe) { c63_motion_compensate_rows(cm, top, bottom); }
+
+  dequantize_idct_rows(f->residuals->Ydct, f->predicted->Y, cm->ypw, cm->yph,
+      top * 8, bottom * 8, f->recons->Y, REF_STRIDE(cm, Y_COMPONENT),
+      (uint8_t *)pf->quanttbl[0]);
+  dequantize_idct_rows(f->residuals->Udct, f->predicted->U, cm->upw, cm->uph,
+      top * 4, bottom * 4, f->recons->U, REF_STRIDE(cm, U_COMPONENT),
+      (uint8_t *)pf->quanttbl[1]);
+  dequantize_idct_rows(f->residuals->Vdct, f->predicted->V, cm->vpw, cm->vph,
+      top * 4, bottom * 4, f->recons->V, REF_STRIDE(cm, V_COMPONENT),
+      (uint8_t *)pf->quanttbl[2]);
+}
+
+static void run_bands(struct recon_pool *rp)
+{
+  uint32_t band, n = 0;
+
+  while ((band = __atomic_fetch_add(&rp->next_band, 1, __ATOMIC_ACQUIRE)) <
+         rp->bands)
+  {
+    reconstruct_band(rp, band);
+    ++n;
+  }
+
+  if (n == 0) { return; }
+
+  pthread_mutex_lock(&rp->lock);
+  rp->bands_done += n;
+  if (rp->bands_done == rp->bands) { pthread_cond_broadcast(&rp->cond); }
+  pthread_mutex_unlock(&rp->lock);
+}
+
+static void *reconstruct_rows(void *arg)
+{
+  struct recon_pool *rp = arg;
+  uint64_t seen = 0;
+
+  pthread_mutex_lock(&rp->lock);
+  while (!rp->quit)
+  {
+    if (rp->generation == seen)
+    {
+      pthread_cond_wait(&rp->cond, &rp->lock);
+      continue;
+    }
+
+    seen = rp->generation;
+    pthread_mutex_unlock(&rp->lock);
+
+    run_bands(rp);
+
+    pthread_mutex_lock(&rp->lock);
+  }
+  pthread_mutex_unlock(&rp->lock);
+
+  return NULL;
+}
+
+/* Reconstruct the frame of pf with cm->refframe as its reference */
+static void reconstruct_frame(struct recon_pool *rp,
+    const struct pipeline_frame *pf)
+{
+  // the bands share the border of the reference, see extend_frame()
+  if (!pf->frame->keyframe) { extend_frame(rp->cm, rp->cm->refframe); }
+
+  pthread_mutex_lock(&rp->lock);
+  rp->cm->curframe = pf->frame;
+  rp->pf = pf;
+  rp->bands = rp->cm->mb_rows / 2;
+  rp->bands_done = 0;
+  __atomic_store_n(&rp->next_band, 0, __ATOMIC_RELEASE);
+  ++rp->generation;
+  pthread_cond_broadcast(&rp->cond);
+  pthread_mutex_unlock(&rp->lock);
+
+  run_bands(rp);
+
+  pthread_mutex_lock(&rp->lock);
+  while (rp->bands_done < rp->bands)
+  {
+    pthread_cond_wait(&rp->cond, &rp->lock);
+  }
+  pthread_mutex_unlock(&rp->lock);
+}
+
+/*
+*   Decode the frames of cm from framenum on, and write those from start on,
+*   with the entropy decode thread and nthreads threads reconstructing,
+*   counting the main thread
+*/
+static void decode_pipelined(struct c63_common *cm, uint32_t framenum,
+    uint32_t start, int nthreads, FILE *fout, FILE *log)
+{
+  struct pipeline p;
+  struct recon_pool rp;
+  struct c63_common *rcm = calloc(1, sizeof(*rcm));
+  pthread_t parser;
+  uint32_t head = 0;
+  int i, err;
+
+  if (!rcm)
+  {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  memset(&p, 0, sizeof(p));
+  p.cm = cm;
+
+  memset(&rp, 0, sizeof(rp));
+  rp.cm = rcm;
+  rp.nthreads = nthreads - 1;
+  pthread_mutex_init(&rp.lock, NULL);
+  pthread_cond_init(&rp.cond, NULL);
+
+  err = pthread_create(&parser, NULL, entropy_decode, &p);
+  for (i = 0; !err && i < rp.nthreads; ++i)
+  {
+    err = pthread_create(&rp.thread[i], NULL, reconstruct_rows, &rp);
+  }
+  if (err)
+  {
+    fprintf(stderr, "pthread_create: %s\n", strerror(err));
+    exit(EXIT_FAILURE);
+  }
+
+  while (1)
+  {
+    struct pipeline_frame *pf = &p.ring[head % PIPELINE_DEPTH];
+    unsigned int polls = 0;
+
+    while (__atomic_load_n(&p.tail, __ATOMIC_ACQUIRE) == head)
+    {
+      if (__atomic_load_n(&p.done, __ATOMIC_ACQUIRE) &&
+          __atomic_load_n(&p.tail, __ATOMIC_ACQUIRE) == head)
+      {
+        break;
+      }
+      pipeline_wait(&polls);
+    }
+    if (__atomic_load_n(&p.tail, __ATOMIC_ACQUIRE) == head) { break; }
+
+    if (head == 0)
+    {
+      // the dimensions are set by the first frame and stay
+      rcm->width = cm->width;
+      rcm->height = cm->height;
+      rcm->ypw = cm->ypw;
+      rcm->yph = cm->yph;
+      rcm->upw = cm->upw;
+      rcm->uph = cm->uph;
+      rcm->vpw = cm->vpw;
+      rcm->vph = cm->vph;
+      memcpy(rcm->padw, cm->padw, sizeof(rcm->padw));
+      memcpy(rcm->padh, cm->padh, sizeof(rcm->padh));
+      rcm->mb_cols = cm->mb_cols;
+      rcm->mb_rows = cm->mb_rows;
+    }
+
+    fprintf(log, "Decoding frame %u\n", framenum);
+
+    reconstruct_frame(&rp, pf);
+
+    if (framenum >= start)
+    {
+      uint32_t stride[COLOR_COMPONENTS];
+      yuv_t *image = output_image(rcm, stride);
+
+      if (y4m) { write_y4m_frame_header(rcm->width, rcm->height, fout); }
+
+      dump_image(image, stride, rcm->width, rcm->height, fout);
+    }
+
+    destroy_frame(rcm->refframe);
+    rcm->refframe = rcm->curframe;
+    rcm->curframe = NULL;
+
+    __atomic_store_n(&p.head, ++head, __ATOMIC_RELEASE);
+    ++framenum;
+  }
+
+  pthread_join(parser, NULL);
+
+  pthread_mutex_lock(&rp.lock);
+  rp.quit = 1;
+  pthread_cond_broadcast(&rp.cond);
+  pthread_mutex_unlock(&rp.lock);
+
+  for (i = 0; i < rp.nthreads; ++i) { pthread_join(rp.thread[i], NULL); }
+
+  pthread_mutex_destroy(&rp.lock);
+  pthread_cond_destroy(&rp.cond);
+
+  destroy_frame(rcm->refframe);
+  free(rcm);
 }
 
-static void print_help(int argc, char **argv)
+static void print_help(char **argv)
 {
-  printf("Usage: %s input.c63 output.yuv\n\n", argv[0]);
+  printf("Usage: %s [-y] [-s frame] input.c63 output.yuv\n", argv[0]);
+  printf("       %s -i input.c63\n\n", argv[0]);
+  printf("Commandline options:\n");
+  printf("  [-y]                           Write Y4M instead of raw YUV, the "
+         "default for output.y4m\n");
+  printf("  [-s]                           Start output at this frame, "
+         "decoding from the keyframe before it\n");
+  printf("  [-j]                           Decode GOPs on this many threads "
+         "(1-%d, default: 1)\n", MAX_THREADS);
+  printf("  [-p]                           Entropy decode on a thread of its "
+         "own, reconstructing on this many threads (1-%d), not with -j\n",
+         MAX_THREADS);
+  printf("  [-i]                           Only write the frame index, "
+         "input.c63" INDEX_SUFFIX "\n");
+  printf("A file name of - reads standard input or writes standard "
+         "output.\n\n");
   printf("Tip! Use mplayer to playback raw YUV file:\n");
   printf("mplayer -demuxer rawvideo -rawvideo w=352:h=288 foreman.yuv\n\n");
   exit(EXIT_FAILURE);
@@ -437,30 +1037,133 @@ static void print_help(int argc, char **argv)
 
 int main(int argc, char **argv)
 {
-  if(argc < 3 || argc > 3) { print_help(argc, argv); }
+  int c;
+  int index_only = 0;
+  uint32_t start = 0;
+  int nthreads = 1;
+  int recon_threads = 0;
 
-  FILE *fin = fopen(argv[1], "rb");
-  FILE *fout = fopen(argv[2], "wb");
+  while ((c = getopt(argc, argv, "yis:j:p:")) != -1)
+  {
+    switch (c)
+    {
+      case 'y':
+        y4m = 1;
+        break;
+      case 'i':
+        index_only = 1;
+        break;
+      case 's':
+        start = atoi(optarg);
+        break;
+      case 'j':
+        nthreads = atoi(optarg);
+        break;
+      case 'p':
+        recon_threads = atoi(optarg);
+        break;
+      default:
+        print_help(argv);
+        break;
+    }
+  }
 
-  if (!fin || !fout)
+  if (argc - optind != (index_only ? 1 : 2)) { print_help(argv); }
+  if (nthreads < 1 || nthreads > MAX_THREADS) { print_help(argv); }
+  if (recon_threads < 0 || recon_threads > MAX_THREADS) { print_help(argv); }
+  if (recon_threads && nthreads > 1) { print_help(argv); }
+
+  const char *input = argv[optind];
+  int fin = strcmp(input, "-") == 0 ? STDIN_FILENO : open(input, O_RDONLY);
+
+  if (fin < 0)
   {
-    perror("fopen");
+    perror("open");
     exit(EXIT_FAILURE);
   }
 
   struct c63_common *cm = calloc(1, sizeof(*cm));
-  cm->e_ctx.fp = fin;
+  open_input(&cm->e_ctx, fin);
+
+  if (index_only)
+  {
+    struct c63_index idx;
+
+    get_index(&idx, &cm->e_ctx, input, stdout);
+    index_free(&idx);
+    close_input(&cm->e_ctx);
+
+    return 0;
+  }
+
+  const char *output = argv[optind + 1];
+  size_t len = strlen(output);
+
+  if (len > 4 && strcmp(output + len - 4, ".y4m") == 0) { y4m = 1; }
+
+  FILE *fout = strcmp(output, "-") == 0 ? stdout : fopen(output, "wb");
+
+  if (!fout)
+  {
+    perror("fopen");
+    exit(EXIT_FAILURE);
+  }
+
+  // progress goes to stderr when the frames go to stdout
+  FILE *log = fout == stdout ? stderr : stdout;
+
+  uint32_t framenum = 0;
+
+  init_vlc_luts();
+
+  if (start > 0 || nthreads > 1)
+  {
+    struct c63_index idx;
+
+    get_index(&idx, &cm->e_ctx, input, log);
+
+    if (start >= idx.frames)
+    {
+      fprintf(stderr, "The input has %u frames\n", idx.frames);
+      exit(EXIT_FAILURE);
+    }
+
+    if (nthreads > 1)
+    {
+      decode_parallel(&cm->e_ctx, &idx, start, nthreads, fout, log);
+
+      index_free(&idx);
+      close_input(&cm->e_ctx);
+      fclose(fout);
+
+      return 0;
+    }
+
+    framenum = index_keyframe_before(&idx, start);
+    seek_input(&cm->e_ctx, idx.entries[framenum].offset);
+    index_free(&idx);
+  }
+
+  if (recon_threads)
+  {
+    decode_pipelined(cm, framenum, start, recon_threads, fout, log);
+
+    close_input(&cm->e_ctx);
+    fclose(fout);
+
+    return 0;
+  }
 
-  int framenum = 0;
-  while(!feof(fin))
+  while(!end_of_input(&cm->e_ctx))
   {
-    printf("Decoding frame %d\n", framenum++);
+    fprintf(log, "Decoding frame %u\n", framenum);
 
     parse_c63_frame(cm);
-    decode_c63_frame(cm, fout);
+    decode_c63_frame(cm, framenum >= start ? fout : NULL);
+    ++framenum;
   }
 
-  fclose(fin);
+  close_input(&cm->e_ctx);
   fclose(fout);
 
   return 0;
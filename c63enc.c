@@ -1,3 +1,5 @@
+#define _POSIX_C_SOURCE 200809L   // open_memstream(), clock_gettime()
+
 #include <assert.h>
 #include <errno.h>
 #include <getopt.h>
@@ -7,79 +9,81 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
-#include <sisci_error.h>
-#include <sisci_api.h>
+#include <time.h>
 
 #include "c63.h"
 #include "c63_write.h"
+#include "doorbell.h"
+#include "encode.h"
+#include "input.h"
+#include "io.h"
+#include "me.h"
+#include "segment.h"
 #include "sisci_variables.h"
 #include "tables.h"
+#include "transport.h"
 
 
 static char *output_file, *input_file;
 FILE *outfile;
 
 static int limit_numframes = 0;
+static int ring_depth = 0;           // 0 picks it from the batch size
+static enum result_format result_format = RESULT_RESIDUALS;
+static int spin_budget = DOORBELL_DEFAULT_SPIN;
+static enum transport_kind transport_kind = TRANSPORT_DEFAULT;
+static enum me_mode me_mode = ME_FULL;
+static int me_range = 16;            // pixels in every direction
+static int me_in_frame = 0;          // for decoders without the border
+
+/*
+*   Split mode, the client encodes the top client_share percent of each
+*   frame itself. The split moves at most SPLIT_STEP luma rows a frame, so
+*   split_halo rows next to it are all motion estimation on either side
+*   needs of the other side's reconstruction.
+*/
+#define SPLIT_STEP 16
+static int client_share = 0;
+static uint32_t split_halo = 0;
+
+/*
+*   MCU rows per band when the server streams dense results, so frames are
+*   entropy coded while their lower rows are still being encoded. 0 sends
+*   whole frames, -1 picks BAND_DEFAULT_ROWS where streaming applies.
+*/
+#define BAND_DEFAULT_ROWS 4
+static int band_rows = -1;
+
+/*
+*   Frames per transfer, 0 picks as many as fit in BATCH_TARGET_SIZE bytes
+*   of images so small frames do not pay the DMA and doorbell cost one by
+*   one. Large frames stream their results in bands instead.
+*/
+#define BATCH_TARGET_SIZE (1 << 20)
+static int batch = 0;
 
 static uint32_t width;
 static uint32_t height;
-static uint32_t remote_node = 0;
+static unsigned int remote_nodes[MAX_SERVERS];
+static int nservers = 0;
+
+// wire layout of the image and result segments, see segment.h
+static struct image_segment_header image_layout;
+static struct result_segment_header result_layout;
+
+// frames in the input, known once the end is read
+static uint32_t input_frames = UINT32_MAX;
 
 /* getopt */
 extern int optind;
 extern char *optarg;
 
-/* Read planar YUV frames with 4:2:0 chroma sub-sampling */
-static yuv_t* read_yuv(FILE *file, struct c63_common *cm)
+static double now(void)
 {
-  size_t len = 0;
-  yuv_t *image = malloc(sizeof(*image));
-
-  /* Read Y. The size of Y is the same as the size of the image. The indices
-     represents the color component (0 is Y, 1 is U, and 2 is V) */
-  image->Y = calloc(1, cm->padw[Y_COMPONENT]*cm->padh[Y_COMPONENT]);
-  len += fread(image->Y, 1, width*height, file);
-
-
-  /* Read U. Given 4:2:0 chroma sub-sampling, the size is 1/4 of Y
-     because (height/2)*(width/2) = (height*width)/4. */
-  image->U = calloc(1, cm->padw[U_COMPONENT]*cm->padh[U_COMPONENT]);
-  len += fread(image->U, 1, (width*height)/4, file);
-
-  /* Read V. Given 4:2:0 chroma sub-sampling, the size is 1/4 of Y. */
-  image->V = calloc(1, cm->padw[V_COMPONENT]*cm->padh[V_COMPONENT]);
-  len += fread(image->V, 1, (width*height)/4, file);
-
-  if (ferror(file))
-  {
-    perror("ferror");
-    exit(EXIT_FAILURE);
-  }
-
-  if (feof(file))
-  {
-    free(image->Y);
-    free(image->U);
-    free(image->V);
-    free(image);
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
 
-    return NULL;
-  }
-  else if (len != width*height*1.5)
-  {
-    fprintf(stderr, "Reached end of file, but incorrect bytes read.\n");
-    fprintf(stderr, "Wrong input? (height: %d width: %d)\n", height, width);
-
-    free(image->Y);
-    free(image->U);
-    free(image->V);
-    free(image);
-
-    return NULL;
-  }
-
-  return image;
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
 }
 
 struct c63_common* init_c63_enc(int width, int height)
@@ -120,494 +124,1133 @@ struct c63_common* init_c63_enc(int width, int height)
   return cm;
 }
 
-static void print_help()
-{
-  printf("Usage: ./c63enc [options] input_file\n");
-  printf("Commandline options:\n");
-  printf("  -h                             Height of images to compress\n");
-  printf("  -w                             Width of images to compress\n");
-  printf("  -o                             Output file (.c63)\n");
-  printf("  -r                             Node id of server\n");
-  printf("  [-f]                           Limit number of frames to encode\n");
-  printf("\n");
-
-  exit(EXIT_FAILURE);
-}
-
-
-int main(int argc, char **argv)
+/*
+*   A server and the state of its rings. Server i of the -r list uses
+*   channel i, see CHANNEL_ID in sisci_variables.h. It is handed whole GOPs,
+*   which it encodes without reference to any other GOP.
+*/
+struct server
 {
+  unsigned int node;
+  int channel;
 
-  yuv_t *image;
-
-  // Sisci variables
-  unsigned int localAdapterNo = 0;
-  sci_error_t error;
-  sci_desc_t sd;
-  size_t local_offset = 0;
-  size_t remote_offset = 0;
-  sci_dma_queue_t	dq;           // DMA queue used to transfer image data
-  unsigned int max_entries = 1; // max entries inside dma queue
+  // transport to the server, see transport.h
+  struct transport transport;
+  struct doorbell_peer doorbell;
 
-  // segments used to transfer image y, u, v from client
-  sci_remote_segment_t remoteSegment;
-  sci_local_segment_t localSegment;
-  sci_map_t localMap;
+  // segments used to transfer image y, u, v to the server
+  struct transport_remote remoteSegment;
+  struct transport_segment localSegment;
 
   // Client server communication
-  sci_remote_segment_t remoteSegment_comms;
-  sci_local_segment_t localSegment_comms;
-  sci_map_t localMap_comms;
-  sci_map_t remoteMap_comms;
+  struct transport_remote remoteSegment_comms;
+  struct transport_segment localSegment_comms;
 
+  // Segment used to transefer results to client ydct,udct,vdtc and macroblock
+  struct transport_segment result_localSegment;
 
   // struct comms defined in sisci_variables.h
-  // comms contain cmd used to communicate and height/width parameters
   volatile struct comms *remote_comms;
   volatile struct comms *local_comms;
 
-  // Segment used to transefer results to client ydct,udct,vdtc and macroblock
-  sci_local_segment_t result_localSegment;
-  sci_remote_segment_t result_remoteSegment;
-  sci_map_t result_localMap;
+  // local segment for image data and encoding results
+  volatile struct image_segment_header *local_seg;
+  volatile struct result_segment_header *result_local_seg;
 
+  // the image ring of the server if the transport maps it, see main()
+  volatile void *remote_images;
 
-  int c;
-  if (argc == 1) { print_help(); }
+  int gop;                  // GOP being shipped, -1 if none
+  uint32_t next_frame;      // next frame of the input to ship
+  uint32_t gop_end;         // one past the last frame of the GOP
+
+  // frames shipped to and written from this server, counted like its rings
+  uint32_t sent;
+  uint32_t written;
+
+  // frames written to the ring but not shipped yet, see server_flush()
+  int staged;
+
+  // GOP and input frame of the frame in flight in each ring slot
+  int slot_gop[RING_MAX_DEPTH];
+  uint32_t slot_frame[RING_MAX_DEPTH];
 
-  while ((c = getopt(argc, argv, "h:w:o:f:i:r:")) != -1)
+  double encode_time;       // seconds the server took for the last frame
+
+  // writes the results of this server, frames of several servers can be
+  // partly written at the same time when results are streamed in bands
+  struct c63_common *writer;
+  uint32_t rows_written;    // MCU rows of the oldest frame written so far
+};
+
+/*
+*   Output of a GOP. The GOP that is next in the output file writes straight
+*   to it, GOPs encoded ahead of it are kept in memory until it is done.
+*/
+struct gop_output
+{
+  FILE *fp;
+  char *buf;
+  size_t size;
+  uint32_t sent;            // frames shipped
+  uint32_t written;         // frames written to fp
+  int closed;               // set when no more frames will be shipped
+};
+
+// allocated one by one, open_memstream() keeps pointers to buf and size
+static struct gop_output **gops = NULL;
+static int ngops = 0;
+static int next_output = 0;   // first GOP not completely in the output file
+
+static void gop_open(int gop)
+{
+  struct gop_output *g = calloc(1, sizeof(*g));
+
+  gops = realloc(gops, (gop + 1) * sizeof(*gops));
+  gops[gop] = g;
+  ngops = gop + 1;
+
+  if (gop == next_output)
   {
-    switch (c)
-    {
-      case 'h':
-        height = atoi(optarg);
-        break;
-      case 'w':
-        width = atoi(optarg);
-        break;
-      case 'o':
-        output_file = optarg;
-        break;
-      case 'f':
-        limit_numframes = atoi(optarg);
-        break;
-      case 'r':
-        remote_node = atoi(optarg);
-        break;
-      default:
-        print_help();
-        break;
-    }
+    g->fp = outfile;
+    return;
   }
 
-  if (optind >= argc)
+  g->fp = open_memstream(&g->buf, &g->size);
+  if (g->fp == NULL)
   {
-    fprintf(stderr, "Error getting program options, try --help.\n");
+    perror("open_memstream");
     exit(EXIT_FAILURE);
   }
+}
 
-  outfile = fopen(output_file, "wb");
-
-  if (outfile == NULL)
+/* Move finished GOPs to the output file, in order */
+static void gop_advance()
+{
+  while (next_output < ngops)
   {
-    perror("fopen output file");
-    exit(EXIT_FAILURE);
+    struct gop_output *g = gops[next_output];
+
+    // it is this GOP's turn, write what is buffered and go on directly
+    if (g->fp != outfile)
+    {
+      fclose(g->fp);
+      write_bytes(outfile, g->buf, g->size);
+      free(g->buf);
+      g->buf = NULL;
+      g->fp = outfile;
+    }
+
+    if (!g->closed || g->written != g->sent) { break; }
+
+    free(g);
+    gops[next_output++] = NULL;
   }
+}
 
-  struct c63_common *cm = init_c63_enc(width, height);
-  cm->e_ctx.fp = outfile;
+static void gop_close(int gop)
+{
+  gops[gop]->closed = 1;
+  gop_advance();
+}
 
-  input_file = argv[optind];
+static int server_can_ship(struct server *s)
+{
+  uint32_t next = s->sent + s->staged;
 
-  if (limit_numframes) { printf("Limited to %d frames.\n", limit_numframes); }
+  return s->gop >= 0 && next - s->written < (uint32_t)ring_depth &&
+         next - s->local_comms->ack < (uint32_t)ring_depth;
+}
 
-  FILE *infile = fopen(input_file, "rb");
+static int server_has_result(struct server *s)
+{
+  int slot = s->written % ring_depth;
 
-  if (infile == NULL)
+  if (band_rows)
   {
-    perror("fopen input file");
-    exit(EXIT_FAILURE);
+    // rows of the oldest frame that have not been written yet
+    uint32_t band_seq = s->local_comms->band_seq[slot];
+
+    return s->written != s->sent && BAND_SEQ_IS_FRAME(band_seq, s->written) &&
+           BAND_SEQ_ROWS(band_seq) > s->rows_written;
   }
 
+  return s->written != s->sent &&
+         s->local_comms->seq[slot] == s->written + 1;
+}
+
+/* Whether a server needs the client, the condition we wait for */
+static int servers_ready(struct server *servers, int nservers, int gops_left)
+{
+  int i;
+
+  for (i = 0; i < nservers; ++i)
+  {
+    if (server_can_ship(&servers[i]) || server_has_result(&servers[i]) ||
+        (servers[i].gop < 0 && gops_left))
+    {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+*   Create our segments for a server, connect to its segments and send the
+*   encoder parameters. The client doorbell must exist already.
+*/
+static void server_connect(struct server *s)
+{
+  int ch = s->channel;
+
   /*
-  *   struct image segment for transfering image data to tegra/server with DMA
+  *   create segment for pio communication comms
   */
-  volatile struct image_segment
+  s->local_comms =
+    transport_create_segment(&s->transport, &s->localSegment_comms,
+                             CHANNEL_ID(SEGMENT_CLIENT_COMMS, ch),
+                             sizeof(struct comms));
+
+  /*
+  * Connect to and map remote segment in tegra/server for pio communication
+  */
+  s->remote_comms =
+    transport_connect_segment(&s->transport, &s->remoteSegment_comms,
+                              CHANNEL_ID(SEGMENT_SERVER_COMMS, ch),
+                              sizeof(struct comms), 1);
+
+  doorbell_connect(&s->doorbell, &s->transport,
+                   CHANNEL_ID(INTERRUPT_SERVER, ch));
+
+  // no results published or input slots released yet
+  memset((void *)s->local_comms->seq, 0, sizeof(s->local_comms->seq));
+  memset((void *)s->local_comms->band_seq, 0,
+         sizeof(s->local_comms->band_seq));
+  s->local_comms->ack = 0;
+
+  /*
+  *   Send width, height and ring depth to tegra/server with comms
+  *   and set cmd to CMD_DONE to signal that it can stop waiting
+  */
+  s->local_comms->packet.width = width;
+  s->local_comms->packet.height = height;
+  s->local_comms->packet.depth = ring_depth;
+  s->local_comms->packet.format = result_format;
+  s->local_comms->packet.spin = spin_budget;
+  s->local_comms->packet.halo = split_halo;
+  s->local_comms->packet.band = band_rows;
+  s->local_comms->packet.batch = batch;
+  s->local_comms->packet.me_mode = me_mode;
+  s->local_comms->packet.me_range = me_range;
+  s->local_comms->packet.me_in_frame = me_in_frame;
+  s->local_comms->packet.cmd = CMD_DONE;
+  doorbell_ring(&s->doorbell);
+
+  /*
+  *   create local segment for image data and for encoding results. A batch
+  *   of images is staged in consecutive slots, the server DMAs results into
+  *   one slot per frame in flight.
+  */
+  s->local_seg =
+    transport_create_segment(&s->transport, &s->localSegment,
+                             CHANNEL_ID(SEGMENT_CLIENT, ch),
+                             SEGMENT_SLOT_OFFSET(image_layout.size, batch));
+  s->result_local_seg =
+    transport_create_segment(&s->transport, &s->result_localSegment,
+                             CHANNEL_ID(SEGMENT_CLIENT_RESULT, ch),
+                             SEGMENT_SLOT_OFFSET(result_layout.size,
+                                                 ring_depth));
+
+  /*
+  *   Connect remote segment for image data transfer to tegra/server. A
+  *   transport that maps it, like shm, lets us write frames straight into
+  *   the ring instead of staging them in local_seg for a DMA.
+  */
+  s->remote_images =
+    transport_connect_segment(&s->transport, &s->remoteSegment,
+                              CHANNEL_ID(SEGMENT_SERVER, ch),
+                              SEGMENT_SLOT_OFFSET(image_layout.size,
+                                                  ring_depth), 0);
+
+  s->gop = -1;
+}
+
+/*
+*   Ship the staged frames to the server, in one transfer to consecutive
+*   ring slots and with one doorbell
+*/
+static void server_flush(struct server *s)
+{
+  int first_slot = s->sent % ring_depth;
+  int i;
+
+  if (s->staged == 0) { return; }
+
+  /*
+  *   transfer image data from the local segment to the ring slots of
+  *   these frames in the remote segment
+  */
+  if (!s->remote_images)
   {
-    uint8_t *Y[cm->padw[Y_COMPONENT]*cm->padh[Y_COMPONENT]];
-    uint8_t *U[cm->padw[U_COMPONENT]*cm->padh[U_COMPONENT]];
-    uint8_t *V[cm->padw[V_COMPONENT]*cm->padh[V_COMPONENT]];
-  } *local_seg;
+    transport_copy(&s->transport, &s->localSegment, 0, &s->remoteSegment,
+                   SEGMENT_SLOT_OFFSET(image_layout.size, first_slot),
+                   SEGMENT_SLOT_OFFSET(image_layout.size, s->staged - 1) +
+                   image_layout.size);
+  }
 
   /*
-  *  struct result_segment for transfering encoding results back to x86/client
+  * signal to tegra/server that the slots hold the next frames
   */
-  volatile struct result_segment
+  for (i = 0; i < s->staged; ++i)
+  {
+    s->remote_comms->seq[(first_slot + i) % ring_depth] = s->sent + i + 1;
+  }
+  doorbell_ring(&s->doorbell);
+
+  s->sent += s->staged;
+  s->staged = 0;
+}
+
+/*
+*   The image segment slot the next frame of s is staged in, the ring slot
+*   itself when the transport maps it. image gets its planes.
+*/
+static volatile struct image_segment_header *server_slot(struct server *s,
+    yuv_t *image)
+{
+  int slot = (s->sent + s->staged) % ring_depth;
+
+  volatile struct image_segment_header *input =
+    SEGMENT_SLOT(s->local_seg, image_layout.size, s->staged);
+  if (s->remote_images)
   {
-    int keyframe;
+    input = SEGMENT_SLOT(s->remote_images, image_layout.size, slot);
+  }
+
+  image->Y = SEGMENT_PTR(input, image_layout.plane[Y_COMPONENT]);
+  image->U = SEGMENT_PTR(input, image_layout.plane[U_COMPONENT]);
+  image->V = SEGMENT_PTR(input, image_layout.plane[V_COMPONENT]);
+
+  return input;
+}
 
-    // macroblock
-    struct macroblock *mbs[COLOR_COMPONENTS][cm->mb_rows * cm->mb_cols];
+/*
+*   Stage the frame read into server_slot() for the next ring slot of s, and
+*   ship the batch once it is full or reaches the end of the ring. In split
+*   mode the header fields of image_layout say which rows of recons, the
+*   reconstruction of the previous frame, go along as the halo.
+*/
+static void server_send(struct server *s, struct c63_common *cm,
+    yuv_t *recons)
+{
+  int slot = (s->sent + s->staged) % ring_depth;
+  yuv_t image;
+
+  volatile struct image_segment_header *input = server_slot(s, &image);
+  memcpy((void *)input, &image_layout, sizeof(image_layout));
 
-    // residuals
-    int16_t *Ydct[cm->ypw * cm->yph];
-    int16_t *Udct[cm->upw * cm->uph];
-    int16_t *Vdct[cm->vpw * cm->vph];
-  } *result_local_seg;
+  if (recons && image_layout.halo_rows)
+  {
+    yuv_t halo = {
+      .Y = SEGMENT_PTR(input, image_layout.halo[Y_COMPONENT]),
+      .U = SEGMENT_PTR(input, image_layout.halo[U_COMPONENT]),
+      .V = SEGMENT_PTR(input, image_layout.halo[V_COMPONENT]),
+    };
+
+    c63_copy_rows(cm, &halo, 0, recons, image_layout.halo_top,
+                  image_layout.halo_rows, 0);
+  }
 
-  /* Initialize the SISCI library */
-  SCIInitialize(NO_FLAGS, &error);
-  if (error != SCI_ERR_OK) {
-      fprintf(stderr,"SCIInitialize failed: %s\n", SCIGetErrorString(error));
+  ++s->staged;
+  if (s->staged == batch || slot + 1 == ring_depth)
+  {
+    server_flush(s);
+  }
+}
+
+/*
+*   Read the next frame of the GOP of s and ship it, returns -1 at the end
+*   of the input
+*/
+static int server_ship(struct server *s, struct input *input,
+    struct c63_common *cm)
+{
+  uint32_t frame = s->next_frame;
+  int slot = (s->sent + s->staged) % ring_depth;
+  yuv_t image;
+
+  if (frame >= input_frames) { return -1; }
+
+  // read image straight into the slot it is shipped from
+  server_slot(s, &image);
+  if (input_read(input, cm, frame, &image) < 0)
+  {
+    input_frames = frame;
+    return -1;
+  }
+
+  s->slot_gop[slot] = s->gop;
+  s->slot_frame[slot] = frame;
+  ++gops[s->gop]->sent;
+  ++s->next_frame;
+
+  server_send(s, cm, NULL);
+
+  return 0;
+}
+
+/* Let the server reuse the result slot of the oldest frame */
+static void server_release(struct server *s)
+{
+  s->remote_comms->ack = ++s->written;
+  doorbell_ring(&s->doorbell);
+}
+
+/*
+*   Copy the macroblocks and residuals of luma rows top to bottom, and of the
+*   chroma rows they cover, from the dense result into the current frame
+*/
+static void result_rows(struct c63_common *cm,
+    volatile struct result_segment_header *result, uint32_t top,
+    uint32_t bottom)
+{
+  int16_t *dct[COLOR_COMPONENTS] = { cm->curframe->residuals->Ydct,
+                                     cm->curframe->residuals->Udct,
+                                     cm->curframe->residuals->Vdct };
+  int c;
+
+  for (c = 0; c < COLOR_COMPONENTS; ++c)
+  {
+    // rows of 8x8 blocks, a chroma row covers two luma rows
+    uint32_t first = top * cm->padh[c] / cm->padh[Y_COMPONENT] / 8;
+    uint32_t last = bottom * cm->padh[c] / cm->padh[Y_COMPONENT] / 8;
+    uint32_t cols = cm->padw[c] / 8;
+
+    memcpy(cm->curframe->mbs[c] + first * cols,
+           (struct macroblock *)SEGMENT_PTR(result, result_layout.mbs[c]) +
+           first * cols,
+           (last - first) * cols * sizeof(struct macroblock));
+    memcpy(dct[c] + first * cols * 64,
+           (int16_t *)SEGMENT_PTR(result, result_layout.dct[c]) +
+           first * cols * 64,
+           (last - first) * cols * 64 * sizeof(int16_t));
+  }
+}
+
+/*
+*   Write the MCU rows of the oldest frame of s that have landed since the
+*   last call, the header before the first and the trailer after the last
+*/
+static void server_collect_rows(struct server *s)
+{
+  int slot = s->written % ring_depth;
+  struct gop_output *g = gops[s->slot_gop[slot]];
+  struct c63_common *cm = s->writer;
+  uint32_t rows = BAND_SEQ_ROWS(s->local_comms->band_seq[slot]);
+
+  volatile struct result_segment_header *result =
+    SEGMENT_SLOT(s->result_local_seg, result_layout.size, slot);
+
+  // the GOP may have moved from its buffer to the output file since
+  cm->e_ctx.fp = g->fp;
+
+  if (s->rows_written == 0)
+  {
+    printf("Encoding frame %u, ", s->slot_frame[slot]);
+
+    if (result_segment_check(&result_layout, result) < 0)
+    {
       exit(EXIT_FAILURE);
+    }
+
+    cm->curframe->keyframe = result->keyframe;
+    write_frame_header(cm);
   }
 
-  /* Open a file descriptor */
-  SCIOpen(&sd,NO_FLAGS,&error);
-  if (error != SCI_ERR_OK) {
-     fprintf(stderr, "SCIOpen failed: %s (0x%x)\n",
-             SCIGetErrorString(error), error);
-     exit(error);
+  result_rows(cm, result, s->rows_written * 16, rows * 16);
+
+  if (rows == write_frame_mcu_rows(cm))
+  {
+    // the result slot is copied out
+    server_release(s);
   }
 
+  write_frame_rows(cm, s->rows_written, rows);
+  s->rows_written = rows;
+
+  if (rows < write_frame_mcu_rows(cm)) { return; }
+
+  write_frame_trailer(cm);
+  s->rows_written = 0;
 
+  ++g->written;
+  gop_advance();
+
+  printf("Done!\n");
+}
+
+/* Write the oldest result of s to the output of its GOP */
+static void server_collect(struct server *s)
+{
+  int slot = s->written % ring_depth;
+  struct gop_output *g = gops[s->slot_gop[slot]];
+  struct c63_common *cm = s->writer;
+  struct sparse_residuals sparse;
+
+  if (band_rows)
+  {
+    server_collect_rows(s);
+    return;
+  }
+
+  printf("Encoding frame %u, ", s->slot_frame[slot]);
+
+  volatile struct result_segment_header *result =
+    SEGMENT_SLOT(s->result_local_seg, result_layout.size, slot);
 
   /*
-  *   reate prepare and set available segment for pio communication comms.
+  *   use memcpy() to copy blocks of memory from local segments
+  *   that has recived encoding results from server through DMA transfer
   */
-  SCICreateSegment(sd,
-                   &localSegment_comms,
-                   SEGMENT_CLIENT_COMMS,
-                   sizeof(struct comms),
-                   NO_CALLBACK,
-                   NULL,
-                   NO_FLAGS,
-                   &error);
-   if(error != SCI_ERR_OK){
-     fprintf(stderr, "SCICreateSegment failed: %s - Error code: (0x%x)\n",
-             SCIGetErrorString(error), error);
-     exit(EXIT_FAILURE);
-   }
-
-  SCIPrepareSegment(localSegment_comms, localAdapterNo, NO_FLAGS, &error);
-  if(error != SCI_ERR_OK){
-    fprintf(stderr, "SCIPrepareSegment failed: %s - Error code: (0x%x)\n",
-            SCIGetErrorString(error), error);
+  if (result_segment_check(&result_layout, result) < 0)
+  {
     exit(EXIT_FAILURE);
   }
-  SCISetSegmentAvailable(localSegment_comms, localAdapterNo, NO_FLAGS, &error);
-  if(error != SCI_ERR_OK){
-    fprintf(stderr, "SCISetSegmentAvailable failed: %s - Error code: (0x%x)\n",
-            SCIGetErrorString(error), error);
-    exit(EXIT_FAILURE);
+
+  cm->e_ctx.fp = g->fp;
+
+  if (result_format == RESULT_BITSTREAM)
+  {
+    // the server has entropy coded the frame, append it to the output
+    write_bytes(g->fp, SEGMENT_PTR(result, result_layout.bitstream),
+                result->bitstream_size);
+    server_release(s);
   }
+  else
+  {
+    cm->curframe->keyframe = result->keyframe;
 
+    // macroblocks
+    memcpy( cm->curframe->mbs[Y_COMPONENT],
+            SEGMENT_PTR(result, result_layout.mbs[Y_COMPONENT]),
+            result_layout.mbs[Y_COMPONENT].size);
+    memcpy( cm->curframe->mbs[U_COMPONENT],
+            SEGMENT_PTR(result, result_layout.mbs[U_COMPONENT]),
+            result_layout.mbs[U_COMPONENT].size);
+    memcpy( cm->curframe->mbs[V_COMPONENT],
+            SEGMENT_PTR(result, result_layout.mbs[V_COMPONENT]),
+            result_layout.mbs[V_COMPONENT].size);
 
-  /*
-  * Connect to remote segment in tegra/server for pio communication comms.
-  */
-  do {
-      SCIConnectSegment(sd,
-                        &remoteSegment_comms,
-                        remote_node,
-                        SEGMENT_SERVER_COMMS,
-                        localAdapterNo,
-                        NO_CALLBACK,
-                        NULL,
-                        SCI_INFINITE_TIMEOUT,
-                        NO_FLAGS,
-                        &error);
-  } while (error != SCI_ERR_OK);
-  if(error != SCI_ERR_OK){
-    fprintf(stderr, " failed: %s - Error code: (0x%x)\n",
-            SCIGetErrorString(error), error);
-    exit(EXIT_FAILURE);
+    if (result_format == RESULT_SPARSE)
+    {
+      // write_frame() reads the sparse residuals in place
+      result_segment_sparse(result, &result_layout, &sparse);
+      sparse.ncoeffs = result->ncoeffs;
+      cm->curframe->sparse = &sparse;
+
+      // write_frame
+      write_frame(cm);
+      server_release(s);
+    }
+    else
+    {
+      // residuals
+      memcpy( cm->curframe->residuals->Ydct,
+              SEGMENT_PTR(result, result_layout.dct[Y_COMPONENT]),
+              result_layout.dct[Y_COMPONENT].size);
+      memcpy( cm->curframe->residuals->Udct,
+              SEGMENT_PTR(result, result_layout.dct[U_COMPONENT]),
+              result_layout.dct[U_COMPONENT].size);
+      memcpy( cm->curframe->residuals->Vdct,
+              SEGMENT_PTR(result, result_layout.dct[V_COMPONENT]),
+              result_layout.dct[V_COMPONENT].size);
+
+      // the result slot is copied out
+      server_release(s);
+
+      // write_frame
+      write_frame(cm);
+    }
   }
 
-  /*
-  *   map the local and remote segments for comms
-  */
-  local_comms = SCIMapLocalSegment(localSegment_comms,
-                                   &localMap_comms,
-                                    local_offset,
-                                    sizeof(struct comms),
-                                    NULL,
-                                    NO_FLAGS,
-                                      &error);
-  if(error != SCI_ERR_OK){
-    fprintf(stderr, " failed: %s - Error code: (0x%x)\n",
-            SCIGetErrorString(error), error);
+  ++g->written;
+  gop_advance();
+
+  printf("Done!\n");
+}
+
+/*
+*   Copy the server's band of the result in slot of s, macroblocks and
+*   residuals of the rows from split down and its reconstruction of the
+*   halo rows below split, into the frame we are encoding
+*/
+static void split_collect(struct server *s, struct c63_common *cm,
+    uint32_t split)
+{
+  int slot = s->written % ring_depth;
+
+  volatile struct result_segment_header *result =
+    SEGMENT_SLOT(s->result_local_seg, result_layout.size, slot);
+
+  if (result_segment_check(&result_layout, result) < 0)
+  {
     exit(EXIT_FAILURE);
   }
-  remote_comms = SCIMapRemoteSegment(remoteSegment_comms,
-                                      &remoteMap_comms,
-                                      remote_offset,
-                                      sizeof(struct comms),
-                                      NULL,
-                                      NO_FLAGS,
-                                      &error);
-  if(error != SCI_ERR_OK){
-    fprintf(stderr, " failed: %s - Error code: (0x%x)\n",
-            SCIGetErrorString(error), error);
+
+  if (result->split != split || result->halo_rows > split_halo ||
+      result->halo_rows > (uint32_t)cm->yph - split)
+  {
+    fprintf(stderr, "Result segment: split %u and halo %u, expected %u\n",
+            result->split, result->halo_rows, split);
     exit(EXIT_FAILURE);
   }
 
-  /*
-  *   Send width and hegith to tegra/server with comms
-  *   and set cmd to CMD_DONE to signal that it can stop waiting
-  */
-  local_comms->packet.width = width;
-  local_comms->packet.height = height;
-  local_comms->packet.cmd = CMD_DONE;
+  result_rows(cm, result, split, cm->yph);
+
+  yuv_t halo = {
+    .Y = SEGMENT_PTR(result, result_layout.halo[Y_COMPONENT]),
+    .U = SEGMENT_PTR(result, result_layout.halo[U_COMPONENT]),
+    .V = SEGMENT_PTR(result, result_layout.halo[V_COMPONENT]),
+  };
+
+  c63_copy_rows(cm, cm->curframe->recons, split, &halo, 0, result->halo_rows,
+                1);
+
+  s->encode_time = result->encode_time * 1e-6;
+
+  // the result slot is copied out
+  server_release(s);
+}
+
+/*
+*   Split mode, the client encodes the luma rows above split and the server
+*   the rest of every frame. Both need the other's reconstruction of the
+*   rows next to the split to search in for the next frame, so frames go
+*   strictly one at a time: our halo of frame n - 1 travels with image n
+*   and the server's halo of frame n with its result. After each frame the
+*   split is moved towards where both sides would take equally long.
+*/
+static void encode_split(struct server *s, struct doorbell *doorbell,
+    struct input *input, struct c63_common *cm)
+{
+  uint32_t yph = cm->yph;
+  uint32_t split = (yph * client_share / 100 + 8) / 16 * 16;
+  uint32_t prev_split = 0;
+  uint32_t n;
+
+  if (split < 16) { split = 16; }
+  if (split > yph - 16) { split = yph - 16; }
+
+  for (n = 0; n < input_frames; ++n)
+  {
+    yuv_t image;
+
+    // wait until the server has copied out the previous image
+    DOORBELL_WAIT(doorbell,
+                  s->sent - s->local_comms->ack < (uint32_t)ring_depth);
+
+    server_slot(s, &image);
+    if (input_read(input, cm, n, &image) < 0) { break; }
+
+    printf("Encoding frame %u, ", n);
+
+    // our reconstruction of the previous frame above its split
+    image_layout.split = split;
+    image_layout.halo_top = prev_split > split_halo ? prev_split - split_halo : 0;
+    image_layout.halo_rows = cm->curframe ? prev_split - image_layout.halo_top
+                                          : 0;
+    server_send(s, cm, cm->curframe ? cm->curframe->recons : NULL);
+
+    // encode our band while the server encodes its own, from the slot
+    double start = now();
+    c63_begin_frame(cm, &image, NULL, NULL, NULL);
+    c63_encode_rows(cm, 0, split);
+    double client_time = now() - start;
+
+    DOORBELL_WAIT(doorbell, server_has_result(s));
+    split_collect(s, cm, split);
+
+    // write_frame
+    write_frame(cm);
+    c63_end_frame(cm);
+
+    // the frame keeps its reconstruction, the slot is reused for the next
+    cm->curframe->orig = NULL;
 
     /*
-    *   create, prepare and set available local segment for image data
+    *   rows per second on each side give the split where both would finish
+    *   together, move there by at most SPLIT_STEP rows
     */
-  SCICreateSegment(sd,
-                   &localSegment,
-                   SEGMENT_CLIENT,
-                   sizeof(struct image_segment),
-                   NO_CALLBACK,
-                   NULL,
-                   NO_FLAGS,
-                   &error);
-  if(error != SCI_ERR_OK){
-   fprintf(stderr, "SCICreateSegment failed: %s - Error code: (0x%x)\n",
-           SCIGetErrorString(error), error);
-   exit(EXIT_FAILURE);
-  }
-
-  SCIPrepareSegment(localSegment, localAdapterNo, NO_FLAGS, &error);
-  if(error != SCI_ERR_OK){
-   fprintf(stderr, "SCIPrepareSegment failed: %s - Error code: (0x%x)\n",
-           SCIGetErrorString(error), error);
-   exit(EXIT_FAILURE);
-  }
-  SCISetSegmentAvailable(localSegment, localAdapterNo, NO_FLAGS, &error);
-  if(error != SCI_ERR_OK){
-   fprintf(stderr, "SCISetSegmentAvailable failed: %s - Error code: (0x%x)\n",
-           SCIGetErrorString(error), error);
-   exit(EXIT_FAILURE);
+    double client_rate = split / (client_time > 1e-6 ? client_time : 1e-6);
+    double server_rate = (yph - split) /
+      (s->encode_time > 1e-6 ? s->encode_time : 1e-6);
+    uint32_t target = (uint32_t)(yph * client_rate /
+                                 (client_rate + server_rate) + 8) / 16 * 16;
+
+    prev_split = split;
+    if (target > split + SPLIT_STEP) { target = split + SPLIT_STEP; }
+    if (target + SPLIT_STEP < split) { target = split - SPLIT_STEP; }
+    if (target < 16) { target = 16; }
+    if (target > yph - 16) { target = yph - 16; }
+    split = target;
+
+    printf("Done!\n");
+  }
+
+  printf("Split ended at row %u of %u\n", split, yph);
+}
+
+/*
+*   A copy of cm with a frame to receive results into, for c63_write
+*/
+static struct c63_common *create_writer(struct c63_common *cm)
+{
+  struct c63_common *w = malloc(sizeof(*w));
+
+  *w = *cm;
+
+  w->curframe = malloc(sizeof(struct frame));
+  w->curframe ->residuals = malloc(sizeof(dct_t));
+  w->curframe ->residuals->Ydct = calloc(cm->ypw * cm->yph, sizeof(int16_t));
+  w->curframe ->residuals->Udct = calloc(cm->upw * cm->uph, sizeof(int16_t));
+  w->curframe ->residuals->Vdct = calloc(cm->vpw * cm->vph, sizeof(int16_t));
+
+  // set per frame in sparse mode, pointing into the result slot
+  w->curframe->sparse = NULL;
+
+  w->curframe ->mbs[Y_COMPONENT] =
+    calloc(cm->mb_rows * cm->mb_cols, sizeof(struct macroblock));
+  w->curframe ->mbs[U_COMPONENT] =
+    calloc(cm->mb_rows/2 * cm->mb_cols/2, sizeof(struct macroblock));
+  w->curframe ->mbs[V_COMPONENT] =
+    calloc(cm->mb_rows/2 * cm->mb_cols/2, sizeof(struct macroblock));
+
+  return w;
+}
+
+/*
+*   Encode on the servers, which take whole GOPs each
+*/
+static void encode_servers(struct server *servers, struct doorbell *doorbell,
+    struct input *input, struct c63_common *cm)
+{
+  int i;
+
+  for (i = 0; i < nservers; ++i)
+  {
+    servers[i].writer = create_writer(cm);
   }
 
   /*
-  *   create, prepare and set available local segment for encoding results
+  *   read,remote-encode,write loop
+  *
+  *   The input is cut into GOPs of keyframe_interval frames, which the
+  *   servers encode independently. A server that has shipped all frames of
+  *   its GOP is handed the next one, so faster servers get more GOPs. Each
+  *   server has a ring of ring_depth slots: while it encodes one frame we
+  *   ship the following ones of its GOP and entropy code the results that
+  *   have already landed, into the output of their GOP.
   */
-  SCICreateSegment(sd,
-                  &result_localSegment,
-                  SEGMENT_CLIENT_RESULT,
-                  sizeof(struct result_segment),
-                  NO_CALLBACK,
-                  NULL,
-                  NO_FLAGS,
-                  &error);
-  if(error != SCI_ERR_OK){
-    fprintf(stderr, "SCICreateSegment failed: %s - Error code: (0x%x)\n",
-            SCIGetErrorString(error), error);
+  uint32_t gop_frames = cm->keyframe_interval;
+  int next_gop = 0;
+  while (1)
+  {
+    int busy = 0;
+
+    for (i = 0; i < nservers; ++i)
+    {
+      struct server *s = &servers[i];
+
+      if (s->gop < 0 && next_gop * gop_frames < input_frames)
+      {
+        s->gop = next_gop++;
+        s->next_frame = s->gop * gop_frames;
+        s->gop_end = s->next_frame + gop_frames;
+        gop_open(s->gop);
+      }
+
+      /*
+      *   keep the ring full, as long as the server has released the input
+      *   slot and the GOP has frames left
+      */
+      while (server_can_ship(s))
+      {
+        if (server_ship(s, input, cm) < 0 || s->next_frame == s->gop_end)
+        {
+          gop_close(s->gop);
+          s->gop = -1;
+        }
+      }
+
+      // ship a partial batch, the ring or the GOP is full
+      server_flush(s);
+
+      // write out the results that have landed
+      while (server_has_result(s))
+      {
+        server_collect(s);
+      }
+
+      if (s->gop >= 0 || s->sent != s->written) { busy = 1; }
+    }
+
+    if (!busy && next_gop * gop_frames >= input_frames) { break; }
+
+    /*
+    *   wait for a server to publish results or release an input slot
+    */
+    DOORBELL_WAIT(doorbell,
+                  servers_ready(servers, nservers,
+                                next_gop * gop_frames < input_frames));
+  }
+}
+
+static void print_help()
+{
+  printf("Usage: ./c63enc [options] input_file\n");
+  printf("The input is raw YUV 4:2:0 or Y4M, - reads standard input\n");
+  printf("Commandline options:\n");
+  printf("  -h                             Height of images to compress, "
+         "read from the header of Y4M\n");
+  printf("  -w                             Width of images to compress, "
+         "read from the header of Y4M\n");
+  printf("  -o                             Output file (.c63)\n");
+  printf("  [-r]                           Node ids of the servers, comma "
+         "separated. Server i has to run with -c i (default: 0)\n");
+  printf("  [-t]                           Transport, sisci or shm\n");
+  printf("  [-f]                           Limit number of frames to encode\n");
+  printf("  [-n]                           Frames in flight to the server "
+         "(1-%d, default %d or two batches)\n", RING_MAX_DEPTH,
+         RING_DEFAULT_DEPTH);
+  printf("  [-k]                           Frames per transfer (1-%d, default: "
+         "as many as fit in %d KiB)\n", BATCH_MAX, BATCH_TARGET_SIZE / 1024);
+  printf("  [-b]                           Entropy code on the server and "
+         "receive the bitstream\n");
+  printf("  [-s]                           Receive residuals in sparse form\n");
+  printf("  [-p]                           Polls before waiting for a doorbell "
+         "yields the cpu (default: %d)\n", DOORBELL_DEFAULT_SPIN);
+  printf("  [-l]                           MCU rows per band when streaming "
+         "dense results, 0 waits for whole frames (default: %d)\n",
+         BAND_DEFAULT_ROWS);
+  printf("  [-m]                           Motion search, full, fast, "
+         "pyramid or exact (default: full)\n");
+  printf("  [-d]                           Search range in pixels, 1-%d "
+         "(default: 16)\n", ME_MAX_RANGE);
+  printf("  [-e]                           Keep motion vectors in the frame, "
+         "for older decoders\n");
+  printf("  [-x]                           Encode this percentage of each "
+         "frame on the client at first, the split then follows the measured "
+         "encode times (one server, dense residuals, not with -m fast)\n");
+  printf("\n");
+
+  exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char **argv)
+{
+  // the servers, in the order of the -r list
+  struct server servers[MAX_SERVERS];
+
+  // rung by the servers when they have written to our comms
+  struct doorbell doorbell;
+
+  int c, i;
+  char *node;
+  if (argc == 1) { print_help(); }
+
+  while ((c = getopt(argc, argv, "h:w:o:f:i:r:n:bsp:t:x:l:k:m:d:e")) != -1)
+  {
+    switch (c)
+    {
+      case 'h':
+        height = atoi(optarg);
+        break;
+      case 'w':
+        width = atoi(optarg);
+        break;
+      case 'o':
+        output_file = optarg;
+        break;
+      case 'f':
+        limit_numframes = atoi(optarg);
+        break;
+      case 'r':
+        for (node = strtok(optarg, ","); node; node = strtok(NULL, ","))
+        {
+          if (nservers == MAX_SERVERS)
+          {
+            fprintf(stderr, "At most %d servers\n", MAX_SERVERS);
+            exit(EXIT_FAILURE);
+          }
+          remote_nodes[nservers++] = atoi(node);
+        }
+        break;
+      case 'n':
+        ring_depth = atoi(optarg);
+        break;
+      case 'b':
+        result_format = RESULT_BITSTREAM;
+        break;
+      case 's':
+        result_format = RESULT_SPARSE;
+        break;
+      case 'p':
+        spin_budget = atoi(optarg);
+        break;
+      case 't':
+        if (transport_parse(optarg, &transport_kind) < 0) { exit(EXIT_FAILURE); }
+        break;
+      case 'x':
+        client_share = atoi(optarg);
+        break;
+      case 'l':
+        band_rows = atoi(optarg);
+        break;
+      case 'k':
+        batch = atoi(optarg);
+        break;
+      case 'm':
+        if (me_mode_parse(optarg, &me_mode) < 0) { exit(EXIT_FAILURE); }
+        break;
+      case 'd':
+        me_range = atoi(optarg);
+        if (me_range < 1 || me_range > ME_MAX_RANGE)
+        {
+          fprintf(stderr, "Search range must be 1-%d pixels\n", ME_MAX_RANGE);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'e':
+        me_in_frame = 1;
+        break;
+      default:
+        print_help();
+        break;
+    }
+  }
+
+  if (optind >= argc)
+  {
+    fprintf(stderr, "Error getting program options, try --help.\n");
     exit(EXIT_FAILURE);
   }
 
-  SCIPrepareSegment(result_localSegment, localAdapterNo, NO_FLAGS, &error);
-  if(error != SCI_ERR_OK){
-    fprintf(stderr, "SCIPrepareSegment failed: %s - Error code: (0x%x)\n",
-            SCIGetErrorString(error), error);
+  // one server at node 0, as c63server -t shm is on the same host
+  if (nservers == 0) { remote_nodes[nservers++] = 0; }
+
+  if (ring_depth < 0 || ring_depth > RING_MAX_DEPTH)
+  {
+    fprintf(stderr, "Ring depth must be between 1 and %d\n", RING_MAX_DEPTH);
     exit(EXIT_FAILURE);
   }
-  SCISetSegmentAvailable(result_localSegment, localAdapterNo, NO_FLAGS, &error);
-  if(error != SCI_ERR_OK){
-    fprintf(stderr, "SCISetSegmentAvailable failed: %s - Error code: (0x%x)\n",
-            SCIGetErrorString(error), error);
+
+  if (batch < 0 || batch > BATCH_MAX || (ring_depth && batch > ring_depth))
+  {
+    fprintf(stderr, "Batch must be between 1 and %d frames, and fit in the "
+            "ring\n", BATCH_MAX);
     exit(EXIT_FAILURE);
   }
 
-  /*
-  *   Connect remote segment for image data dma transfer to tegra/server
-  */
-  do {
-     SCIConnectSegment(sd,
-                       &remoteSegment,
-                       remote_node,
-                       SEGMENT_SERVER,
-                       localAdapterNo,
-                       NO_CALLBACK,
-                       NULL,
-                       SCI_INFINITE_TIMEOUT,
-                       NO_FLAGS,
-                       &error);
-  } while (error != SCI_ERR_OK);
+  if (spin_budget < 0)
+  {
+    fprintf(stderr, "Spin budget must not be negative\n");
+    exit(EXIT_FAILURE);
+  }
 
-  /*
-  *   map local segment for image transfer from x86/client
-  */
-  local_seg =   SCIMapLocalSegment(localSegment,
-                                      &localMap,
-                                      0,
-                                      sizeof(struct image_segment),
-                                      NULL,
-                                      NO_FLAGS,
-                                      &error);
-  if(error != SCI_ERR_OK){
-    fprintf(stderr, "SCIMapLocalSegment failed: %s - Error code: (0x%x)\n",
-            SCIGetErrorString(error), error);
+  if (client_share < 0 || client_share > 100)
+  {
+    fprintf(stderr, "Client share must be between 0 and 100 percent\n");
     exit(EXIT_FAILURE);
   }
 
-  /*
-  *   map local segment for encoding transfer from x86/client
-  */
-  result_local_seg =   SCIMapLocalSegment(result_localSegment,
-                                    &result_localMap,
-                                    0,
-                                    sizeof(struct result_segment),
-                                    NULL,
-                                    NO_FLAGS,
-                                    &error);
-  if(error != SCI_ERR_OK){
-    fprintf(stderr, "SCIMapLocalSegment failed: %s - Error code: (0x%x)\n",
-            SCIGetErrorString(error), error);
+  if (client_share && (nservers != 1 || result_format != RESULT_RESIDUALS))
+  {
+    fprintf(stderr, "Split mode needs a single server and dense residuals\n");
     exit(EXIT_FAILURE);
   }
 
   /*
-  *   Create a DMA queue for transfering image data
+  *   The fast search seeds from the vectors of the rows the same side
+  *   estimated, which depend on where the split was, and so on timing
   */
-  SCICreateDMAQueue(sd,
-                    &dq,
-                    localAdapterNo,
-                    max_entries,
-                    NO_FLAGS,
-                    &error
-                  );
-  if(error != SCI_ERR_OK){
-    fprintf(stderr, "SCICreateDMAQueue failed: %s - Error code: (0x%x)\n",
-    SCIGetErrorString(error), error);
+  if (client_share && me_mode == ME_FAST)
+  {
+    fprintf(stderr, "Split mode does not combine with -m fast, its vectors "
+            "would depend on the measured encode times\n");
     exit(EXIT_FAILURE);
   }
 
-  // create cm struct for variables we need in c63_write
-  cm->curframe = malloc(sizeof(struct frame));
-  cm->curframe ->residuals = malloc(sizeof(dct_t));
-  cm->curframe ->residuals->Ydct = calloc(cm->ypw * cm->yph, sizeof(int16_t));
-  cm->curframe ->residuals->Udct = calloc(cm->upw * cm->uph, sizeof(int16_t));
-  cm->curframe ->residuals->Vdct = calloc(cm->vpw * cm->vph, sizeof(int16_t));
+  if (batch > 1 && (band_rows > 0 || client_share))
+  {
+    fprintf(stderr, "Batches do not combine with -l or -x\n");
+    exit(EXIT_FAILURE);
+  }
 
-  cm->curframe ->mbs[Y_COMPONENT] =
-    calloc(cm->mb_rows * cm->mb_cols, sizeof(struct macroblock));
-  cm->curframe ->mbs[U_COMPONENT] =
-    calloc(cm->mb_rows/2 * cm->mb_cols/2, sizeof(struct macroblock));
-  cm->curframe ->mbs[V_COMPONENT] =
-    calloc(cm->mb_rows/2 * cm->mb_cols/2, sizeof(struct macroblock));
+  if (band_rows > 0 && (result_format != RESULT_RESIDUALS || client_share))
+  {
+    fprintf(stderr, "Results are streamed in bands of dense residuals only, "
+            "not with -b, -s or -x\n");
+    exit(EXIT_FAILURE);
+  }
 
   /*
-  *   read,remote-encode,write loop
+  *   Y4M input brings its dimensions, raw input needs -w and -h. Servers
+  *   read GOPs out of order, which an input that can not seek only allows
+  *   with a single server.
   */
-  int numframes = 0;
-  while (1)
+  struct input input;
+  input_file = argv[optind];
+  input_open(&input, input_file, width, height);
+  width = input.width;
+  height = input.height;
+
+  if (!input.seekable && nservers > 1)
   {
+    fprintf(stderr, "Input that can not seek takes a single server\n");
+    exit(EXIT_FAILURE);
+  }
 
-    //remote_comms->packet.cmd = CMD_INVALID;
-    local_comms->packet.cmd = CMD_INVALID;
+  outfile = fopen(output_file, "wb");
 
-    // read image
-    image = read_yuv(infile, cm);
-    if (!image) { break; }
+  if (outfile == NULL)
+  {
+    perror("fopen output file");
+    exit(EXIT_FAILURE);
+  }
 
-    /*
-    *   use memcpy() to copy blocks of memory from image to local segment
-    */
-    memcpy(local_seg->Y, image->Y, cm->padw[Y_COMPONENT]*cm->padh[Y_COMPONENT]);
-    memcpy(local_seg->U, image->U, cm->padw[U_COMPONENT]*cm->padh[U_COMPONENT]);
-    memcpy(local_seg->V, image->V, cm->padw[V_COMPONENT]*cm->padh[V_COMPONENT]);
+  struct c63_common *cm = init_c63_enc(width, height);
+  cm->me_mode = me_mode;
+  cm->me_search_range = me_range;
+  cm->me_in_frame = me_in_frame;
+  cm->e_ctx.fp = outfile;
 
-    /*
-    *   Use DMA queue to start DMA transfer of image data from
-    *   local segment to remote segment
-    */
-    SCIStartDmaTransfer(dq,
-                        localSegment,
-                        remoteSegment,
-                        local_offset,
-                        sizeof(struct image_segment),
-                        remote_offset,
-                        NO_CALLBACK,
-                        NULL,
-                        NO_FLAGS,
-                        &error);
-
-    if(error != SCI_ERR_OK){
-      fprintf(stderr, "SCIStartDmaTransfer failed: %s - Error code: (0x%x)\n",
-      SCIGetErrorString(error), error);
+  if (client_share)
+  {
+    if (cm->yph < 32)
+    {
+      fprintf(stderr, "Split mode needs at least two rows of macroblocks\n");
       exit(EXIT_FAILURE);
     }
 
-    // wait for DMA transfer to finish
-    SCIWaitForDMAQueue(dq,
-                      SCI_INFINITE_TIMEOUT,
-                      NO_FLAGS,
-                      &error);
-    if(error != SCI_ERR_OK){
-      fprintf(stderr, "SCIWaitForDMAQueue failed: %s - Error code: (0x%x)\n",
-      SCIGetErrorString(error), error);
-      exit(EXIT_FAILURE);
+    split_halo = (cm->me_search_range + SPLIT_STEP + 15) / 16 * 16;
+
+    /* A -d reaching past the frame needs no more than all of it */
+    if (split_halo > (uint32_t)cm->yph)
+    {
+      split_halo = cm->yph;
     }
+  }
 
+  if (limit_numframes)
+  {
+    printf("Limited to %d frames.\n", limit_numframes);
+    input_frames = limit_numframes;
+  }
 
-    printf("Encoding frame %d, ", numframes);
-    /*
-    * signal to tegra/server to start encoding the image data
-    */
-    remote_comms->packet.cmd = CMD_DONE;
+  /*
+  *   compute the wire layout of the image and result segments,
+  *   see segment.h
+  */
+  image_segment_layout(cm, split_halo, &image_layout);
+  result_segment_layout(cm, result_format, split_halo, &result_layout);
 
-    /*
-    * wait for tegra/server to finish encoding
-    */
-    while(local_comms->packet.cmd != CMD_DONE);
+  /*
+  *   batch small frames, as many as fit in BATCH_TARGET_SIZE, and stream
+  *   the results of frames that are not batched in bands. Split mode and
+  *   streaming send one frame at a time.
+  */
+  if (batch == 0)
+  {
+    batch = BATCH_TARGET_SIZE / image_layout.size;
 
+    if (client_share || band_rows > 0 || batch < 1) { batch = 1; }
+    if (batch > BATCH_MAX) { batch = BATCH_MAX; }
+    if (ring_depth && batch > ring_depth) { batch = ring_depth; }
+  }
 
-    /*
-    *   use memcpy() to copy blocks of memory from local segments
-    *   that has recived encoding results from server through DMA transfer
-    */
-    cm->curframe->keyframe = result_local_seg->keyframe;
+  // room for a batch in transfer and one being encoded
+  if (ring_depth == 0)
+  {
+    ring_depth = 2 * batch > RING_DEFAULT_DEPTH ? 2 * batch
+                                                : RING_DEFAULT_DEPTH;
+  }
 
-    // macroblocks
-    memcpy( cm->curframe->mbs[Y_COMPONENT],
-            result_local_seg->mbs[Y_COMPONENT],
-            cm->mb_rows * cm->mb_cols * sizeof(struct macroblock));
-    memcpy( cm->curframe->mbs[U_COMPONENT],
-            result_local_seg->mbs[U_COMPONENT],
-            cm->mb_rows/2 * cm->mb_cols/2 * sizeof(struct macroblock));
-    memcpy( cm->curframe->mbs[V_COMPONENT],
-            result_local_seg->mbs[V_COMPONENT],
-            cm->mb_rows/2 * cm->mb_cols/2 * sizeof(struct macroblock));
-
-    // residuals
-    memcpy( cm->curframe->residuals->Ydct,
-            result_local_seg->Ydct,
-            cm->ypw * cm->yph * sizeof(int16_t));
-    memcpy( cm->curframe->residuals->Udct,
-            result_local_seg->Udct,
-            cm->upw * cm->uph * sizeof(int16_t));
-    memcpy( cm->curframe->residuals->Vdct,
-            result_local_seg->Vdct,
-            cm->vpw * cm->vph * sizeof(int16_t));
+  if (band_rows < 0)
+  {
+    band_rows = result_format == RESULT_RESIDUALS && !client_share &&
+      batch == 1 ? BAND_DEFAULT_ROWS : 0;
+  }
 
-    // write_frame
-    write_frame(cm);
-    printf("Done!\n");
-    ++numframes;
-    if (limit_numframes && numframes >= limit_numframes) { break; }
+  // the band counter has room for this many MCU rows
+  if ((uint32_t)cm->yph / 16 > BAND_SEQ_ROWS_MAX)
+  {
+    band_rows = 0;
+  }
+
+  if (batch > 1)
+  {
+    printf("Batching %d frames per transfer.\n", batch);
+  }
+
+  for (i = 0; i < nservers; ++i)
+  {
+    memset(&servers[i], 0, sizeof(servers[i]));
+    servers[i].node = remote_nodes[i];
+    servers[i].channel = i;
+    transport_open(&servers[i].transport, transport_kind, remote_nodes[i]);
+  }
+
+  /*
+  *   create the doorbell before the comms segments, so it exists once
+  *   the servers can see our comms
+  */
+  doorbell_create(&doorbell, &servers[0].transport, INTERRUPT_CLIENT,
+                  spin_budget);
+
+  for (i = 0; i < nservers; ++i)
+  {
+    server_connect(&servers[i]);
+  }
+
+  if (client_share)
+  {
+    encode_split(&servers[0], &doorbell, &input, cm);
+  }
+  else
+  {
+    encode_servers(servers, &doorbell, &input, cm);
   }
 
   /*
-  * set cmd to CMD_QUIT to signal the tegra/server to quit
+  * set cmd to CMD_QUIT to signal the tegra/servers to quit
   */
-  remote_comms->packet.cmd = CMD_QUIT;
+  for (i = 0; i < nservers; ++i)
+  {
+    servers[i].remote_comms->packet.cmd = CMD_QUIT;
+    doorbell_ring(&servers[i].doorbell);
+  }
+
+  doorbell_report(&doorbell, "Client");
+  doorbell_destroy(&doorbell);
 
   fclose(outfile);
-  fclose(infile);
+  input_close(&input);
+  free(gops);
 
-  SCITerminate();
+  for (i = 0; i < nservers; ++i)
+  {
+    struct server *s = &servers[i];
+
+    doorbell_disconnect(&s->doorbell);
+    transport_disconnect_segment(&s->transport, &s->remoteSegment);
+    transport_disconnect_segment(&s->transport, &s->remoteSegment_comms);
+    transport_remove_segment(&s->transport, &s->result_localSegment);
+    transport_remove_segment(&s->transport, &s->localSegment);
+    transport_remove_segment(&s->transport, &s->localSegment_comms);
+    transport_close(&s->transport);
+  }
 
   //int i, j;
   //for (i = 0; i < 2; ++i)
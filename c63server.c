@@ -1,3 +1,5 @@
+#define _POSIX_C_SOURCE 200809L   // clock_gettime()
+
 #include <assert.h>
 #include <errno.h>
 #include <getopt.h>
@@ -7,19 +9,25 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
-#include <sisci_error.h>
-#include <sisci_api.h>
+#include <time.h>
 
 #include "c63.h"
+#include "c63_write.h"
+#include "doorbell.h"
+#include "encode.h"
+#include "io.h"
+#include "segment.h"
 #include "sisci_variables.h"
 #include "common.h"
 #include "me.h"
 #include "tables.h"
+#include "transport.h"
 
 
 
 static uint32_t remote_node = 0;
+static enum transport_kind transport_kind = TRANSPORT_DEFAULT;
+static int channel = 0;
 
 /* getopt */
 extern int optind;
@@ -30,67 +38,80 @@ static void print_help()
   printf("Usage: ./c63server -r nodeid\n");
   printf("Commandline options:\n");
   printf("  -r                             Node id of client\n");
+  printf("  [-t]                           Transport, sisci or shm\n");
+  printf("  [-c]                           Channel, the position of this "
+         "server in the -r list of c63enc (default: 0)\n");
   printf("\n");
 
   exit(EXIT_FAILURE);
 }
 
-/*
-*   c63_encode_image from c63enc without write frame
-*/
-static void c63_encode_image(struct c63_common *cm, yuv_t *image)
+static double now(void)
 {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
 
-  /* Advance to next frame */
-  destroy_frame(cm->refframe);
-  cm->refframe = cm->curframe;
-
-  cm->curframe = create_frame(cm, image);
-
-  /* Check if keyframe */
-  if (cm->framenum == 0 || cm->frames_since_keyframe == cm->keyframe_interval)
-  {
-    cm->curframe->keyframe = 1;
-    cm->frames_since_keyframe = 0;
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
 
-    fprintf(stderr, " (keyframe) ");
-  }
-  else { cm->curframe->keyframe = 0; }
 
+/*
+*   Begin encoding image into the result staging slot out. The macroblocks
+*   and residuals the result format carries are encoded straight into their
+*   regions of the slot, so they go out without a copy.
+*/
+static void begin_frame_in(struct c63_common *cm, yuv_t *image,
+    struct sparse_residuals *sparse, const struct result_segment_header *layout,
+    volatile struct result_segment_header *out)
+{
+  struct macroblock *mbs[COLOR_COMPONENTS];
+  int16_t *dct[COLOR_COMPONENTS];
+  int c;
 
-  if (!cm->curframe->keyframe)
+  for (c = 0; c < COLOR_COMPONENTS; ++c)
   {
-    /* Motion Estimation */
-    c63_motion_estimate(cm);
-
-    /* Motion Compensation */
-    c63_motion_compensate(cm);
+    mbs[c] = SEGMENT_PTR(out, layout->mbs[c]);
+    dct[c] = SEGMENT_PTR(out, layout->dct[c]);
   }
 
-  /* DCT and Quantization */
-  dct_quantize(image->Y, cm->curframe->predicted->Y, cm->padw[Y_COMPONENT],
-      cm->padh[Y_COMPONENT], cm->curframe->residuals->Ydct,
-      cm->quanttbl[Y_COMPONENT]);
-
-  dct_quantize(image->U, cm->curframe->predicted->U, cm->padw[U_COMPONENT],
-      cm->padh[U_COMPONENT], cm->curframe->residuals->Udct,
-      cm->quanttbl[U_COMPONENT]);
-
-  dct_quantize(image->V, cm->curframe->predicted->V, cm->padw[V_COMPONENT],
-      cm->padh[V_COMPONENT], cm->curframe->residuals->Vdct,
-      cm->quanttbl[V_COMPONENT]);
+  c63_begin_frame(cm, image, sparse,
+                  layout->format != RESULT_BITSTREAM ? mbs : NULL,
+                  layout->format == RESULT_RESIDUALS ? dct : NULL);
+}
 
+/*
+*   Transfer the macroblocks and residuals of luma rows top to bottom, and
+*   of the chroma rows they cover, from the result staging segment, where
+*   they were encoded, to the result slot at slot_offset in the client
+*/
+static void ship_rows(struct c63_common *cm, struct transport *t,
+    struct transport_segment *local, struct transport_remote *remote,
+    const struct result_segment_header *layout, size_t slot_offset,
+    uint32_t top, uint32_t bottom)
+{
+  int c;
 
-  /* Reconstruct frame for inter-prediction */
-  dequantize_idct(cm->curframe->residuals->Ydct, cm->curframe->predicted->Y,
-      cm->ypw, cm->yph, cm->curframe->recons->Y, cm->quanttbl[Y_COMPONENT]);
-  dequantize_idct(cm->curframe->residuals->Udct, cm->curframe->predicted->U,
-      cm->upw, cm->uph, cm->curframe->recons->U, cm->quanttbl[U_COMPONENT]);
-  dequantize_idct(cm->curframe->residuals->Vdct, cm->curframe->predicted->V,
-      cm->vpw, cm->vph, cm->curframe->recons->V, cm->quanttbl[V_COMPONENT]);
+  for (c = 0; c < COLOR_COMPONENTS; ++c)
+  {
+    // rows of 8x8 blocks, a chroma row covers two luma rows
+    uint32_t first = top * cm->padh[c] / cm->padh[Y_COMPONENT] / 8;
+    uint32_t last = bottom * cm->padh[c] / cm->padh[Y_COMPONENT] / 8;
+    uint32_t cols = cm->padw[c] / 8;
+
+    size_t mbs_offset = layout->mbs[c].offset +
+      first * cols * sizeof(struct macroblock);
+    size_t mbs_size = (last - first) * cols * sizeof(struct macroblock);
+    size_t dct_offset = layout->dct[c].offset +
+      first * cols * 64 * sizeof(int16_t);
+    size_t dct_size = (last - first) * cols * 64 * sizeof(int16_t);
+
+    transport_copy(t, local, mbs_offset, remote, slot_offset + mbs_offset,
+                   mbs_size);
+    transport_copy(t, local, dct_offset, remote, slot_offset + dct_offset,
+                   dct_size);
+  }
 }
 
-
 /*
 *   init_c63_enc from c63enc
 */
@@ -137,24 +158,19 @@ struct c63_common* init_c63_enc(int width, int height)
 int main(int argc, char **argv)
 {
   int c;
-  // Sisci variables
-  unsigned int localAdapterNo = 0;
-  sci_desc_t sd;
-  sci_error_t error;
-  size_t local_offset = 0;
-  size_t remote_offset = 0;
-  sci_dma_queue_t	dq;           // DMA queue used to transfer image data
-  unsigned int max_entries = 1; // max entries inside dma queue
+  // transport to x86/client, see transport.h
+  struct transport transport;
 
   // Segment used to transfer image y, u, v from client
-  sci_local_segment_t localSegment;
-  sci_map_t localMap;
+  struct transport_segment localSegment;
+
+  // rung by x86/client when it has written to our comms and the other way
+  struct doorbell doorbell;
+  struct doorbell_peer client_doorbell;
 
   // Client server communication
-  sci_local_segment_t localSegment_comms;
-  sci_remote_segment_t remoteSegment_comms;
-  sci_map_t localMap_comms;
-  sci_map_t remoteMap_comms;
+  struct transport_segment localSegment_comms;
+  struct transport_remote remoteSegment_comms;
 
   // Struct comms defined in sisci_variables.h
   // comms contain cmd used to communicate and height/width parameters
@@ -162,121 +178,100 @@ int main(int argc, char **argv)
   volatile struct comms *local_comms;
 
   // Segment used to transefer results to client ydct,udct,vdtc and macroblock
-  sci_local_segment_t result_localSegment;
-  sci_remote_segment_t result_remoteSegment;
-  sci_map_t result_localMap;
+  struct transport_segment result_localSegment;
+  struct transport_remote result_remoteSegment;
 
 
   if (argc == 1) { print_help(); }
 
-    while ((c = getopt(argc, argv, "h:w:o:f:i:r:")) != -1)
+    while ((c = getopt(argc, argv, "h:w:o:f:i:r:t:c:")) != -1)
     {
       switch (c)
       {
         case 'r':
           remote_node = atoi(optarg);
           break;
+        case 't':
+          if (transport_parse(optarg, &transport_kind) < 0)
+          {
+            exit(EXIT_FAILURE);
+          }
+          break;
+        case 'c':
+          channel = atoi(optarg);
+          break;
         default:
           print_help();
           break;
       }
   }
 
-  /* Initialize the SISCI library */
-  SCIInitialize(NO_FLAGS, &error);
-  if (error != SCI_ERR_OK) {
-      fprintf(stderr,"SCIInitialize failed: %s\n", SCIGetErrorString(error));
-      exit(EXIT_FAILURE);
+  if (channel < 0 || channel >= MAX_SERVERS)
+  {
+    fprintf(stderr, "Channel must be between 0 and %d\n", MAX_SERVERS - 1);
+    exit(EXIT_FAILURE);
   }
 
-  /* Open a file descriptor */
-  SCIOpen(&sd,NO_FLAGS,&error);
-  if (error != SCI_ERR_OK) {
-     fprintf(stderr, "SCIOpen failed: %s (0x%x)\n",
-             SCIGetErrorString(error), error);
-     exit(error);
-  }
+  transport_open(&transport, transport_kind, remote_node);
 
   /*
-  * Create prepare and set available segment for pio communication comms.
+  *   create the doorbell before the comms segment, so it exists once
+  *   x86/client can see our comms. The spin budget is set by the client.
   */
-  SCICreateSegment(sd,
-                   &localSegment_comms,
-                   SEGMENT_SERVER_COMMS,
-                   sizeof(struct comms),
-                   NO_CALLBACK,
-                   NULL,
-                   NO_FLAGS,
-                   &error);
-  if(error != SCI_ERR_OK){
-   fprintf( stderr, "SCICreateSegment failed: %s - Error code: (0x%x)\n",
-            SCIGetErrorString(error), error);
-   exit(EXIT_FAILURE);
-  }
-
-  SCIPrepareSegment(localSegment_comms, localAdapterNo, NO_FLAGS, &error);
-  if(error != SCI_ERR_OK){
-   fprintf( stderr, "SCIPrepareSegment failed: %s - Error code: (0x%x)\n",
-            SCIGetErrorString(error), error);
-   exit(EXIT_FAILURE);
-  }
+  doorbell_create(&doorbell, &transport,
+                  CHANNEL_ID(INTERRUPT_SERVER, channel), DOORBELL_DEFAULT_SPIN);
 
-  SCISetSegmentAvailable(localSegment_comms, localAdapterNo, NO_FLAGS, &error);
-  if(error != SCI_ERR_OK){
-   fprintf( stderr, "SCISetSegmentAvailable failed: %s - Error code: (0x%x)\n",
-            SCIGetErrorString(error), error);
-   exit(EXIT_FAILURE);
-  }
+  /*
+  * Create segment for pio communication comms.
+  */
+  local_comms = transport_create_segment(&transport, &localSegment_comms,
+                                         CHANNEL_ID(SEGMENT_SERVER_COMMS,
+                                                    channel),
+                                         sizeof(struct comms));
 
    /*
-   * Connect to remote segment in x86/client for pio communication comms.
+   * Connect to and map remote segment in x86/client for pio communication
    */
-   do {
-       SCIConnectSegment(sd,
-                         &remoteSegment_comms,
-                         remote_node,
-                         SEGMENT_CLIENT_COMMS,
-                         localAdapterNo,
-                         NO_CALLBACK,
-                         NULL,
-                         SCI_INFINITE_TIMEOUT,        // dont time out
-                         NO_FLAGS,
-                         &error);
-  } while (error != SCI_ERR_OK);                     //
+  remote_comms = transport_connect_segment(&transport, &remoteSegment_comms,
+                                           CHANNEL_ID(SEGMENT_CLIENT_COMMS,
+                                                      channel),
+                                           sizeof(struct comms), 1);
 
-  /*
-  *   map the local and remote segments for comms
-  */
-  local_comms =  SCIMapLocalSegment(localSegment_comms,
-                                   &localMap_comms,
-                                   local_offset,
-                                   sizeof(struct comms),
-                                   NULL,
-                                   NO_FLAGS,
-                                   &error);
-  if(error != SCI_ERR_OK){
-    fprintf(stderr, " failed: %s - Error code: (0x%x)\n",
-            SCIGetErrorString(error), error);
-    exit(EXIT_FAILURE);
-  }
-  remote_comms = SCIMapRemoteSegment(remoteSegment_comms,
-                                     &remoteMap_comms,
-                                     remote_offset,
-                                     sizeof(struct comms),
-                                     NULL,
-                                     NO_FLAGS,
-                                     &error);
-  if(error != SCI_ERR_OK){
-    fprintf(stderr, " failed: %s - Error code: (0x%x)\n",
-            SCIGetErrorString(error), error);
-    exit(EXIT_FAILURE);
-  }
+  doorbell_connect(&client_doorbell, &transport, INTERRUPT_CLIENT);
+
+  // no images published or result slots released yet
+  memset((void *)local_comms, 0, sizeof(struct comms));
 
    /*
     *   Wait until x86/client have read height/width
     *   so we can retrive them with remote_comms->packet.width/height
     */
-   while(remote_comms->packet.cmd == CMD_INVALID);
+   DOORBELL_WAIT(&doorbell, remote_comms->packet.cmd != CMD_INVALID);
+
+   if (remote_comms->packet.spin < 0)
+   {
+     fprintf(stderr, "Invalid spin budget %d from client\n",
+             remote_comms->packet.spin);
+     exit(EXIT_FAILURE);
+   }
+   doorbell.spin = remote_comms->packet.spin;
+
+   // number of frames in flight, the client has one ring slot per frame
+   int ring_depth = remote_comms->packet.depth;
+   if (ring_depth < 1 || ring_depth > RING_MAX_DEPTH)
+   {
+     fprintf(stderr, "Invalid ring depth %d from client\n", ring_depth);
+     exit(EXIT_FAILURE);
+   }
+
+   // whether to send residuals or entropy code the frames here
+   enum result_format result_format = remote_comms->packet.format;
+   if (result_format != RESULT_RESIDUALS && result_format != RESULT_BITSTREAM &&
+       result_format != RESULT_SPARSE)
+   {
+     fprintf(stderr, "Invalid result format %d from client\n", result_format);
+     exit(EXIT_FAILURE);
+   }
 
    /*
    *  Create cm struct with width and height recived from x86/client
@@ -284,254 +279,347 @@ int main(int argc, char **argv)
    struct c63_common *cm = init_c63_enc(remote_comms->packet.width,
                                         remote_comms->packet.height);
 
-  /*
-  *   struct image segment for transfering image data to tegra/server with DMA
-  */
-  volatile struct image_segment
-  {
-    uint8_t *Y[cm->padw[Y_COMPONENT]*cm->padh[Y_COMPONENT]];
-    uint8_t *U[cm->padw[U_COMPONENT]*cm->padh[U_COMPONENT]];
-    uint8_t *V[cm->padw[V_COMPONENT]*cm->padh[V_COMPONENT]];
-  } *local_seg;
+   // motion search, see me.h
+   cm->me_mode = remote_comms->packet.me_mode;
+   if (cm->me_mode != ME_FULL && cm->me_mode != ME_FAST &&
+       cm->me_mode != ME_PYRAMID && cm->me_mode != ME_EXACT)
+   {
+     fprintf(stderr, "Invalid motion search %d from client\n", cm->me_mode);
+     exit(EXIT_FAILURE);
+   }
+
+   cm->me_search_range = remote_comms->packet.me_range;
+   if (cm->me_search_range < 1 || cm->me_search_range > ME_MAX_RANGE)
+   {
+     fprintf(stderr, "Invalid search range %d from client\n",
+             cm->me_search_range);
+     exit(EXIT_FAILURE);
+   }
+   cm->me_in_frame = remote_comms->packet.me_in_frame != 0;
+
+   // rows of the reference frame exchanged with the client in split mode
+   uint32_t yph = cm->yph;
+   uint32_t halo = remote_comms->packet.halo;
+   if (remote_comms->packet.halo < 0 || halo % 16 || halo > yph ||
+       (halo && result_format != RESULT_RESIDUALS))
+   {
+     fprintf(stderr, "Invalid halo %d from client\n",
+             remote_comms->packet.halo);
+     exit(EXIT_FAILURE);
+   }
+
+   // results of up to batch frames go back in one transfer
+   int batch = remote_comms->packet.batch;
+   if (batch < 1 || batch > ring_depth ||
+       (batch > 1 && (remote_comms->packet.band || halo)))
+   {
+     fprintf(stderr, "Invalid batch %d from client\n", batch);
+     exit(EXIT_FAILURE);
+   }
+
+   // MCU rows per band when streaming the results, 0 to send whole frames
+   int band = remote_comms->packet.band;
+   if (band < 0 || (band && (result_format != RESULT_RESIDUALS || halo ||
+                             yph / 16 > BAND_SEQ_ROWS_MAX)))
+   {
+     fprintf(stderr, "Invalid band %d from client\n", band);
+     exit(EXIT_FAILURE);
+   }
 
   /*
-  *  struct result_segment for transfering encoding results back to x86/client
+  *   compute the wire layout of the image and result segments,
+  *   see segment.h
   */
-  volatile struct result_segment
-  {
-    int keyframe;
+  struct image_segment_header image_layout;
+  struct result_segment_header result_layout;
+  image_segment_layout(cm, halo, &image_layout);
+  result_segment_layout(cm, result_format, halo, &result_layout);
 
-    // macroblock
-    struct macroblock *mbs[COLOR_COMPONENTS][cm->mb_rows * cm->mb_cols];
+  // the client DMAs images into one slot per frame in flight
+  size_t image_ring_size = SEGMENT_SLOT_OFFSET(image_layout.size, ring_depth);
 
-    // residuals
-    int16_t *Ydct[cm->ypw * cm->yph];
-    int16_t *Udct[cm->upw * cm->uph];
-    int16_t *Vdct[cm->vpw * cm->vph];
-  } *result_local_seg;
+  // local segment for image data and encoding results
+  volatile struct image_segment_header *local_seg;
+  volatile struct result_segment_header *result_local_seg;
 
 
   /*
-  * Create, prepeare and set available local segment that for image data
+  *   create local segment for image data and for encoding results, the
+  *   results of a batch are staged in consecutive slots
   */
-  SCICreateSegment(sd,
-                   &localSegment,
-                   SEGMENT_SERVER,
-                   sizeof(struct image_segment),
-                   NO_CALLBACK,
-                   NULL,
-                   NO_FLAGS,
-                   &error);
-  if(error != SCI_ERR_OK){
-   fprintf(stderr, "SCICreateSegment failed: %s - Error code: (0x%x)\n",
-           SCIGetErrorString(error), error);
-   exit(EXIT_FAILURE);
-  }
-
-  SCIPrepareSegment(localSegment, localAdapterNo, NO_FLAGS, &error);
-  if(error != SCI_ERR_OK){
-   fprintf(stderr, "SCIPrepareSegment failed: %s - Error code: (0x%x)\n",
-           SCIGetErrorString(error), error);
-   exit(EXIT_FAILURE);
-  }
-
-  SCISetSegmentAvailable(localSegment, localAdapterNo, NO_FLAGS, &error);
-  if(error != SCI_ERR_OK){
-   fprintf(stderr, "SCISetSegmentAvailable failed: %s - Error code: (0x%x)\n",
-           SCIGetErrorString(error), error);
-   exit(EXIT_FAILURE);
-  }
+  local_seg = transport_create_segment(&transport, &localSegment,
+                                       CHANNEL_ID(SEGMENT_SERVER, channel),
+                                       image_ring_size);
+  result_local_seg = transport_create_segment(&transport,
+                                              &result_localSegment,
+                                              CHANNEL_ID(SEGMENT_SERVER_RESULT,
+                                                         channel),
+                                              SEGMENT_SLOT_OFFSET(
+                                                result_layout.size, batch));
 
   /*
-  *   create, prepare and set available local segment for encoding results
+  *   Connect remote segment for encoding results transfer to x86/client
   */
-  SCICreateSegment(sd,
-                  &result_localSegment,
-                  SEGMENT_SERVER_RESULT,
-                  sizeof(struct result_segment),
-                  NO_CALLBACK,
-                  NULL,
-                  NO_FLAGS,
-                  &error);
-  if(error != SCI_ERR_OK){
-    fprintf(stderr, "SCICreateSegment failed: %s - Error code: (0x%x)\n",
-            SCIGetErrorString(error), error);
-    exit(EXIT_FAILURE);
-  }
-
-  SCIPrepareSegment(result_localSegment, localAdapterNo, NO_FLAGS, &error);
-  if(error != SCI_ERR_OK){
-    fprintf(stderr, "SCIPrepareSegment failed: %s - Error code: (0x%x)\n",
-            SCIGetErrorString(error), error);
-    exit(EXIT_FAILURE);
-  }
-
-  SCISetSegmentAvailable(result_localSegment,localAdapterNo,NO_FLAGS,&error);
-  if(error != SCI_ERR_OK){
-    fprintf(stderr, "SCISetSegmentAvailable failed: %s -Error code: (0x%x)\n",
-            SCIGetErrorString(error), error);
-    exit(EXIT_FAILURE);
-  }
+  transport_connect_segment(&transport, &result_remoteSegment,
+                            CHANNEL_ID(SEGMENT_CLIENT_RESULT, channel),
+                            SEGMENT_SLOT_OFFSET(result_layout.size,
+                                                ring_depth), 0);
 
   /*
-  *   map local segment for image transfer from x86/client
+  *   in sparse mode dct_quantize() packs the residuals straight into the
+  *   sparse regions of the result segment, pointed at the staging slot of
+  *   each frame
   */
-  local_seg =  SCIMapLocalSegment(localSegment,
-                                  &localMap,
-                                  local_offset,
-                                  sizeof(struct image_segment),
-                                  NULL,
-                                  NO_FLAGS,
-                                  &error);
-  if(error != SCI_ERR_OK){
-    fprintf(stderr, "SCIMapLocalSegment failed: %s - Error code: (0x%x)\n",
-            SCIGetErrorString(error), error);
-    exit(EXIT_FAILURE);
+  struct sparse_residuals sparse_storage;
+  struct sparse_residuals *sparse = NULL;
+
+  if (result_format == RESULT_SPARSE)
+  {
+    sparse = &sparse_storage;
   }
 
-  /*
-  *   Connect remote segment for encoding results dma transfer to x86/client
-  */
-  do {
-      SCIConnectSegment(sd,
-                        &result_remoteSegment,
-                        remote_node,
-                        SEGMENT_CLIENT_RESULT,
-                        localAdapterNo,
-                        NO_CALLBACK,
-                        NULL,
-                        SCI_INFINITE_TIMEOUT,
-                        NO_FLAGS,
-                        &error);
-  } while (error != SCI_ERR_OK);
-
-  result_local_seg = SCIMapLocalSegment(result_localSegment,
-                                        &result_localMap,
-                                        0,
-                                        sizeof(struct result_segment),
-                                        NULL,
-                                        NO_FLAGS,
-                                        &error);
+  int i;
 
+  // results staged for the next transfer and their used bytes
+  int staged = 0;
+  uint32_t used[RING_MAX_DEPTH];
 
-  /*
-  *   Create a DMA queue for transfering encoding results
-  */
-  SCICreateDMAQueue(sd,
-                    &dq,
-                    localAdapterNo,
-                    max_entries,
-                    NO_FLAGS,
-                    &error
-                  );
-  if(error != SCI_ERR_OK){
-    fprintf(stderr, "SCICreateDMAQueue failed: %s - Error code: (0x%x)\n",
-            SCIGetErrorString(error), error);
-    exit(EXIT_FAILURE);
-  }
 
-  // Create image variable to use when encoding
-  yuv_t *image;
-  image = malloc(sizeof(*image));
-  image->Y = calloc(1, cm->padw[Y_COMPONENT]*cm->padh[Y_COMPONENT]);
-  image->U = calloc(1, cm->padw[U_COMPONENT]*cm->padh[U_COMPONENT]);
-  image->V = calloc(1, cm->padw[V_COMPONENT]*cm->padh[V_COMPONENT]);
+  // the image being encoded, read in place from its input slot
+  yuv_t image;
 
   /*
-  *   encoding loop
+  *   encoding loop, frame n arrives in and leaves from ring slot n % depth
   */
-  while(1)
+  uint32_t n;
+  for (n = 0; ; ++n)
   {
+    int slot = n % ring_depth;
+
     // wait for client x86 to read and DMA image data to server
-    while(local_comms->packet.cmd == CMD_INVALID);
+    DOORBELL_WAIT(&doorbell, local_comms->seq[slot] == n + 1 ||
+                             local_comms->packet.cmd == CMD_QUIT);
     // Exit loop when client signals CMD_QUIT
-    if(local_comms->packet.cmd == CMD_QUIT){break;}
-    // set CMD_INVALID to signal the client to wait
-    local_comms->packet.cmd = CMD_INVALID;
+    if(local_comms->seq[slot] != n + 1){break;}
+
+    volatile struct image_segment_header *input =
+      SEGMENT_SLOT(local_seg, image_layout.size, slot);
+
+    if (image_segment_check(&image_layout, input) < 0)
+    {
+      exit(EXIT_FAILURE);
+    }
+
+    // in split mode we encode the rows from split down
+    uint32_t split = input->split;
+    uint32_t halo_top = input->halo_top;
+    uint32_t halo_rows = input->halo_rows;
+    if (split % 16 || split >= yph || halo_top % 16 || halo_rows % 16 ||
+        halo_rows > halo || halo_top + halo_rows > yph)
+    {
+      fprintf(stderr, "Invalid split %u or halo %u+%u from client\n", split,
+              halo_top, halo_rows);
+      exit(EXIT_FAILURE);
+    }
+
+    /*
+    *   encode straight from the planes the client has DMAed into the slot,
+    *   the slot stays ours until the frame is encoded
+    */
+    image.Y = SEGMENT_PTR(input, image_layout.plane[Y_COMPONENT]);
+    image.U = SEGMENT_PTR(input, image_layout.plane[U_COMPONENT]);
+    image.V = SEGMENT_PTR(input, image_layout.plane[V_COMPONENT]);
 
     /*
-    *   use memcpy() to copy blocks of memory from local segments
-    *   that has recived image data from client through DMA transfer
+    *   the client's rows of the previous frame next to our band, which
+    *   motion estimation searches in
     */
-    memcpy( image->Y,
-            local_seg->Y,
-            cm->padw[Y_COMPONENT]*cm->padh[Y_COMPONENT]);
-    memcpy( image->U,
-            local_seg->U,
-            cm->padw[U_COMPONENT]*cm->padh[U_COMPONENT]);
-    memcpy( image->V,
-            local_seg->V,
-            cm->padw[V_COMPONENT]*cm->padh[V_COMPONENT]);
+    if (halo_rows && cm->curframe)
+    {
+      yuv_t halo_in = {
+        .Y = SEGMENT_PTR(input, image_layout.halo[Y_COMPONENT]),
+        .U = SEGMENT_PTR(input, image_layout.halo[U_COMPONENT]),
+        .V = SEGMENT_PTR(input, image_layout.halo[V_COMPONENT]),
+      };
+
+      c63_copy_rows(cm, cm->curframe->recons, halo_top, &halo_in, 0,
+                    halo_rows, 1);
+    }
+
+    if (band)
+    {
+      /*
+      *   stream the results a band of MCU rows at a time, so the client
+      *   writes the top of the frame while we encode the rest. The slot has
+      *   to be free before the header goes out.
+      */
+      size_t slot_offset = SEGMENT_SLOT_OFFSET(result_layout.size, slot);
+      uint32_t rows = yph / 16;
+      uint32_t top, bottom;
+
+      DOORBELL_WAIT(&doorbell, n - local_comms->ack < (uint32_t)ring_depth);
+
+      begin_frame_in(cm, &image, NULL, &result_layout, result_local_seg);
+
+      result_layout.keyframe = cm->curframe->keyframe;
+      memcpy((void *)result_local_seg, &result_layout, sizeof(result_layout));
+      transport_copy(&transport, &result_localSegment, 0,
+                     &result_remoteSegment, slot_offset,
+                     result_layout.header_size);
+
+      for (top = 0; top < rows; top = bottom)
+      {
+        bottom = MIN(top + band, rows);
+
+        c63_encode_rows(cm, top * 16, bottom * 16);
+        ship_rows(cm, &transport, &result_localSegment, &result_remoteSegment,
+                  &result_layout, slot_offset, top * 16, bottom * 16);
+
+        remote_comms->band_seq[slot] = BAND_SEQ(n, bottom);
+        doorbell_ring(&client_doorbell);
+      }
+
+      // the input slot is encoded, let the client refill it
+      remote_comms->ack = n + 1;
+      doorbell_ring(&client_doorbell);
+
+      c63_end_frame(cm);
+
+      // the whole frame is there
+      remote_comms->seq[slot] = n + 1;
+      doorbell_ring(&client_doorbell);
+      continue;
+    }
+
+    // staging slot of this frame
+    volatile struct result_segment_header *out =
+      SEGMENT_SLOT(result_local_seg, result_layout.size, staged);
+
+    if (sparse)
+    {
+      result_segment_sparse(out, &result_layout, sparse);
+    }
+
+    // in bitstream mode write_frame() codes straight into the slot
+    if (result_format == RESULT_BITSTREAM)
+    {
+      set_output_buffer(&cm->e_ctx, SEGMENT_PTR(out, result_layout.bitstream),
+                        result_layout.bitstream.size);
+    }
 
     // encode frame
-    c63_encode_image(cm, image);
-
-    // copy over encoding reuslts to local result segment
-    result_local_seg->keyframe = cm->curframe->keyframe;
-
-    // copy macroblocks
-    memcpy( result_local_seg->mbs[Y_COMPONENT],
-            cm->curframe->mbs[Y_COMPONENT],
-            cm->mb_rows * cm->mb_cols * sizeof(struct macroblock));
-    memcpy( result_local_seg->mbs[U_COMPONENT],
-            cm->curframe->mbs[U_COMPONENT],
-            cm->mb_rows/2 * cm->mb_cols/2 * sizeof(struct macroblock));
-    memcpy( result_local_seg->mbs[V_COMPONENT],
-            cm->curframe->mbs[V_COMPONENT],
-            cm->mb_rows/2 * cm->mb_cols/2 * sizeof(struct macroblock));
-
-    // copy residuals
-    memcpy(result_local_seg->Ydct,
-           cm->curframe->residuals->Ydct, cm->ypw * cm->yph * sizeof(int16_t));
-    memcpy(result_local_seg->Udct,
-           cm->curframe->residuals->Udct, cm->upw * cm->uph * sizeof(int16_t));
-    memcpy(result_local_seg->Vdct,
-           cm->curframe->residuals->Vdct, cm->vpw * cm->vph * sizeof(int16_t));
+    double start = now();
+
+    begin_frame_in(cm, &image, sparse, &result_layout, out);
+    c63_encode_rows(cm, split, yph);
+    c63_end_frame(cm);
+
+    result_layout.keyframe = cm->curframe->keyframe;
+    result_layout.split = split;
+    result_layout.encode_time = (now() - start) * 1e6;
 
+    // the input slot is encoded, let the client refill it
+    remote_comms->ack = n + 1;
+    doorbell_ring(&client_doorbell);
 
     /*
-    *   Use DMA queue to start transfer of encoding results from
-    *   local result segment to remote result segment
+    *   our rows of this frame next to the client's band, which its motion
+    *   estimation searches in for the next frame
     */
-    SCIStartDmaTransfer(dq,
-                        result_localSegment,
-                        result_remoteSegment,
-                        local_offset,
-                        sizeof(struct result_segment),
-                        remote_offset,
-                        NO_CALLBACK,
-                        NULL,
-                        NO_FLAGS,
-                        &error);
-    if(error != SCI_ERR_OK){
-      fprintf(stderr,"SCIStartDmaTransfer failed: %s - Error code: (0x%x)\n",
-              SCIGetErrorString(error), error);
-      exit(EXIT_FAILURE);
+    result_layout.halo_rows = 0;
+    if (split && halo)
+    {
+      yuv_t halo_out = {
+        .Y = SEGMENT_PTR(out, result_layout.halo[Y_COMPONENT]),
+        .U = SEGMENT_PTR(out, result_layout.halo[U_COMPONENT]),
+        .V = SEGMENT_PTR(out, result_layout.halo[V_COMPONENT]),
+      };
+
+      result_layout.halo_rows = yph - split < halo ? yph - split : halo;
+
+      c63_copy_rows(cm, &halo_out, 0, cm->curframe->recons, split,
+                    result_layout.halo_rows, 0);
     }
 
-    // wait for DMA transfer to finish
-    SCIWaitForDMAQueue(dq,
-                      SCI_INFINITE_TIMEOUT,
-                      NO_FLAGS,
-                      &error);
-    if(error != SCI_ERR_OK){
-      fprintf(stderr,"SCIWaitForDMAQueue failed: %s - Error code: (0x%x)\n",
-              SCIGetErrorString(error), error);
-      exit(EXIT_FAILURE);
+    if (result_format == RESULT_BITSTREAM)
+    {
+      // entropy code the frame into the bitstream region
+      write_frame(cm);
+      result_layout.bitstream_size = cm->e_ctx.len;
+    }
+    else if (result_format == RESULT_SPARSE)
+    {
+      // residuals are already packed, only record how many there are
+      result_layout.ncoeffs = sparse->ncoeffs;
     }
 
-    // variable increments from bottom of old encode function
-    ++cm->framenum;
-    ++cm->frames_since_keyframe;
+    // header of this frame, keyframe flag and bitstream size
+    memcpy((void *)out, &result_layout, sizeof(result_layout));
+    used[staged++] = result_segment_used(&result_layout);
+
     /*
-    * signal to x86/client to write and read next frame
+    *   results go back in batches of consecutive slots. A batch is sent
+    *   when it is full, when the next frame would wrap around the ring or
+    *   when the next image has not arrived yet, so no result waits for
+    *   input.
     */
-    remote_comms->packet.cmd = CMD_DONE;
+    if (staged < batch && slot + 1 < ring_depth &&
+        local_comms->seq[slot + 1] == n + 2)
+    {
+      continue;
+    }
+
+    uint32_t first = n + 1 - staged;
+    int first_slot = first % ring_depth;
+
+    // wait until the client has written the frames that used these slots
+    DOORBELL_WAIT(&doorbell, n - local_comms->ack < (uint32_t)ring_depth);
+
+    /*
+    *   transfer the used part of the encoding results from the staging
+    *   slots to the ring slots of these frames in the remote segment. Dense
+    *   results fill their slots, so the batch goes in one transfer.
+    */
+    if (result_format == RESULT_RESIDUALS)
+    {
+      transport_copy(&transport, &result_localSegment, 0,
+                     &result_remoteSegment,
+                     SEGMENT_SLOT_OFFSET(result_layout.size, first_slot),
+                     SEGMENT_SLOT_OFFSET(result_layout.size, staged - 1) +
+                     used[staged - 1]);
+    }
+    else
+    {
+      for (i = 0; i < staged; ++i)
+      {
+        transport_copy(&transport, &result_localSegment,
+                       SEGMENT_SLOT_OFFSET(result_layout.size, i),
+                       &result_remoteSegment,
+                       SEGMENT_SLOT_OFFSET(result_layout.size,
+                                           first_slot + i),
+                       used[i]);
+      }
+    }
+
+    /*
+    * signal to x86/client that the results of the batch are in their slots
+    */
+    for (i = 0; i < staged; ++i)
+    {
+      remote_comms->seq[(first + i) % ring_depth] = first + i + 1;
+    }
+    doorbell_ring(&client_doorbell);
+    staged = 0;
   }
-  free(image->Y);
-  free(image->U);
-  free(image->V);
-  free(image);
 
-  SCITerminate();
+  doorbell_report(&doorbell, "Server");
+  doorbell_disconnect(&client_doorbell);
+  doorbell_destroy(&doorbell);
+
+  transport_disconnect_segment(&transport, &result_remoteSegment);
+  transport_disconnect_segment(&transport, &remoteSegment_comms);
+  transport_remove_segment(&transport, &result_localSegment);
+  transport_remove_segment(&transport, &localSegment);
+  transport_remove_segment(&transport, &localSegment_comms);
+  transport_close(&transport);
 }
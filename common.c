@@ -11,7 +11,7 @@
 #include "dsp.h"
 
 void dequantize_idct_row(int16_t *in_data, uint8_t *prediction, int w, int h,
-    int y, uint8_t *out_data, uint8_t *quantization)
+    int y, uint8_t *out_data, int out_stride, uint8_t *quantization)
 {
   int x;
 
@@ -35,26 +35,61 @@ void dequantize_idct_row(int16_t *in_data, uint8_t *prediction, int w, int h,
         if (tmp < 0) { tmp = 0; }
         else if (tmp > 255) { tmp = 255; }
 
-        out_data[i*w+j+x] = tmp;
+        out_data[i*out_stride+j+x] = tmp;
       }
     }
   }
 }
 
 void dequantize_idct(int16_t *in_data, uint8_t *prediction, uint32_t width,
-    uint32_t height, uint8_t *out_data, uint8_t *quantization)
+    uint32_t height, uint8_t *out_data, uint32_t out_stride,
+    uint8_t *quantization)
 {
-  int y;
+  dequantize_idct_rows(in_data, prediction, width, height, 0, height,
+      out_data, out_stride, quantization);
+}
+
+/* Like dequantize_idct(), for rows top to bottom only */
+void dequantize_idct_rows(int16_t *in_data, uint8_t *prediction,
+    uint32_t width, uint32_t height, uint32_t top, uint32_t bottom,
+    uint8_t *out_data, uint32_t out_stride, uint8_t *quantization)
+{
+  uint32_t y;
 
-  for (y = 0; y < height; y += 8)
+  for (y = top; y < bottom; y += 8)
   {
     dequantize_idct_row(in_data+y*width, prediction+y*width, width, height, y,
-        out_data+y*width, quantization);
+        out_data+y*out_stride, out_stride, quantization);
   }
 }
 
+/* Append the nonzero coefficients of block b to the sparse residuals */
+static void sparse_pack_block(struct sparse_residuals *sparse, int component,
+    int b, int16_t *coeffs)
+{
+  struct sparse_plane *plane = &sparse->plane[component];
+  uint64_t nonzero = 0;
+  int i, last = 0;
+
+  plane->start[b] = sparse->ncoeffs;
+
+  for (i = 0; i < 64; ++i)
+  {
+    if (coeffs[i])
+    {
+      nonzero |= 1ULL << i;
+      sparse->coeffs[sparse->ncoeffs++] = coeffs[i];
+      last = i + 1;
+    }
+  }
+
+  plane->nonzero[b] = nonzero;
+  plane->last[b] = last;
+}
+
 void dct_quantize_row(uint8_t *in_data, uint8_t *prediction, int w, int h,
-    int16_t *out_data, uint8_t *quantization)
+    int y, int16_t *out_data, uint8_t *quantization,
+    struct sparse_residuals *sparse, int component)
 {
   int x;
 
@@ -77,18 +112,34 @@ void dct_quantize_row(uint8_t *in_data, uint8_t *prediction, int w, int h,
        continous. This allows us to ignore stride in DCT/iDCT and other
        functions. */
     dct_quant_block_8x8(block, out_data+(x*8), quantization);
+
+    if (sparse)
+    {
+      sparse_pack_block(sparse, component, (y/8)*(w/8) + x/8,
+          out_data+(x*8));
+    }
   }
 }
 
 void dct_quantize(uint8_t *in_data, uint8_t *prediction, uint32_t width,
-    uint32_t height, int16_t *out_data, uint8_t *quantization)
+    uint32_t height, int16_t *out_data, uint8_t *quantization,
+    struct sparse_residuals *sparse, int component)
 {
-  int y;
+  dct_quantize_rows(in_data, prediction, width, height, 0, height, out_data,
+      quantization, sparse, component);
+}
+
+/* Like dct_quantize(), for rows top to bottom only */
+void dct_quantize_rows(uint8_t *in_data, uint8_t *prediction, uint32_t width,
+    uint32_t height, uint32_t top, uint32_t bottom, int16_t *out_data,
+    uint8_t *quantization, struct sparse_residuals *sparse, int component)
+{
+  uint32_t y;
 
-  for (y = 0; y < height; y += 8)
+  for (y = top; y < bottom; y += 8)
   {
-    dct_quantize_row(in_data+y*width, prediction+y*width, width, height,
-        out_data+y*width, quantization);
+    dct_quantize_row(in_data+y*width, prediction+y*width, width, height, y,
+        out_data+y*width, quantization, sparse, component);
   }
 }
 
@@ -97,14 +148,15 @@ void destroy_frame(struct frame *f)
   /* First frame doesn't have a reconstructed frame to destroy */
   if (!f) { return; }
 
-  free(f->recons->Y);
-  free(f->recons->U);
-  free(f->recons->V);
+  free(f->recons_buf);
   free(f->recons);
 
-  free(f->residuals->Ydct);
-  free(f->residuals->Udct);
-  free(f->residuals->Vdct);
+  if (!f->borrowed_residuals)
+  {
+    free(f->residuals->Ydct);
+    free(f->residuals->Udct);
+    free(f->residuals->Vdct);
+  }
   free(f->residuals);
 
   free(f->predicted->Y);
@@ -112,23 +164,67 @@ void destroy_frame(struct frame *f)
   free(f->predicted->V);
   free(f->predicted);
 
-  free(f->mbs[Y_COMPONENT]);
-  free(f->mbs[U_COMPONENT]);
-  free(f->mbs[V_COMPONENT]);
+  if (!f->borrowed_mbs)
+  {
+    free(f->mbs[Y_COMPONENT]);
+    free(f->mbs[U_COMPONENT]);
+    free(f->mbs[V_COMPONENT]);
+  }
 
   free(f);
 }
 
 struct frame* create_frame(struct c63_common *cm, yuv_t *image)
+{
+  return create_frame_in(cm, image, NULL, NULL);
+}
+
+/*
+*   create_frame() with the macroblocks in mbs and the residuals in dct
+*   unless they are NULL, so the encoder writes them straight to where they
+*   are sent from. The macroblocks are cleared like allocated ones, while
+*   every block of the residuals is overwritten when it is encoded.
+*   destroy_frame() leaves them to the caller.
+*/
+struct frame* create_frame_in(struct c63_common *cm, yuv_t *image,
+    struct macroblock **mbs, int16_t **dct)
 {
   struct frame *f = malloc(sizeof(struct frame));
 
   f->orig = image;
 
+  // the planes of recons inside their borders, see REF_BORDER()
+  uint8_t **recons[COLOR_COMPONENTS];
+  size_t size = 0;
+  int c;
+
+  for (c = 0; c < COLOR_COMPONENTS; ++c)
+  {
+    size += REF_STRIDE(cm, c) * (cm->padh[c] + 2 * REF_BORDER(c));
+  }
+
   f->recons = malloc(sizeof(yuv_t));
-  f->recons->Y = malloc(cm->ypw * cm->yph);
-  f->recons->U = malloc(cm->upw * cm->uph);
-  f->recons->V = malloc(cm->vpw * cm->vph);
+  f->recons_buf = malloc(size);
+  if (!f->recons || !f->recons_buf)
+  {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  f->extended = 0;
+
+  recons[Y_COMPONENT] = &f->recons->Y;
+  recons[U_COMPONENT] = &f->recons->U;
+  recons[V_COMPONENT] = &f->recons->V;
+
+  uint8_t *plane = f->recons_buf;
+  for (c = 0; c < COLOR_COMPONENTS; ++c)
+  {
+    int b = REF_BORDER(c);
+    int stride = REF_STRIDE(cm, c);
+
+    *recons[c] = plane + b*stride + b;
+    plane += stride * (cm->padh[c] + 2*b);
+  }
 
   f->predicted = malloc(sizeof(yuv_t));
   f->predicted->Y = calloc(cm->ypw * cm->yph, sizeof(uint8_t));
@@ -136,23 +232,133 @@ struct frame* create_frame(struct c63_common *cm, yuv_t *image)
   f->predicted->V = calloc(cm->vpw * cm->vph, sizeof(uint8_t));
 
   f->residuals = malloc(sizeof(dct_t));
-  f->residuals->Ydct = calloc(cm->ypw * cm->yph, sizeof(int16_t));
-  f->residuals->Udct = calloc(cm->upw * cm->uph, sizeof(int16_t));
-  f->residuals->Vdct = calloc(cm->vpw * cm->vph, sizeof(int16_t));
+  f->borrowed_residuals = dct != NULL;
+  if (dct)
+  {
+    f->residuals->Ydct = dct[Y_COMPONENT];
+    f->residuals->Udct = dct[U_COMPONENT];
+    f->residuals->Vdct = dct[V_COMPONENT];
+  }
+  else
+  {
+    f->residuals->Ydct = calloc(cm->ypw * cm->yph, sizeof(int16_t));
+    f->residuals->Udct = calloc(cm->upw * cm->uph, sizeof(int16_t));
+    f->residuals->Vdct = calloc(cm->vpw * cm->vph, sizeof(int16_t));
+  }
+
+  f->sparse = NULL;
 
-  f->mbs[Y_COMPONENT] =
-    calloc(cm->mb_rows * cm->mb_cols, sizeof(struct macroblock));
-  f->mbs[U_COMPONENT] =
-    calloc(cm->mb_rows/2 * cm->mb_cols/2, sizeof(struct macroblock));
-  f->mbs[V_COMPONENT] =
-    calloc(cm->mb_rows/2 * cm->mb_cols/2, sizeof(struct macroblock));
+  f->borrowed_mbs = mbs != NULL;
+  if (mbs)
+  {
+    f->mbs[Y_COMPONENT] = mbs[Y_COMPONENT];
+    f->mbs[U_COMPONENT] = mbs[U_COMPONENT];
+    f->mbs[V_COMPONENT] = mbs[V_COMPONENT];
+
+    memset(f->mbs[Y_COMPONENT], 0,
+           cm->mb_rows * cm->mb_cols * sizeof(struct macroblock));
+    memset(f->mbs[U_COMPONENT], 0,
+           cm->mb_rows/2 * cm->mb_cols/2 * sizeof(struct macroblock));
+    memset(f->mbs[V_COMPONENT], 0,
+           cm->mb_rows/2 * cm->mb_cols/2 * sizeof(struct macroblock));
+  }
+  else
+  {
+    f->mbs[Y_COMPONENT] =
+      calloc(cm->mb_rows * cm->mb_cols, sizeof(struct macroblock));
+    f->mbs[U_COMPONENT] =
+      calloc(cm->mb_rows/2 * cm->mb_cols/2, sizeof(struct macroblock));
+    f->mbs[V_COMPONENT] =
+      calloc(cm->mb_rows/2 * cm->mb_cols/2, sizeof(struct macroblock));
+  }
 
   return f;
 }
 
-void dump_image(yuv_t *image, int w, int h, FILE *fp)
+/*
+*   Fill the borders of the reconstruction of f with copies of its edge
+*   pixels. Only the first call does it, so every motion estimation and
+*   compensation of a frame can make sure its reference is extended, after
+*   all the rows it reads are reconstructed. Threads that share the
+*   reference have to have it extended before they start.
+*/
+void extend_frame(struct c63_common *cm, struct frame *f)
 {
-  fwrite(image->Y, 1, w*h, fp);
-  fwrite(image->U, 1, w*h/4, fp);
-  fwrite(image->V, 1, w*h/4, fp);
+  uint8_t *recons[COLOR_COMPONENTS] = { f->recons->Y, f->recons->U,
+                                        f->recons->V };
+  int c;
+
+  if (f->extended) { return; }
+
+  for (c = 0; c < COLOR_COMPONENTS; ++c)
+  {
+    extend_plane(recons[c], cm->padw[c], cm->padh[c], REF_STRIDE(cm, c),
+        REF_BORDER(c));
+  }
+
+  f->extended = 1;
+}
+
+/*
+*   Fill the border of b pixels around the w by h pixels at plane, rows
+*   stride bytes apart, with copies of their edge pixels
+*/
+void extend_plane(uint8_t *plane, int w, int h, int stride, int b)
+{
+  int y;
+
+  for (y = 0; y < h; ++y)
+  {
+    uint8_t *row = plane + y*stride;
+
+    memset(row - b, row[0], b);
+    memset(row + w, row[w-1], b);
+  }
+
+  for (y = 1; y <= b; ++y)
+  {
+    memcpy(plane - y*stride - b, plane - b, w + 2*b);
+    memcpy(plane + (h-1+y)*stride - b, plane + (h-1)*stride - b, w + 2*b);
+  }
+}
+
+/*
+*   Write the w by h pixels of image as planar 4:2:0, its luma rows are
+*   stride[Y_COMPONENT] bytes apart and so on
+*/
+void dump_image(yuv_t *image, const uint32_t *stride, int w, int h, FILE *fp)
+{
+  uint8_t *planes[COLOR_COMPONENTS] = { image->Y, image->U, image->V };
+  int c, y;
+
+  for (c = 0; c < COLOR_COMPONENTS; ++c)
+  {
+    int pw = c ? w / 2 : w;
+    int ph = c ? h / 2 : h;
+
+    for (y = 0; y < ph; ++y)
+    {
+      fwrite(planes[c] + y*stride[c], 1, pw, fp);
+    }
+  }
+}
+
+/* Like dump_image(), into the w*h*3/2 bytes at out */
+void pack_image(yuv_t *image, const uint32_t *stride, int w, int h,
+    uint8_t *out)
+{
+  uint8_t *planes[COLOR_COMPONENTS] = { image->Y, image->U, image->V };
+  int c, y;
+
+  for (c = 0; c < COLOR_COMPONENTS; ++c)
+  {
+    int pw = c ? w / 2 : w;
+    int ph = c ? h / 2 : h;
+
+    for (y = 0; y < ph; ++y)
+    {
+      memcpy(out, planes[c] + y*stride[c], pw);
+      out += pw;
+    }
+  }
 }
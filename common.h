@@ -8,14 +8,34 @@
 // Declarations
 struct frame* create_frame(struct c63_common *cm, yuv_t *image);
 
+struct frame* create_frame_in(struct c63_common *cm, yuv_t *image,
+    struct macroblock **mbs, int16_t **dct);
+
 void dct_quantize(uint8_t *in_data, uint8_t *prediction, uint32_t width,
-    uint32_t height, int16_t *out_data, uint8_t *quantization);
+    uint32_t height, int16_t *out_data, uint8_t *quantization,
+    struct sparse_residuals *sparse, int component);
+
+void dct_quantize_rows(uint8_t *in_data, uint8_t *prediction, uint32_t width,
+    uint32_t height, uint32_t top, uint32_t bottom, int16_t *out_data,
+    uint8_t *quantization, struct sparse_residuals *sparse, int component);
 
 void dequantize_idct(int16_t *in_data, uint8_t *prediction, uint32_t width,
-    uint32_t height, uint8_t *out_data, uint8_t *quantization);
+    uint32_t height, uint8_t *out_data, uint32_t out_stride,
+    uint8_t *quantization);
+
+void dequantize_idct_rows(int16_t *in_data, uint8_t *prediction,
+    uint32_t width, uint32_t height, uint32_t top, uint32_t bottom,
+    uint8_t *out_data, uint32_t out_stride, uint8_t *quantization);
 
 void destroy_frame(struct frame *f);
 
-void dump_image(yuv_t *image, int w, int h, FILE *fp);
+void extend_frame(struct c63_common *cm, struct frame *f);
+
+void extend_plane(uint8_t *plane, int w, int h, int stride, int b);
+
+void dump_image(yuv_t *image, const uint32_t *stride, int w, int h, FILE *fp);
+
+void pack_image(yuv_t *image, const uint32_t *stride, int w, int h,
+    uint8_t *out);
 
 #endif  /* C63_COMMON_H_ */
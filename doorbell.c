@@ -0,0 +1,108 @@
+#define _POSIX_C_SOURCE 200809L   // clock_gettime()
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "doorbell.h"
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Tell the cpu we are in a spin loop */
+static void cpu_relax(void)
+{
+#if defined(__aarch64__) || defined(__arm__)
+  __asm__ __volatile__("yield" ::: "memory");
+#elif defined(__x86_64__) || defined(__i386__)
+  __asm__ __volatile__("pause" ::: "memory");
+#else
+  __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+/* Create the interrupt the peers ring */
+void doorbell_create(struct doorbell *db, struct transport *t,
+    unsigned int intno, unsigned int spin)
+{
+  memset(db, 0, sizeof(*db));
+  db->transport = t;
+  db->spin = spin;
+
+  transport_create_interrupt(t, &db->local, intno);
+}
+
+/* Connect to the interrupt of the peer, waiting until it has been created */
+void doorbell_connect(struct doorbell_peer *peer, struct transport *t,
+    unsigned int intno)
+{
+  peer->transport = t;
+  transport_connect_interrupt(t, &peer->remote, intno);
+}
+
+void doorbell_ring(struct doorbell_peer *peer)
+{
+  transport_trigger_interrupt(peer->transport, &peer->remote);
+}
+
+void doorbell_disconnect(struct doorbell_peer *peer)
+{
+  transport_disconnect_interrupt(peer->transport, &peer->remote);
+}
+
+void doorbell_wait_begin(struct doorbell *db, struct doorbell_wait *w)
+{
+  (void)db;
+
+  w->polls = 0;
+  w->start = now();
+}
+
+/* One round of waiting, spin then yield then block on the interrupt */
+void doorbell_wait_step(struct doorbell *db, struct doorbell_wait *w)
+{
+  if (w->polls < db->spin)
+  {
+    cpu_relax();
+  }
+  else if (w->polls < db->spin + DOORBELL_YIELDS)
+  {
+    sched_yield();
+  }
+  else
+  {
+    // a timeout is not an error, the caller checks its condition again
+    transport_wait_interrupt(db->transport, &db->local, DOORBELL_BLOCK_TIMEOUT);
+  }
+
+  ++w->polls;
+}
+
+void doorbell_wait_end(struct doorbell *db, struct doorbell_wait *w)
+{
+  db->wait_time += now() - w->start;
+  ++db->waits;
+
+  if (w->polls <= db->spin) { ++db->spins; }
+  else if (w->polls <= db->spin + DOORBELL_YIELDS) { ++db->yields; }
+  else { ++db->blocks; }
+}
+
+void doorbell_report(struct doorbell *db, const char *name)
+{
+  printf("%s waited %.3f s in %" PRIu64 " waits, resolved by spinning %"
+         PRIu64 ", yielding %" PRIu64 " and blocking %" PRIu64 "\n",
+         name, db->wait_time, db->waits, db->spins, db->yields, db->blocks);
+}
+
+void doorbell_destroy(struct doorbell *db)
+{
+  transport_remove_interrupt(db->transport, &db->local);
+}
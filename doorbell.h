@@ -0,0 +1,90 @@
+#ifndef C63_DOORBELL_H_
+#define C63_DOORBELL_H_
+
+#include <inttypes.h>
+#include <stdint.h>
+
+#include "transport.h"
+
+/*
+*   Doorbell between client and server. The state itself stays in struct
+*   comms, the doorbell only tells the peer that it changed. Every peer rings
+*   our doorbell through its struct doorbell_peer, so one doorbell wakes us
+*   whichever peer wrote to our comms. A waiter first
+*   polls its comms spin times, then yields the cpu DOORBELL_YIELDS times and
+*   then blocks on its transport interrupt until the peer rings it. The block
+*   has a timeout, so a ring that comes before we block only costs latency.
+*/
+
+#define DOORBELL_DEFAULT_SPIN 4096
+#define DOORBELL_YIELDS 64
+#define DOORBELL_BLOCK_TIMEOUT 10   // ms
+
+struct doorbell
+{
+  struct transport *transport;
+  struct transport_interrupt local;   // rung by the peers
+  unsigned int spin;                  // polls before yielding
+
+  // time spent waiting and how the waits were resolved
+  uint64_t waits;
+  uint64_t spins;
+  uint64_t yields;
+  uint64_t blocks;
+  double wait_time;                   // seconds
+};
+
+// the doorbell of a peer, rung after writing to its comms
+struct doorbell_peer
+{
+  struct transport *transport;
+  struct transport_interrupt remote;
+};
+
+// state of a single wait, see DOORBELL_WAIT
+struct doorbell_wait
+{
+  unsigned int polls;
+  double start;
+};
+
+// Declarations
+void doorbell_create(struct doorbell *db, struct transport *t,
+    unsigned int intno, unsigned int spin);
+
+void doorbell_connect(struct doorbell_peer *peer, struct transport *t,
+    unsigned int intno);
+
+void doorbell_ring(struct doorbell_peer *peer);
+
+void doorbell_disconnect(struct doorbell_peer *peer);
+
+void doorbell_wait_begin(struct doorbell *db, struct doorbell_wait *w);
+
+void doorbell_wait_step(struct doorbell *db, struct doorbell_wait *w);
+
+void doorbell_wait_end(struct doorbell *db, struct doorbell_wait *w);
+
+void doorbell_report(struct doorbell *db, const char *name);
+
+void doorbell_destroy(struct doorbell *db);
+
+/*
+*   Wait until cond holds, cond is evaluated again after every poll, yield
+*   and wake up. A wait that does not have to wait is not counted.
+*/
+#define DOORBELL_WAIT(db, cond)                 \
+  do {                                          \
+    if (!(cond))                                \
+    {                                           \
+      struct doorbell_wait w_;                  \
+      doorbell_wait_begin((db), &w_);           \
+      while (!(cond))                           \
+      {                                         \
+        doorbell_wait_step((db), &w_);          \
+      }                                         \
+      doorbell_wait_end((db), &w_);             \
+    }                                           \
+  } while (0)
+
+#endif  /* C63_DOORBELL_H_ */
@@ -18,6 +18,8 @@ static void transpose_block(float *in_data, float *out_data)
   }
 }
 
+#ifdef __ARM_NEON
+
 static void dct_1d(float *in_data, float *out_data)
 {
 
@@ -208,6 +210,40 @@ static void idct_1d(float *in_data, float *out_data)
 
 }
 
+#else
+
+/*
+*   Plain C versions of the NEON code above. The sums are done in the same
+*   order as vaddq_f32() and vaddvq_f32() do them, so both give the same
+*   coefficients and a frame can be encoded partly on either side.
+*/
+static float dot_8(const float *in, const float *lookup)
+{
+  float r0 = in[0] * lookup[0] + in[4] * lookup[4];
+  float r1 = in[1] * lookup[1] + in[5] * lookup[5];
+  float r2 = in[2] * lookup[2] + in[6] * lookup[6];
+  float r3 = in[3] * lookup[3] + in[7] * lookup[7];
+
+  return (r0 + r1) + (r2 + r3);
+}
+
+static void dct_1d(float *in_data, float *out_data)
+{
+  int i;
+
+  // dctlookup_T is a transposed version of dctlookup
+  for (i = 0; i < 8; ++i) { out_data[i] = dot_8(in_data, dctlookup_T[i]); }
+}
+
+static void idct_1d(float *in_data, float *out_data)
+{
+  int i;
+
+  for (i = 0; i < 8; ++i) { out_data[i] = dot_8(in_data, dctlookup[i]); }
+}
+
+#endif  /* __ARM_NEON */
+
 static void scale_block(float *in_data, float *out_data)
 {
   int u, v;
@@ -302,70 +338,193 @@ void dequant_idct_block_8x8(int16_t *in_data, int16_t *out_data,
   for (i = 0; i < 64; ++i) { out_data[i] = mb[i]; }
 }
 
-void sad_block_8x8(uint8_t *block1, uint8_t *block2, int stride, int *result)
+#ifdef __ARM_NEON
+
+void sad_block_8x8(uint8_t *block1, uint8_t *block2, int stride,
+    int ref_stride, int *result)
 {
   
 
   // Neon Intrinsics varriables
   uint8x8_t b_1, b_2;           // variables hold 8 block1 and block 2 elements
   uint16x8_t sad, total_sad;    // variables calcualte sad and hold total sad.
-  *result = 0; 
+  *result = 0;
+  total_sad = vdupq_n_u16(0);
 
     /*  unrolled loop with Neon Intrinsics*/
     // 0
     b_1 = vld1_u8(block1 + 0*stride); // load 8 elems from block1
-    b_2 = vld1_u8(block2 + 0*stride); // load 8 elems from block2
+    b_2 = vld1_u8(block2 + 0*ref_stride); // load 8 elems from block2
     
     sad = vabdl_u8(b_2, b_1);        // calculate abs difference long, uint8x8_t -> uint16x8_t
     total_sad = vaddq_u16(sad, total_sad);   // add to total sad amount
     
     // 1
     b_1 = vld1_u8(block1 + 1*stride); // load 8 elems from block1
-    b_2 = vld1_u8(block2 + 1*stride); // load 8 elems from block2
+    b_2 = vld1_u8(block2 + 1*ref_stride); // load 8 elems from block2
     
     sad = vabdl_u8(b_2, b_1);        // calculate abs difference long, uint8x8_t -> uint16x8_t
     total_sad = vaddq_u16(sad, total_sad);   // add to total sad amount
 
     // 2
     b_1 = vld1_u8(block1 + 2*stride); // load 8 elems from block1
-    b_2 = vld1_u8(block2 + 2*stride); // load 8 elems from block2
+    b_2 = vld1_u8(block2 + 2*ref_stride); // load 8 elems from block2
     
     sad = vabdl_u8(b_2, b_1);        // calculate abs difference long, uint8x8_t -> uint16x8_t
     total_sad = vaddq_u16(sad, total_sad);   // add to total sad amount
     
     // 3
     b_1 = vld1_u8(block1 + 3*stride); // load 8 elems from block1
-    b_2 = vld1_u8(block2 + 3*stride); // load 8 elems from block2
+    b_2 = vld1_u8(block2 + 3*ref_stride); // load 8 elems from block2
     
     sad = vabdl_u8(b_2, b_1);        // calculate abs difference long, uint8x8_t -> uint16x8_t
     total_sad = vaddq_u16(sad, total_sad);   // add to total sad amount
     
     // 4
     b_1 = vld1_u8(block1 + 4*stride); // load 8 elems from block1
-    b_2 = vld1_u8(block2 + 4*stride); // load 8 elems from block2
+    b_2 = vld1_u8(block2 + 4*ref_stride); // load 8 elems from block2
     
     sad = vabdl_u8(b_2, b_1);        // calculate abs difference long, uint8x8_t -> uint16x8_t
     total_sad = vaddq_u16(sad, total_sad);   // add to total sad amount
     
     // 5
     b_1 = vld1_u8(block1 + 5*stride); // load 8 elems from block1
-    b_2 = vld1_u8(block2 + 5*stride); // load 8 elems from block2
+    b_2 = vld1_u8(block2 + 5*ref_stride); // load 8 elems from block2
     
     sad = vabdl_u8(b_2, b_1);        // calculate abs difference long, uint8x8_t -> uint16x8_t
     total_sad = vaddq_u16(sad, total_sad);   // add to total sad amount
   
     // 6
     b_1 = vld1_u8(block1 + 6*stride); // load 8 elems from block1
-    b_2 = vld1_u8(block2 + 6*stride); // load 8 elems from block2
+    b_2 = vld1_u8(block2 + 6*ref_stride); // load 8 elems from block2
     
     sad = vabdl_u8(b_2, b_1);        // calculate abs difference long, uint8x8_t -> uint16x8_t
     total_sad = vaddq_u16(sad, total_sad);   // add to total sad amount
   
     // 7
     b_1 = vld1_u8(block1 + 7*stride); // load 8 elems from block1
-    b_2 = vld1_u8(block2 + 7*stride); // load 8 elems from block2
+    b_2 = vld1_u8(block2 + 7*ref_stride); // load 8 elems from block2
     
     sad = vabdl_u8(b_2, b_1);        // calculate abs difference long, uint8x8_t -> uint16x8_t
     total_sad = vaddq_u16(sad, total_sad);
     *result += vaddvq_u16(total_sad);      // vector wide sum of total sad amount
 }
+
+#else
+
+void sad_block_8x8(uint8_t *block1, uint8_t *block2, int stride,
+    int ref_stride, int *result)
+{
+  int u, v;
+
+  *result = 0;
+
+  for (v = 0; v < 8; ++v)
+  {
+    for (u = 0; u < 8; ++u)
+    {
+      *result += abs(block2[v*ref_stride+u] - block1[v*stride+u]);
+    }
+  }
+}
+
+#endif  /* __ARM_NEON */
+
+/*
+*   SADs of the 8x8 block at block1 against the SAD_BATCH blocks at block2,
+*   block2 + 1, ..., block2 + SAD_BATCH - 1, into result. The rows of block1
+*   are loaded once for all of them, and each row of the reference is one
+*   load of 16 bytes, which block2 has to have in every row.
+*/
+#ifdef __ARM_NEON
+
+// shift the reference row k pixels and add its differences to acc[k]
+#define SAD_ROW_OFFSET(k) \
+  acc[k] = vabal_u8(acc[k], vext_u8(r_lo, r_hi, k), b_1)
+
+void sad_block_8x8_x8(uint8_t *block1, uint8_t *block2, int stride,
+    int ref_stride, int *result)
+{
+  uint16x8_t acc[SAD_BATCH];
+  int k, v;
+
+  for (k = 0; k < SAD_BATCH; ++k) { acc[k] = vdupq_n_u16(0); }
+
+  for (v = 0; v < 8; ++v)
+  {
+    uint8x8_t b_1 = vld1_u8(block1 + v*stride);
+    uint8x16_t r = vld1q_u8(block2 + v*ref_stride);
+    uint8x8_t r_lo = vget_low_u8(r);
+    uint8x8_t r_hi = vget_high_u8(r);
+
+    acc[0] = vabal_u8(acc[0], r_lo, b_1);
+    SAD_ROW_OFFSET(1);
+    SAD_ROW_OFFSET(2);
+    SAD_ROW_OFFSET(3);
+    SAD_ROW_OFFSET(4);
+    SAD_ROW_OFFSET(5);
+    SAD_ROW_OFFSET(6);
+    SAD_ROW_OFFSET(7);
+  }
+
+  // three rounds of pairwise adds leave the sum of acc[k] in lane k
+  uint16x8_t s01 = vpaddq_u16(acc[0], acc[1]);
+  uint16x8_t s23 = vpaddq_u16(acc[2], acc[3]);
+  uint16x8_t s45 = vpaddq_u16(acc[4], acc[5]);
+  uint16x8_t s67 = vpaddq_u16(acc[6], acc[7]);
+  uint16x8_t sum = vpaddq_u16(vpaddq_u16(s01, s23), vpaddq_u16(s45, s67));
+
+  vst1q_s32(result, vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(sum))));
+  vst1q_s32(result + 4, vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(sum))));
+}
+
+#elif defined(__SSE2__)
+
+// SADs of the row o against the reference row shifted k and k + 1 pixels
+#define SAD_ROW_PAIR(k) \
+  _mm_sad_epu8(o, _mm_unpacklo_epi64(_mm_srli_si128(r, k), \
+                                     _mm_srli_si128(r, k + 1)))
+
+void sad_block_8x8_x8(uint8_t *block1, uint8_t *block2, int stride,
+    int ref_stride, int *result)
+{
+  // the SADs of offsets k and k + 1 are in the two halves of acc[k/2]
+  __m128i acc[SAD_BATCH / 2];
+  int k, v;
+
+  for (k = 0; k < SAD_BATCH / 2; ++k) { acc[k] = _mm_setzero_si128(); }
+
+  for (v = 0; v < 8; ++v)
+  {
+    __m128i o = _mm_loadl_epi64((__m128i *)(block1 + v*stride));
+    __m128i r = _mm_loadu_si128((__m128i *)(block2 + v*ref_stride));
+
+    o = _mm_unpacklo_epi64(o, o);
+
+    acc[0] = _mm_add_epi64(acc[0], SAD_ROW_PAIR(0));
+    acc[1] = _mm_add_epi64(acc[1], SAD_ROW_PAIR(2));
+    acc[2] = _mm_add_epi64(acc[2], SAD_ROW_PAIR(4));
+    acc[3] = _mm_add_epi64(acc[3], SAD_ROW_PAIR(6));
+  }
+
+  for (k = 0; k < SAD_BATCH / 2; ++k)
+  {
+    result[2*k] = _mm_cvtsi128_si32(acc[k]);
+    result[2*k+1] = _mm_cvtsi128_si32(_mm_srli_si128(acc[k], 8));
+  }
+}
+
+#else
+
+void sad_block_8x8_x8(uint8_t *block1, uint8_t *block2, int stride,
+    int ref_stride, int *result)
+{
+  int k;
+
+  for (k = 0; k < SAD_BATCH; ++k)
+  {
+    sad_block_8x8(block1, block2 + k, stride, ref_stride, &result[k]);
+  }
+}
+
+#endif  /* __ARM_NEON */
@@ -4,7 +4,19 @@
 #define ISQRT2 0.70710678118654f
 
 #include <inttypes.h>
+
+/*
+*   NEON on the tegra, plain C elsewhere, e.g. for the x86 client, which
+*   only has SSE2 for sad_block_8x8_x8()
+*/
+#ifdef __ARM_NEON
 #include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// reference positions of a sad_block_8x8_x8() call
+#define SAD_BATCH 8
 
 void dct_quant_block_8x8(int16_t *in_data, int16_t *out_data,
     uint8_t *quant_tbl);
@@ -12,6 +24,11 @@ void dct_quant_block_8x8(int16_t *in_data, int16_t *out_data,
 void dequant_idct_block_8x8(int16_t *in_data, int16_t *out_data,
     uint8_t *quant_tbl);
 
-void sad_block_8x8(uint8_t *block1, uint8_t *block2, int stride, int *result);
+// block2 is in the reference frame, its rows are ref_stride apart
+void sad_block_8x8(uint8_t *block1, uint8_t *block2, int stride,
+    int ref_stride, int *result);
+
+void sad_block_8x8_x8(uint8_t *block1, uint8_t *block2, int stride,
+    int ref_stride, int *result);
 
 #endif  /* C63_DSP_H_ */
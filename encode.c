@@ -0,0 +1,129 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "encode.h"
+#include "me.h"
+
+/*
+*   Advance to next frame, the new frame encodes image and fills sparse with
+*   the quantized residuals unless it is NULL. The macroblocks and residuals
+*   go to mbs and dct unless they are NULL, see create_frame_in().
+*/
+void c63_begin_frame(struct c63_common *cm, yuv_t *image,
+    struct sparse_residuals *sparse, struct macroblock **mbs, int16_t **dct)
+{
+  destroy_frame(cm->refframe);
+  cm->refframe = cm->curframe;
+
+  cm->curframe = create_frame_in(cm, image, mbs, dct);
+
+  cm->curframe->sparse = sparse;
+  if (sparse)
+  {
+    sparse->ncoeffs = 0;
+  }
+
+  /* Check if keyframe */
+  if (cm->framenum == 0 || cm->frames_since_keyframe == cm->keyframe_interval)
+  {
+    cm->curframe->keyframe = 1;
+    cm->frames_since_keyframe = 0;
+
+    fprintf(stderr, " (keyframe) ");
+  }
+  else { cm->curframe->keyframe = 0; }
+}
+
+void c63_encode_rows(struct c63_common *cm, int top, int bottom)
+{
+  yuv_t *image = cm->curframe->orig;
+  struct sparse_residuals *sparse = cm->curframe->sparse;
+
+  if (!cm->curframe->keyframe)
+  {
+    /* Motion Estimation */
+    c63_motion_estimate_rows(cm, top / 8, bottom / 8);
+
+    /* Motion Compensation */
+    c63_motion_compensate_rows(cm, top / 8, bottom / 8);
+  }
+
+  /* DCT and Quantization */
+  dct_quantize_rows(image->Y, cm->curframe->predicted->Y,
+      cm->padw[Y_COMPONENT], cm->padh[Y_COMPONENT], top, bottom,
+      cm->curframe->residuals->Ydct, cm->quanttbl[Y_COMPONENT], sparse,
+      Y_COMPONENT);
+
+  dct_quantize_rows(image->U, cm->curframe->predicted->U,
+      cm->padw[U_COMPONENT], cm->padh[U_COMPONENT], top / 2, bottom / 2,
+      cm->curframe->residuals->Udct, cm->quanttbl[U_COMPONENT], sparse,
+      U_COMPONENT);
+
+  dct_quantize_rows(image->V, cm->curframe->predicted->V,
+      cm->padw[V_COMPONENT], cm->padh[V_COMPONENT], top / 2, bottom / 2,
+      cm->curframe->residuals->Vdct, cm->quanttbl[V_COMPONENT], sparse,
+      V_COMPONENT);
+
+  /* Reconstruct frame for inter-prediction */
+  dequantize_idct_rows(cm->curframe->residuals->Ydct,
+      cm->curframe->predicted->Y, cm->ypw, cm->yph, top, bottom,
+      cm->curframe->recons->Y, REF_STRIDE(cm, Y_COMPONENT),
+      cm->quanttbl[Y_COMPONENT]);
+  dequantize_idct_rows(cm->curframe->residuals->Udct,
+      cm->curframe->predicted->U, cm->upw, cm->uph, top / 2, bottom / 2,
+      cm->curframe->recons->U, REF_STRIDE(cm, U_COMPONENT),
+      cm->quanttbl[U_COMPONENT]);
+  dequantize_idct_rows(cm->curframe->residuals->Vdct,
+      cm->curframe->predicted->V, cm->vpw, cm->vph, top / 2, bottom / 2,
+      cm->curframe->recons->V, REF_STRIDE(cm, V_COMPONENT),
+      cm->quanttbl[V_COMPONENT]);
+}
+
+void c63_end_frame(struct c63_common *cm)
+{
+  ++cm->framenum;
+  ++cm->frames_since_keyframe;
+}
+
+/*
+*   Copy width bytes of n rows at from, from_stride bytes apart, to the rows
+*   at to, to_stride bytes apart
+*/
+static void copy_plane_rows(uint8_t *to, uint32_t to_stride,
+    const uint8_t *from, uint32_t from_stride, uint32_t width, uint32_t n)
+{
+  uint32_t y;
+
+  for (y = 0; y < n; ++y)
+  {
+    memcpy(to + y*to_stride, from + y*from_stride, width);
+  }
+}
+
+/*
+*   Copy luma rows from_top to from_top + rows of from to the rows from
+*   to_top of to, and the chroma rows they cover. One of them is a
+*   reconstruction, REF_STRIDE() wide, and the other is dense, as the halo
+*   regions of the segments are; to_recons says which.
+*/
+void c63_copy_rows(struct c63_common *cm, yuv_t *to, uint32_t to_top,
+    yuv_t *from, uint32_t from_top, uint32_t rows, int to_recons)
+{
+  uint8_t *to_planes[COLOR_COMPONENTS] = { to->Y, to->U, to->V };
+  uint8_t *from_planes[COLOR_COMPONENTS] = { from->Y, from->U, from->V };
+  int c;
+
+  for (c = 0; c < COLOR_COMPONENTS; ++c)
+  {
+    uint32_t shift = c == Y_COMPONENT ? 0 : 1;
+    uint32_t to_stride = to_recons ? REF_STRIDE(cm, c) : cm->padw[c];
+    uint32_t from_stride = to_recons ? cm->padw[c] : REF_STRIDE(cm, c);
+
+    copy_plane_rows(to_planes[c] + (to_top >> shift) * to_stride, to_stride,
+        from_planes[c] + (from_top >> shift) * from_stride, from_stride,
+        cm->padw[c], rows >> shift);
+  }
+}
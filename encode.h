@@ -0,0 +1,32 @@
+#ifndef C63_ENCODE_H_
+#define C63_ENCODE_H_
+
+#include "c63.h"
+
+/*
+*   Encoding of a frame in bands of rows, so c63server can encode the whole
+*   frame and c63enc and c63server can each encode a part of it in split
+*   mode. A frame is encoded by
+*     - c63_begin_frame()   advance to the frame and decide if it is a keyframe
+*     - c63_encode_rows()   motion estimation and compensation, DCT and
+*                           reconstruction of luma rows top to bottom and the
+*                           chroma rows they cover. Rows are multiples of 16,
+*                           as a band has to cover whole chroma macroblocks.
+*     - c63_end_frame()     advance the frame counters
+*   Motion estimation reads the reference frame up to me_search_range rows
+*   outside the band, those rows have to be reconstructed by whoever encoded
+*   them before c63_encode_rows().
+*/
+
+// Declarations
+void c63_begin_frame(struct c63_common *cm, yuv_t *image,
+    struct sparse_residuals *sparse, struct macroblock **mbs, int16_t **dct);
+
+void c63_encode_rows(struct c63_common *cm, int top, int bottom);
+
+void c63_end_frame(struct c63_common *cm);
+
+void c63_copy_rows(struct c63_common *cm, yuv_t *to, uint32_t to_top,
+    yuv_t *from, uint32_t from_top, uint32_t rows, int to_recons);
+
+#endif  /* C63_ENCODE_H_ */
@@ -0,0 +1,242 @@
+#define _POSIX_C_SOURCE 200809L   // st_mtim
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "c63.h"
+#include "index.h"
+
+/*
+*   Find the end of the frame at *pos, and whether it is a keyframe. Returns
+*   -1 if there is no whole frame there.
+*/
+static int scan_frame(const uint8_t *data, size_t size, size_t *pos,
+    uint8_t *keyframe)
+{
+  size_t p = *pos;
+
+  if (p + 2 > size || data[p] != JPEG_DEF_MARKER ||
+      data[p+1] != JPEG_SOI_MARKER)
+  {
+    return -1;
+  }
+  p += 2;
+
+  *keyframe = 0;
+
+  while (1)
+  {
+    uint8_t marker;
+    size_t len;
+
+    if (p + 2 > size || data[p] != JPEG_DEF_MARKER) { return -1; }
+    marker = data[p+1];
+    p += 2;
+
+    if (marker == JPEG_EOI_MARKER)
+    {
+      *pos = p;
+      return 0;
+    }
+
+    if (p + 2 > size) { return -1; }
+    len = data[p] << 8 | data[p+1];
+
+    // DQT records 2 bytes short, its length is the three tables of parse_dqt()
+    if (marker == JPEG_DQT_MARKER) { len = 2 + COLOR_COMPONENTS * (1 + 64); }
+
+    if (len < 2 || p + len > size) { return -1; }
+
+    // the keyframe byte ends SOF0, see write_SOF0()
+    if (marker == JPEG_SOF_MARKER && len > 2) { *keyframe = data[p+len-1]; }
+
+    p += len;
+
+    if (marker != JPEG_SOS_MARKER) { continue; }
+
+    // the scan ends at the first 0xff that is not followed by a stuffed 0
+    while (1)
+    {
+      const uint8_t *ff = memchr(data + p, JPEG_DEF_MARKER, size - p);
+
+      if (!ff || ff + 1 >= data + size) { return -1; }
+      p = ff - data;
+
+      if (data[p+1] != 0) { break; }
+      p += 2;
+    }
+  }
+}
+
+/*
+*   Index the size bytes of a .c63 file at data. A frame cut short at the
+*   end is left out. Returns -1 if data does not start with a frame.
+*/
+int index_scan(struct c63_index *idx, const uint8_t *data, size_t size)
+{
+  uint32_t cap = 1024;
+  size_t pos = 0;
+
+  memset(idx, 0, sizeof(*idx));
+  idx->input_size = size;
+  idx->entries = malloc(cap * sizeof(*idx->entries));
+  if (!idx->entries)
+  {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  while (pos < size)
+  {
+    struct index_entry e;
+
+    memset(&e, 0, sizeof(e));
+    e.offset = pos;
+
+    if (scan_frame(data, size, &pos, &e.keyframe) < 0) { break; }
+
+    if (idx->frames == cap)
+    {
+      cap *= 2;
+      idx->entries = realloc(idx->entries, cap * sizeof(*idx->entries));
+      if (!idx->entries)
+      {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    idx->entries[idx->frames++] = e;
+  }
+
+  return idx->frames > 0 ? 0 : -1;
+}
+
+/*
+*   Load the index at path if it is one of the input open at input_fd, as it
+*   is now: same size and modification time. Returns -1 if there is none,
+*   or it is stale or damaged.
+*/
+int index_load(struct c63_index *idx, const char *path, int input_fd)
+{
+  struct index_file_header h;
+  struct stat st;
+  FILE *fp;
+
+  memset(idx, 0, sizeof(*idx));
+
+  if (fstat(input_fd, &st) < 0) { return -1; }
+
+  fp = fopen(path, "rb");
+  if (!fp) { return -1; }
+
+  if (fread(&h, sizeof(h), 1, fp) != 1 || h.magic != INDEX_MAGIC ||
+      h.version != INDEX_VERSION || h.header_size != sizeof(h) ||
+      h.entry_size != sizeof(struct index_entry) ||
+      h.input_size != (uint64_t)st.st_size ||
+      h.input_mtime_sec != (int64_t)st.st_mtim.tv_sec ||
+      h.input_mtime_nsec != (uint32_t)st.st_mtim.tv_nsec || h.frames == 0)
+  {
+    fclose(fp);
+    return -1;
+  }
+
+  idx->entries = malloc(h.frames * sizeof(*idx->entries));
+  if (!idx->entries)
+  {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  if (fread(idx->entries, sizeof(*idx->entries), h.frames, fp) != h.frames)
+  {
+    fclose(fp);
+    index_free(idx);
+    return -1;
+  }
+
+  fclose(fp);
+
+  idx->input_size = h.input_size;
+  idx->frames = h.frames;
+
+  return 0;
+}
+
+/*
+*   Write the index of the input open at input_fd to path, returns -1 if it
+*   can not be written.
+*/
+int index_save(const struct c63_index *idx, const char *path, int input_fd)
+{
+  struct index_file_header h;
+  struct stat st;
+  FILE *fp;
+
+  if (fstat(input_fd, &st) < 0) { return -1; }
+
+  fp = fopen(path, "wb");
+  if (!fp) { return -1; }
+
+  memset(&h, 0, sizeof(h));
+  h.magic = INDEX_MAGIC;
+  h.version = INDEX_VERSION;
+  h.header_size = sizeof(h);
+  h.input_size = idx->input_size;
+  h.frames = idx->frames;
+  h.entry_size = sizeof(struct index_entry);
+  h.input_mtime_sec = st.st_mtim.tv_sec;
+  h.input_mtime_nsec = st.st_mtim.tv_nsec;
+
+  if (fwrite(&h, sizeof(h), 1, fp) != 1 ||
+      fwrite(idx->entries, sizeof(*idx->entries), idx->frames, fp) !=
+      idx->frames)
+  {
+    fclose(fp);
+    remove(path);
+    return -1;
+  }
+
+  if (fclose(fp) != 0)
+  {
+    remove(path);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Path of the sidecar index of input, to be freed by the caller */
+char *index_path(const char *input)
+{
+  char *path = malloc(strlen(input) + sizeof(INDEX_SUFFIX));
+  if (!path)
+  {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  strcpy(path, input);
+  strcat(path, INDEX_SUFFIX);
+
+  return path;
+}
+
+/* The last keyframe at or before frame, where decoding it has to start */
+uint32_t index_keyframe_before(const struct c63_index *idx, uint32_t frame)
+{
+  uint32_t i = MIN(frame, idx->frames - 1);
+
+  while (i > 0 && !idx->entries[i].keyframe) { --i; }
+
+  return i;
+}
+
+void index_free(struct c63_index *idx)
+{
+  free(idx->entries);
+  idx->entries = NULL;
+  idx->frames = 0;
+}
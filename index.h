@@ -0,0 +1,61 @@
+#ifndef C63_INDEX_H_
+#define C63_INDEX_H_
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+*   Frame index of a .c63 file, the offset of every frame and whether it is
+*   a keyframe. It is found by walking the markers of the frames, which
+*   only has to look at the bytes of the scans for the 0xff of the EOI
+*   marker. The index is kept in a sidecar file next to the input, see
+*   index_path(), which records the size and modification time of the input
+*   it was made for so a stale one is scanned again.
+*/
+
+#define INDEX_MAGIC 0x63363349      // "I36c" in memory on little endian
+#define INDEX_VERSION 2
+#define INDEX_SUFFIX ".idx"
+
+struct index_file_header
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t header_size;
+  uint64_t input_size;        // bytes of the .c63 file indexed
+  uint32_t frames;
+  uint32_t entry_size;
+  int64_t input_mtime_sec;    // st_mtim of the .c63 file indexed
+  uint32_t input_mtime_nsec;
+  uint32_t reserved;
+};
+
+struct index_entry
+{
+  uint64_t offset;            // of the SOI marker of the frame
+  uint8_t keyframe;
+  uint8_t reserved[7];
+};
+
+struct c63_index
+{
+  uint64_t input_size;
+  uint32_t frames;
+  struct index_entry *entries;
+};
+
+// Declarations
+int index_scan(struct c63_index *idx, const uint8_t *data, size_t size);
+
+int index_load(struct c63_index *idx, const char *path, int input_fd);
+
+int index_save(const struct c63_index *idx, const char *path, int input_fd);
+
+char *index_path(const char *input);
+
+uint32_t index_keyframe_before(const struct c63_index *idx, uint32_t frame);
+
+void index_free(struct c63_index *idx);
+
+#endif  /* C63_INDEX_H_ */
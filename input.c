@@ -0,0 +1,455 @@
+#define _POSIX_C_SOURCE 200809L   // posix_fadvise(), posix_madvise()
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "input.h"
+
+/* Read size bytes from fd, returns the bytes read, short at the end */
+static ssize_t read_fd(int fd, void *data, size_t size)
+{
+  size_t len = 0;
+
+  while (len < size)
+  {
+    ssize_t n = read(fd, (uint8_t *)data + len, size - len);
+    if (n < 0 && errno == EINTR) { continue; }
+    if (n < 0) { return -1; }
+    if (n == 0) { break; }
+
+    len += n;
+  }
+
+  return len;
+}
+
+/* Like read_fd(), starting with the bytes read to tell raw from Y4M */
+static ssize_t read_input(struct input *in, uint8_t *data, size_t size)
+{
+  size_t len = in->head_len < size ? in->head_len : size;
+  ssize_t n;
+
+  memcpy(data, in->head, len);
+  memmove(in->head, in->head + len, in->head_len - len);
+  in->head_len -= len;
+
+  n = read_fd(in->fd, data + len, size - len);
+
+  return n < 0 ? -1 : (ssize_t)len + n;
+}
+
+/* Y4M frames start with a FRAME line, without parameters here */
+static void check_frame_line(struct input *in, uint32_t frame,
+    const uint8_t *line)
+{
+  if (memcmp(line, Y4M_FRAME, in->frame_header) != 0)
+  {
+    fprintf(stderr, "Frame %u of the input does not start with a bare FRAME "
+            "line, Y4M frame parameters are not supported\n", frame);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+*   Read the FRAME line, if any, and the planes of frame into data. Returns
+*   the bytes read, short at the end.
+*/
+static ssize_t read_frame(struct input *in, uint32_t frame, uint8_t *data)
+{
+  uint8_t line[sizeof(Y4M_FRAME) - 1];
+  ssize_t len = 0;
+  ssize_t n;
+
+  if (in->frame_header)
+  {
+    len = read_input(in, line, in->frame_header);
+    if (len < (ssize_t)in->frame_header) { return len; }
+
+    check_frame_line(in, frame, line);
+  }
+
+  n = read_input(in, data, in->frame_size);
+
+  return n < 0 ? -1 : len + n;
+}
+
+/*
+*   Read ahead thread, keeps the ring filled with the frames following the
+*   one last read by input_read()
+*/
+static void *read_ahead(void *arg)
+{
+  struct input *in = arg;
+
+  pthread_mutex_lock(&in->lock);
+  while (!in->quit)
+  {
+    if (in->seek != UINT32_MAX)
+    {
+      off_t offset = in->header_size +
+        (off_t)in->seek * (in->frame_header + in->frame_size);
+
+      if (lseek(in->fd, offset, SEEK_SET) < 0)
+      {
+        in->error = errno;
+      }
+      in->head_len = 0;
+      in->first = in->seek;
+      in->count = 0;
+      in->seek = UINT32_MAX;
+      pthread_cond_broadcast(&in->cond);
+      continue;
+    }
+
+    uint32_t next = in->first + in->count;
+    if (in->count == INPUT_AHEAD || next >= in->frames || in->error)
+    {
+      pthread_cond_wait(&in->cond, &in->lock);
+      continue;
+    }
+
+    // the slot of next is not in the ring, so it is ours while unlocked
+    uint8_t *data = in->ahead + (size_t)(next % INPUT_AHEAD) * in->frame_size;
+    pthread_mutex_unlock(&in->lock);
+    ssize_t len = read_frame(in, next, data);
+    pthread_mutex_lock(&in->lock);
+
+    // the frame is of no use if the reader has moved elsewhere meanwhile
+    if (in->seek != UINT32_MAX) { continue; }
+
+    if (len < 0)
+    {
+      in->error = errno;
+    }
+    else if ((size_t)len < in->frame_header + in->frame_size)
+    {
+      in->frames = next;
+      in->partial = len > 0;
+    }
+    else
+    {
+      ++in->count;
+    }
+    pthread_cond_broadcast(&in->cond);
+  }
+  pthread_mutex_unlock(&in->lock);
+
+  return NULL;
+}
+
+/*
+*   Tell raw input from Y4M by its first bytes, and take the dimensions from
+*   the header of Y4M. Raw input keeps the bytes to read them again.
+*/
+static void read_header(struct input *in)
+{
+  char header[Y4M_HEADER_MAX];
+  char *token, *save;
+  uint32_t width = 0, height = 0;
+  size_t len = 0;
+  ssize_t n;
+
+  n = read_fd(in->fd, in->head, sizeof(in->head));
+  if (n < 0)
+  {
+    perror("read input file");
+    exit(EXIT_FAILURE);
+  }
+
+  if ((size_t)n < sizeof(in->head) ||
+      memcmp(in->head, Y4M_MAGIC, sizeof(in->head)) != 0)
+  {
+    in->head_len = n;
+    return;
+  }
+
+  // the rest of the header line
+  while (1)
+  {
+    if (len == sizeof(header) || read_fd(in->fd, &header[len], 1) != 1)
+    {
+      fprintf(stderr, "Y4M header of the input is cut off or too long\n");
+      exit(EXIT_FAILURE);
+    }
+    if (header[len] == '\n') { break; }
+    ++len;
+  }
+  header[len] = '\0';
+
+  in->header_size = sizeof(in->head) + len + 1;
+  in->frame_header = sizeof(Y4M_FRAME) - 1;
+
+  for (token = strtok_r(header, " ", &save); token;
+       token = strtok_r(NULL, " ", &save))
+  {
+    switch (token[0])
+    {
+      case 'W':
+        width = strtoul(token + 1, NULL, 10);
+        break;
+      case 'H':
+        height = strtoul(token + 1, NULL, 10);
+        break;
+      case 'C':
+        // every 4:2:0 chroma siting is read as is
+        if (strncmp(token + 1, "420", 3) != 0 ||
+            (token[4] && strcmp(token + 4, "jpeg") != 0 &&
+             strcmp(token + 4, "paldv") != 0 &&
+             strcmp(token + 4, "mpeg2") != 0))
+        {
+          fprintf(stderr, "Y4M colorspace %s is not supported, only "
+                  "4:2:0\n", token + 1);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      default:
+        // frame rate, interlacing, aspect ratio and comments do not matter
+        break;
+    }
+  }
+
+  if (width == 0 || height == 0)
+  {
+    fprintf(stderr, "Y4M header of the input has no dimensions\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if ((in->width && in->width != width) ||
+      (in->height && in->height != height))
+  {
+    fprintf(stderr, "Input is %ux%u, not the %ux%u given\n", width, height,
+            in->width, in->height);
+    exit(EXIT_FAILURE);
+  }
+
+  in->width = width;
+  in->height = height;
+}
+
+/*
+*   Open the input at path, "-" for standard input. width and height are
+*   those of raw input, Y4M input brings its own and may leave them 0.
+*/
+void input_open(struct input *in, const char *path, uint32_t width,
+    uint32_t height)
+{
+  struct stat st;
+  int err;
+
+  memset(in, 0, sizeof(*in));
+  in->width = width;
+  in->height = height;
+  in->frames = UINT32_MAX;
+  in->seek = UINT32_MAX;
+
+  in->fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+  if (in->fd < 0)
+  {
+    perror("open input file");
+    exit(EXIT_FAILURE);
+  }
+
+  if (fstat(in->fd, &st) < 0)
+  {
+    perror("fstat input file");
+    exit(EXIT_FAILURE);
+  }
+
+  read_header(in);
+
+  if (in->width == 0 || in->height == 0)
+  {
+    fprintf(stderr, "Raw input needs its width and height, see -w and -h\n");
+    exit(EXIT_FAILURE);
+  }
+  in->frame_size = in->width*in->height + 2*((in->width*in->height)/4);
+
+  if (S_ISREG(st.st_mode) && (size_t)st.st_size > in->header_size &&
+      (unsigned long long)st.st_size <= SIZE_MAX)
+  {
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in->fd, 0);
+    if (map != MAP_FAILED)
+    {
+      size_t stride = in->frame_header + in->frame_size;
+
+      in->map = map;
+      in->map_size = st.st_size;
+      in->frames = (in->map_size - in->header_size) / stride;
+      in->partial = (in->map_size - in->header_size) % stride != 0;
+      in->seekable = 1;
+      in->head_len = 0;
+
+      return;
+    }
+  }
+
+  in->seekable = lseek(in->fd, 0, SEEK_CUR) >= 0;
+
+  // a hint only, pipes do not take it
+  posix_fadvise(in->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  in->ahead = malloc(INPUT_AHEAD * in->frame_size);
+  if (!in->ahead)
+  {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  pthread_mutex_init(&in->lock, NULL);
+  pthread_cond_init(&in->cond, NULL);
+
+  err = pthread_create(&in->thread, NULL, read_ahead, in);
+  if (err)
+  {
+    fprintf(stderr, "pthread_create: %s\n", strerror(err));
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+*   Copy a frame of the input to the planes of image. They are padded and
+*   usually a reused segment slot, so the padding is cleared.
+*/
+static void put_frame(struct input *in, struct c63_common *cm,
+    const uint8_t *data, yuv_t *image)
+{
+  uint8_t *planes[COLOR_COMPONENTS] = { image->Y, image->U, image->V };
+  size_t ysize = in->width*in->height;
+  int c;
+
+  for (c = 0; c < COLOR_COMPONENTS; ++c)
+  {
+    /* Given 4:2:0 chroma sub-sampling, the size of U and V is 1/4 of Y */
+    size_t size = c == Y_COMPONENT ? ysize : ysize/4;
+
+    memcpy(planes[c], data, size);
+    memset(planes[c] + size, 0, cm->padw[c]*cm->padh[c] - size);
+    data += size;
+  }
+}
+
+/* The input has no frame to read, tell once if it ends in one */
+static int input_end(struct input *in)
+{
+  if (in->partial)
+  {
+    fprintf(stderr, "Reached end of file, but incorrect bytes read.\n");
+    fprintf(stderr, "Wrong input? (height: %d width: %d)\n", in->height,
+            in->width);
+    in->partial = 0;
+  }
+
+  return -1;
+}
+
+/*
+*   Read frame into the padded planes of image, returns -1 past the end of
+*   the input
+*/
+int input_read(struct input *in, struct c63_common *cm, uint32_t frame,
+    yuv_t *image)
+{
+  if (in->map)
+  {
+    size_t stride = in->frame_header + in->frame_size;
+
+    if (frame >= in->frames) { return input_end(in); }
+
+    const uint8_t *data = in->map + in->header_size + (size_t)frame * stride;
+
+    /*
+    *   have the kernel read the following frames while we copy this one,
+    *   the advice has to start on a page
+    */
+    size_t start = in->header_size + ((size_t)frame + 1) * stride;
+    size_t end = start + INPUT_AHEAD * stride;
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    if (end > in->map_size) { end = in->map_size; }
+    if (start < end)
+    {
+      posix_madvise(in->map + start / page * page, end - start / page * page,
+                    POSIX_MADV_WILLNEED);
+    }
+
+    if (in->frame_header)
+    {
+      check_frame_line(in, frame, data);
+    }
+    put_frame(in, cm, data + in->frame_header, image);
+
+    return 0;
+  }
+
+  pthread_mutex_lock(&in->lock);
+
+  // the frame is neither read ahead nor read next, continue from it
+  if (frame < in->first || frame > in->first + in->count)
+  {
+    in->seek = frame;
+    pthread_cond_broadcast(&in->cond);
+  }
+
+  while (!in->error && frame < in->frames &&
+         (in->seek != UINT32_MAX || frame >= in->first + in->count))
+  {
+    pthread_cond_wait(&in->cond, &in->lock);
+  }
+
+  if (in->error)
+  {
+    fprintf(stderr, "Reading frame %u of the input: %s\n", frame,
+            strerror(in->error));
+    exit(EXIT_FAILURE);
+  }
+
+  if (frame >= in->frames)
+  {
+    int ret = input_end(in);
+    pthread_mutex_unlock(&in->lock);
+    return ret;
+  }
+
+  // the thread does not touch the slots in the ring
+  pthread_mutex_unlock(&in->lock);
+  put_frame(in, cm,
+            in->ahead + (size_t)(frame % INPUT_AHEAD) * in->frame_size, image);
+  pthread_mutex_lock(&in->lock);
+
+  // frame and those before it are done, make room for the next ones
+  in->count -= frame + 1 - in->first;
+  in->first = frame + 1;
+  pthread_cond_broadcast(&in->cond);
+  pthread_mutex_unlock(&in->lock);
+
+  return 0;
+}
+
+void input_close(struct input *in)
+{
+  if (in->map)
+  {
+    munmap(in->map, in->map_size);
+  }
+  else
+  {
+    pthread_mutex_lock(&in->lock);
+    in->quit = 1;
+    pthread_cond_broadcast(&in->cond);
+    pthread_mutex_unlock(&in->lock);
+
+    pthread_join(in->thread, NULL);
+    pthread_mutex_destroy(&in->lock);
+    pthread_cond_destroy(&in->cond);
+    free(in->ahead);
+  }
+
+  close(in->fd);
+}
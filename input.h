@@ -0,0 +1,76 @@
+#ifndef C63_INPUT_H_
+#define C63_INPUT_H_
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "c63.h"
+
+/*
+*   Planar YUV 4:2:0 input of c63enc, raw or Y4M, from a file or from
+*   standard input as "-". Frames are read by number, so servers can be
+*   handed GOPs out of order, straight into the padded planes of a segment
+*   slot. Y4M gives the dimensions in its header, its frames have to be
+*   4:2:0 and their FRAME lines can not carry parameters.
+*     - a regular file is mapped, frames are copied out of the mapping and
+*       the frames after the one read are advised to the kernel, so they are
+*       in the page cache when they are needed
+*     - anything that can not be mapped, like a pipe, is read by a read
+*       ahead thread into a ring of INPUT_AHEAD frames. Such an input has to
+*       be read in order unless it can seek.
+*/
+
+#define INPUT_AHEAD 8
+
+#define Y4M_MAGIC "YUV4MPEG2 "
+#define Y4M_FRAME "FRAME\n"
+#define Y4M_HEADER_MAX 256
+
+struct input
+{
+  int fd;
+  uint32_t width;
+  uint32_t height;
+  size_t frame_size;          // bytes of the planes of a frame
+  size_t frame_header;        // bytes of the FRAME line before them, if Y4M
+  size_t header_size;         // bytes before the first frame
+  uint32_t frames;            // frames in the input, UINT32_MAX until known
+  int partial;                // the input ends in the middle of a frame
+  int seekable;               // frames can be read in any order
+
+  // bytes read to tell raw from Y4M, read again as the start of a frame
+  uint8_t head[sizeof(Y4M_MAGIC) - 1];
+  size_t head_len;
+
+  // the whole input when mapped, NULL if it is read ahead
+  uint8_t *map;
+  size_t map_size;
+
+  /*
+  *   read ahead, frames first to first + count are in ring slots
+  *   frame % INPUT_AHEAD of ahead. seek asks the thread to continue from
+  *   another frame, UINT32_MAX if not.
+  */
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  uint8_t *ahead;
+  uint32_t first;
+  uint32_t count;
+  uint32_t seek;
+  int error;                  // errno of a failed read, 0 if none
+  int quit;
+};
+
+// Declarations
+void input_open(struct input *in, const char *path, uint32_t width,
+    uint32_t height);
+
+int input_read(struct input *in, struct c63_common *cm, uint32_t frame,
+    yuv_t *image);
+
+void input_close(struct input *in);
+
+#endif  /* C63_INPUT_H_ */
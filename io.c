@@ -1,63 +1,265 @@
+#define _POSIX_C_SOURCE 200809L   // posix_madvise()
+
 #include <assert.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "io.h"
 
-// XXX: Should be moved to a struct with FILE*
+/*
+*   The writer collects whole bytes in the buffer of the entropy context,
+*   which flush_output() hands to fp in one write. Bits wait in the 64-bit
+*   bit_buffer until 32 of them are there.
+*/
+
+#define OUTPUT_MIN_SIZE (64 * 1024)
 
-void put_byte(FILE *fp, int byte)
+/* Make room for n more bytes of output */
+static void reserve_output(struct entropy_ctx *c, size_t n)
 {
-  int status = fputc(byte, fp);
+  if (c->len + n <= c->cap) { return; }
+
+  if (c->fixed)
+  {
+    fprintf(stderr, "Bitstream does not fit in its %zu byte buffer\n",
+            c->cap);
+    exit(EXIT_FAILURE);
+  }
+
+  size_t cap = c->cap ? 2 * c->cap : OUTPUT_MIN_SIZE;
+  while (cap < c->len + n) { cap *= 2; }
 
-  if (status == EOF)
+  c->buf = realloc(c->buf, cap);
+  if (!c->buf)
   {
-    fprintf(stderr, "Error writing byte\n");
+    perror("realloc");
     exit(EXIT_FAILURE);
   }
+  c->cap = cap;
+}
+
+/*
+*   Write into buf of size bytes instead, which the caller owns. It does not
+*   grow, and flush_output() leaves the len bytes written there.
+*/
+void set_output_buffer(struct entropy_ctx *c, uint8_t *buf, size_t size)
+{
+  c->buf = buf;
+  c->cap = size;
+  c->len = 0;
+  c->fixed = 1;
+}
+
+/* Write the buffered output to fp, one write per frame */
+void flush_output(struct entropy_ctx *c)
+{
+  if (c->fixed || c->len == 0) { return; }
+
+  write_bytes(c->fp, c->buf, c->len);
+  c->len = 0;
 }
 
-void put_bytes(FILE *fp, const void* data, unsigned int len)
+void write_bytes(FILE *fp, const void* data, size_t len)
 {
-  size_t n = fwrite(data, 1, (size_t) len, fp);
+  size_t n = fwrite(data, 1, len, fp);
 
-  if(n != (size_t) len)
+  if(n != len)
   {
     fprintf(stderr, "Error writing bytes\n");
     exit(EXIT_FAILURE);
   }
 }
 
-uint8_t get_byte(FILE *fp)
+/* Output a byte of coded data, 0xff is followed by a stuffed 0 */
+static inline void put_coded_byte(struct entropy_ctx *c, uint8_t b)
 {
-  int status = fgetc(fp);
+  c->buf[c->len++] = b;
 
-  if (status == EOF)
+  if(b == 0xff) { c->buf[c->len++] = 0; }
+}
+
+/* Output the whole bytes of the bits in bit_buffer */
+static void drain_bits(struct entropy_ctx *c)
+{
+  reserve_output(c, 2 * (c->bit_buffer_width / 8));
+
+  while(c->bit_buffer_width >= 8)
   {
-    fprintf(stderr, "End of file.\n");
+    put_coded_byte(c, c->bit_buffer >> (c->bit_buffer_width - 8));
+    c->bit_buffer_width -= 8;
+  }
+}
+
+void put_byte(struct entropy_ctx *c, int byte)
+{
+  drain_bits(c);
+  reserve_output(c, 1);
+
+  c->buf[c->len++] = byte;
+}
+
+void put_bytes(struct entropy_ctx *c, const void* data, unsigned int len)
+{
+  drain_bits(c);
+  reserve_output(c, len);
+
+  memcpy(c->buf + c->len, data, len);
+  c->len += len;
+}
+
+/*
+*   The reader works on the coded bytes in memory, a mapping of the whole
+*   input when it is a regular file, or else a buffer of INPUT_BUFFER_SIZE
+*   bytes that is refilled from the descriptor as it is used up. Headers
+*   and the scan are read from the same cursor, in to in_end.
+*/
+
+#define INPUT_BUFFER_SIZE (1024 * 1024)
+
+void open_input(struct entropy_ctx *c, int fd)
+{
+  struct stat st;
+
+  c->in_fd = fd;
+  c->in_eof = 0;
+
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+      (unsigned long long)st.st_size <= SIZE_MAX)
+  {
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED)
+    {
+      posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+
+      c->in_buf = map;
+      c->in_map_size = st.st_size;
+      c->in = map;
+      c->in_end = c->in + st.st_size;
+      c->in_eof = 1;
+
+      return;
+    }
+  }
+
+  c->in_buf = malloc(INPUT_BUFFER_SIZE);
+  if (!c->in_buf)
+  {
+    perror("malloc");
     exit(EXIT_FAILURE);
   }
 
-  return (uint8_t) status;
+  c->in_map_size = 0;
+  c->in = c->in_end = c->in_buf;
 }
 
-int read_bytes(FILE *fp, void *data, unsigned int sz)
+void close_input(struct entropy_ctx *c)
 {
-  size_t status = fread(data, 1, (size_t) sz, fp);
+  if (c->in_map_size)
+  {
+    munmap(c->in_buf, c->in_map_size);
+  }
+  else
+  {
+    free(c->in_buf);
+  }
+
+  close(c->in_fd);
+}
+
+/* Have n bytes, n <= INPUT_BUFFER_SIZE, at in if the input has them */
+static size_t fill_input(struct entropy_ctx *c, size_t n)
+{
+  size_t len = c->in_end - c->in;
+
+  if (len >= n || c->in_eof) { return len; }
+
+  memmove(c->in_buf, c->in, len);
+  c->in = c->in_buf;
+  c->in_end = c->in_buf + len;
 
-  if ((int) status == EOF)
+  while (len < n)
+  {
+    ssize_t r = read(c->in_fd, c->in_buf + len, INPUT_BUFFER_SIZE - len);
+    if (r < 0 && errno == EINTR) { continue; }
+    if (r < 0)
+    {
+      perror("read");
+      exit(EXIT_FAILURE);
+    }
+    if (r == 0)
+    {
+      c->in_eof = 1;
+      break;
+    }
+
+    len += r;
+    c->in_end += r;
+  }
+
+  return len;
+}
+
+/*
+*   Continue reading at offset of a mapped input. Returns -1 if the input
+*   is read instead, and can not seek.
+*/
+int seek_input(struct entropy_ctx *c, uint64_t offset)
+{
+  if (!c->in_map_size || offset > c->in_map_size) { return -1; }
+
+  c->in = c->in_buf + offset;
+  c->bit_buffer = c->bit_buffer_width = 0;
+  c->marker = 0;
+
+  return 0;
+}
+
+/* Whether all of the input has been read */
+int end_of_input(struct entropy_ctx *c)
+{
+  return fill_input(c, 1) == 0;
+}
+
+uint8_t get_byte(struct entropy_ctx *c)
+{
+  if (fill_input(c, 1) == 0)
   {
     fprintf(stderr, "End of file.\n");
     exit(EXIT_FAILURE);
   }
-  else if (status != (size_t) sz)
+
+  return *c->in++;
+}
+
+int read_bytes(struct entropy_ctx *c, void *data, unsigned int sz)
+{
+  uint8_t *out = data;
+  size_t left = sz;
+
+  while (left > 0)
   {
-    fprintf(stderr, "Error reading bytes\n");
-    exit(EXIT_FAILURE);
+    size_t n = fill_input(c, MIN(left, INPUT_BUFFER_SIZE));
+
+    if (n == 0)
+    {
+      fprintf(stderr, "End of file.\n");
+      exit(EXIT_FAILURE);
+    }
+
+    n = MIN(n, left);
+    memcpy(out, c->in, n);
+    c->in += n;
+    out += n;
+    left -= n;
   }
 
-  return (int) status;
+  return (int) sz;
 }
 
 /**
@@ -69,58 +271,121 @@ void put_bits(struct entropy_ctx *c, uint16_t bits, uint8_t n)
 {
   assert(n <= 24  && "Error writing bit");
 
-  if(n == 0) { return; }
-
   c->bit_buffer <<= n;
   c->bit_buffer |= bits & ((1 << n) - 1);
   c->bit_buffer_width += n;
 
-  while(c->bit_buffer_width >= 8)
-  {
-    uint8_t b = (uint8_t)(c->bit_buffer >> (c->bit_buffer_width - 8));
-
-    put_byte(c->fp, b);
+  if(c->bit_buffer_width < 32) { return; }
 
-    if(b == 0xff) { put_byte(c->fp, 0); }
+  /*
+  *   output the oldest 32 bits at once, unless one of their bytes is 0xff
+  *   and needs a stuffed 0 after it
+  */
+  uint32_t w = c->bit_buffer >> (c->bit_buffer_width - 32);
 
-    c->bit_buffer_width -= 8;
+  if((~w - 0x01010101) & w & 0x80808080)
+  {
+    drain_bits(c);
+    return;
   }
+
+  reserve_output(c, 4);
+  c->buf[c->len++] = w >> 24;
+  c->buf[c->len++] = w >> 16;
+  c->buf[c->len++] = w >> 8;
+  c->buf[c->len++] = w;
+  c->bit_buffer_width -= 32;
 }
 
-uint16_t get_bits(struct entropy_ctx *c, uint8_t n)
+/*
+*   Have at least n bits, n <= 16, in bit_buffer. A 0xff byte is followed
+*   by a stuffed 0 in the scan, anything else after it is the marker that
+*   ends the scan. The marker is kept in the entropy context, and zeros are
+*   read past it, so the reader may look ahead of the last token of the
+*   scan. Like put_bits(), 32 bits are taken at once when none of their
+*   bytes is 0xff.
+*/
+static void fill_bits(struct entropy_ctx *c, uint8_t n)
 {
-  uint16_t ret = 0;
+  if (c->bit_buffer_width >= n) { return; }
+
+  if (!c->marker && fill_input(c, 4) >= 4)
+  {
+    const uint8_t *p = c->in;
+    uint32_t w = (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+
+    if(!((~w - 0x01010101) & w & 0x80808080))
+    {
+      c->bit_buffer = c->bit_buffer << 32 | w;
+      c->bit_buffer_width += 32;
+      c->in += 4;
+
+      return;
+    }
+  }
 
   while(c->bit_buffer_width < n)
   {
-    uint8_t b = get_byte(c->fp);
-    if (b == 0xff) { get_byte(c->fp); } /* Discard stuffed byte */
+    uint8_t b = 0;
+
+    if (!c->marker)
+    {
+      b = get_byte(c);
+      if (b == 0xff)
+      {
+        uint8_t m = get_byte(c);
+        if (m != 0)
+        {
+          c->marker = m;
+          b = 0;
+        }
+      }
+    }
 
     c->bit_buffer <<= 8;
     c->bit_buffer |= b;
     c->bit_buffer_width += 8;
   }
+}
 
-  ret = c->bit_buffer >> (c->bit_buffer_width - n);
-  c->bit_buffer_width -= n;
+uint16_t get_bits(struct entropy_ctx *c, uint8_t n)
+{
+  uint16_t ret = peek_bits(c, n);
 
-  /* Clear grabbed bits */
-  c->bit_buffer &= (1 << c->bit_buffer_width) - 1;
+  c->bit_buffer_width -= n;
 
   return ret;
 }
 
+/* The next n bits, n <= 16, without consuming them */
+uint16_t peek_bits(struct entropy_ctx *c, uint8_t n)
+{
+  fill_bits(c, n);
+
+  return (c->bit_buffer >> (c->bit_buffer_width - n)) & ((1u << n) - 1);
+}
+
+/* Consume n bits seen with peek_bits() */
+void skip_bits(struct entropy_ctx *c, uint8_t n)
+{
+  c->bit_buffer_width -= n;
+}
+
 /**
  * Flushes the bitBuffer by writing zeroes to fill a full byte
  */
 void flush_bits(struct entropy_ctx *c)
 {
-  if(c->bit_buffer > 0)
-  {
-    uint8_t b = c->bit_buffer << (8 - c->bit_buffer_width);
-    put_byte(c->fp, b);
+  drain_bits(c);
 
-    if(b == 0xff) { put_byte(c->fp, 0); }
+  /*
+  *   like the 32-bit writer this replaces, write the last byte whenever
+  *   one of the last 32 bits put is set, even with no bits left over
+  */
+  if((uint32_t)c->bit_buffer > 0)
+  {
+    reserve_output(c, 2);
+    put_coded_byte(c, c->bit_buffer << (8 - c->bit_buffer_width));
   }
 
   c->bit_buffer = 0;
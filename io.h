@@ -2,23 +2,42 @@
 #define C63_IO_H_
 
 #include <inttypes.h>
+#include <stddef.h>
 #include <stdio.h>
 
 #include "c63.h"
 
 // Declarations
-int read_bytes(FILE *fp, void *data, unsigned int sz);
+void open_input(struct entropy_ctx *c, int fd);
+
+void close_input(struct entropy_ctx *c);
+
+int end_of_input(struct entropy_ctx *c);
+
+int seek_input(struct entropy_ctx *c, uint64_t offset);
+
+int read_bytes(struct entropy_ctx *c, void *data, unsigned int sz);
 
 uint16_t get_bits(struct entropy_ctx *c, uint8_t n);
 
-uint8_t get_byte(FILE *fp);
+uint16_t peek_bits(struct entropy_ctx *c, uint8_t n);
+
+void skip_bits(struct entropy_ctx *c, uint8_t n);
+
+uint8_t get_byte(struct entropy_ctx *c);
 
 void flush_bits(struct entropy_ctx *c);
 
+void flush_output(struct entropy_ctx *c);
+
 void put_bits(struct entropy_ctx *c, uint16_t bits, uint8_t n);
 
-void put_byte(FILE *fp, int byte);
+void put_byte(struct entropy_ctx *c, int byte);
+
+void put_bytes(struct entropy_ctx *c, const void* data, unsigned int len);
+
+void set_output_buffer(struct entropy_ctx *c, uint8_t *buf, size_t size);
 
-void put_bytes(FILE *fp, const void* data, unsigned int len);
+void write_bytes(FILE *fp, const void* data, size_t len);
 
 #endif  /* C63_IO_H_ */
@@ -8,35 +8,85 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "common.h"
 #include "dsp.h"
 #include "me.h"
 
-/* Motion estimation for 8x8 block */
-static void me_block_8x8(struct c63_common *cm, int mb_x, int mb_y,
-    uint8_t *orig, uint8_t *ref, int color_component)
+int me_mode_parse(const char *name, enum me_mode *mode)
 {
-  struct macroblock *mb =
-    &cm->curframe->mbs[color_component][mb_y*cm->padw[color_component]/8+mb_x];
+  if (strcmp(name, "full") == 0)
+  {
+    *mode = ME_FULL;
+    return 0;
+  }
+  else if (strcmp(name, "fast") == 0)
+  {
+    *mode = ME_FAST;
+    return 0;
+  }
+  else if (strcmp(name, "pyramid") == 0)
+  {
+    *mode = ME_PYRAMID;
+    return 0;
+  }
+  else if (strcmp(name, "exact") == 0)
+  {
+    *mode = ME_EXACT;
+    return 0;
+  }
+
+  fprintf(stderr, "Unknown motion search %s\n", name);
+  return -1;
+}
 
+/*
+*   The search window of a block, the positions left <= x < right and
+*   top <= y < bottom of its top left corner in the reference frame. It may
+*   reach into the border of the reference, see extend_frame().
+*/
+struct me_window
+{
+  int left, top, right, bottom;
+};
+
+static void me_window(struct c63_common *cm, int mb_x, int mb_y,
+    int color_component, struct me_window *win)
+{
   int range = cm->me_search_range;
 
   /* Quarter resolution for chroma channels. */
   if (color_component > 0) { range /= 2; }
 
-  int left = mb_x * 8 - range;
-  int top = mb_y * 8 - range;
-  int right = mb_x * 8 + range;
-  int bottom = mb_y * 8 + range;
+  win->left = mb_x * 8 - range;
+  win->top = mb_y * 8 - range;
+  win->right = mb_x * 8 + range;
+  win->bottom = mb_y * 8 + range;
 
-  int w = cm->padw[color_component];
-  int h = cm->padh[color_component];
+  /* The reference is extended, unless the decoder does not do that */
+  if (cm->me_in_frame)
+  {
+    int w = cm->padw[color_component];
+    int h = cm->padh[color_component];
 
-  /* Make sure we are within bounds of reference frame. TODO: Support partial
-     frame bounds. */
-  if (left < 0) { left = 0; }
-  if (top < 0) { top = 0; }
-  if (right > (w - 8)) { right = w - 8; }
-  if (bottom > (h - 8)) { bottom = h - 8; }
+    if (win->left < 0) { win->left = 0; }
+    if (win->top < 0) { win->top = 0; }
+    if (win->right > (w - 8)) { win->right = w - 8; }
+    if (win->bottom > (h - 8)) { win->bottom = h - 8; }
+  }
+}
+
+/* Motion estimation for 8x8 block */
+static void me_block_8x8(struct c63_common *cm, int mb_x, int mb_y,
+    uint8_t *orig, uint8_t *ref, int color_component)
+{
+  struct macroblock *mb =
+    &cm->curframe->mbs[color_component][mb_y*cm->padw[color_component]/8+mb_x];
+
+  struct me_window win;
+  me_window(cm, mb_x, mb_y, color_component, &win);
+
+  int w = cm->padw[color_component];
+  int rs = REF_STRIDE(cm, color_component);
 
   int x, y;
 
@@ -45,12 +95,35 @@ static void me_block_8x8(struct c63_common *cm, int mb_x, int mb_y,
 
   int best_sad = INT_MAX;
 
-  for (y = top; y < bottom; ++y)
+  for (y = win.top; y < win.bottom; ++y)
   {
-    for (x = left; x < right; ++x)
+    /*
+    *   SAD_BATCH positions of the row a call, while they are all in the
+    *   window. The 16 bytes of a reference row it loads are then within
+    *   the border.
+    */
+    for (x = win.left; x + SAD_BATCH <= win.right; x += SAD_BATCH)
+    {
+      int sad[SAD_BATCH];
+      int k;
+
+      sad_block_8x8_x8(orig + my*w+mx, ref + y*rs+x, w, rs, sad);
+
+      for (k = 0; k < SAD_BATCH; ++k)
+      {
+        if (sad[k] < best_sad)
+        {
+          mb->mv_x = x + k - mx;
+          mb->mv_y = y - my;
+          best_sad = sad[k];
+        }
+      }
+    }
+
+    for (; x < win.right; ++x)
     {
       int sad;
-      sad_block_8x8(orig + my*w+mx, ref + y*w+x, w, &sad);
+      sad_block_8x8(orig + my*w+mx, ref + y*rs+x, w, rs, &sad);
 
       /* printf("(%4d,%4d) - %d\n", x, y, sad); */
 
@@ -72,29 +145,744 @@ static void me_block_8x8(struct c63_common *cm, int mb_x, int mb_y,
   mb->use_mv = 1;
 }
 
+/*
+*   Fast search, ME_FAST. A SAD of ME_FAST_STOP_SAD or less, 4 per pixel,
+*   ends the search. Each diamond moves at most ME_FAST_MAX_STEPS times.
+*/
+#define ME_FAST_STOP_SAD 256
+#define ME_FAST_MAX_STEPS 16
+
+static const int8_t large_diamond[8][2] =
+{
+  {0, -2}, {1, -1}, {2, 0}, {1, 1}, {0, 2}, {-1, 1}, {-2, 0}, {-1, -1},
+};
+
+static const int8_t small_diamond[4][2] =
+{
+  {0, -1}, {1, 0}, {0, 1}, {-1, 0},
+};
+
+// state of the fast search of a block at mx, my
+struct me_search
+{
+  uint8_t *orig;
+  uint8_t *ref;
+  int w;
+  int ref_stride;
+  int mx, my;
+  struct me_window win;
+
+  int best_sad;
+  int mv_x, mv_y;
+};
+
+/* Try the vector mv_x, mv_y if it is in the window */
+static void me_try(struct me_search *s, int mv_x, int mv_y)
+{
+  int x = s->mx + mv_x;
+  int y = s->my + mv_y;
+  int sad;
+
+  if (x < s->win.left || x >= s->win.right || y < s->win.top ||
+      y >= s->win.bottom)
+  {
+    return;
+  }
+
+  sad_block_8x8(s->orig + s->my*s->w + s->mx, s->ref + y*s->ref_stride + x,
+      s->w, s->ref_stride, &sad);
+
+  if (sad < s->best_sad)
+  {
+    s->best_sad = sad;
+    s->mv_x = mv_x;
+    s->mv_y = mv_y;
+  }
+}
+
+/* Move the best vector along the n points of a diamond until it stays */
+static void me_diamond(struct me_search *s, const int8_t (*points)[2], int n)
+{
+  int step, i;
+
+  for (step = 0; step < ME_FAST_MAX_STEPS; ++step)
+  {
+    int cx = s->mv_x;
+    int cy = s->mv_y;
+
+    if (s->best_sad <= ME_FAST_STOP_SAD) { return; }
+
+    for (i = 0; i < n; ++i)
+    {
+      me_try(s, cx + points[i][0], cy + points[i][1]);
+    }
+
+    if (s->mv_x == cx && s->mv_y == cy) { return; }
+  }
+}
+
+/*
+*   Vectors of the fast search, of the frame being estimated and of the one
+*   before it. They are kept apart from the macroblocks of the frames, which
+*   may be the same memory for consecutive frames, see create_frame_in(), and
+*   hold only the rows estimated here. Rows above first_row are estimated by
+*   the other side of a split frame, so they do not seed the search.
+*/
+struct me_seeds
+{
+  int framenum;               // the vectors are of this frame + 1, 0 if none
+  int first_row;              // luma macroblock row the frame started at
+
+  struct macroblock *cur[COLOR_COMPONENTS];
+  struct macroblock *prev[COLOR_COMPONENTS];
+};
+
+static size_t seed_blocks(struct c63_common *cm, int c)
+{
+  return (cm->padw[c] / 8) * (cm->padh[c] / 8);
+}
+
+/*
+*   Start the vectors of the frame at the first band of it, top. The vectors
+*   of the last frame seed it if it was estimated, it is zero otherwise, as
+*   after a keyframe.
+*/
+static void begin_seeds(struct c63_common *cm, int top)
+{
+  struct me_seeds *s = cm->seeds;
+  int c;
+
+  if (!s)
+  {
+    s = cm->seeds = calloc(1, sizeof(*s));
+    if (!s)
+    {
+      perror("calloc");
+      exit(EXIT_FAILURE);
+    }
+
+    for (c = 0; c < COLOR_COMPONENTS; ++c)
+    {
+      s->cur[c] = calloc(seed_blocks(cm, c), sizeof(struct macroblock));
+      s->prev[c] = calloc(seed_blocks(cm, c), sizeof(struct macroblock));
+      if (!s->cur[c] || !s->prev[c])
+      {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+  if (s->framenum == cm->framenum + 1) { return; }
+
+  for (c = 0; c < COLOR_COMPONENTS; ++c)
+  {
+    size_t size = seed_blocks(cm, c) * sizeof(struct macroblock);
+    struct macroblock *last = s->cur[c];
+
+    s->cur[c] = s->prev[c];
+    s->prev[c] = last;
+
+    if (s->framenum != cm->framenum) { memset(s->prev[c], 0, size); }
+    memset(s->cur[c], 0, size);
+  }
+
+  s->framenum = cm->framenum + 1;
+  s->first_row = top;
+}
+
+/* Motion estimation for 8x8 block with the fast search */
+static void me_block_8x8_fast(struct c63_common *cm, int mb_x, int mb_y,
+    uint8_t *orig, uint8_t *ref, int color_component)
+{
+  struct me_seeds *seeds = cm->seeds;
+  int cols = cm->padw[color_component] / 8;
+  int row_top = color_component > 0 ? seeds->first_row / 2 : seeds->first_row;
+  struct macroblock *mb =
+    &cm->curframe->mbs[color_component][mb_y*cols+mb_x];
+  struct macroblock *prev = &seeds->prev[color_component][mb_y*cols+mb_x];
+
+  struct me_search s;
+  s.orig = orig;
+  s.ref = ref;
+  s.w = cm->padw[color_component];
+  s.ref_stride = REF_STRIDE(cm, color_component);
+  s.mx = mb_x * 8;
+  s.my = mb_y * 8;
+  s.best_sad = INT_MAX;
+  s.mv_x = s.mv_y = 0;
+  me_window(cm, mb_x, mb_y, color_component, &s.win);
+
+  // seeded with the zero vector and the vectors of the neighbours
+  me_try(&s, 0, 0);
+
+  if (mb_x > 0) { me_try(&s, mb[-1].mv_x, mb[-1].mv_y); }
+  if (mb_y > row_top)
+  {
+    me_try(&s, mb[-cols].mv_x, mb[-cols].mv_y);
+    if (mb_x + 1 < cols) { me_try(&s, mb[1-cols].mv_x, mb[1-cols].mv_y); }
+  }
+  me_try(&s, prev->mv_x, prev->mv_y);
+
+  me_diamond(&s, large_diamond, 8);
+  me_diamond(&s, small_diamond, 4);
+
+  mb->mv_x = s.mv_x;
+  mb->mv_y = s.mv_y;
+  mb->use_mv = 1;
+
+  seeds->cur[color_component][mb_y*cols+mb_x] = *mb;
+}
+
+/*
+*   Pyramid search, ME_PYRAMID. Level l of the pyramid of a plane is the
+*   plane downsampled 2^l times, the pyramids of the current and the
+*   reference frame are built by the first motion estimation of a frame.
+*   The top level is searched in full over the window scaled down, and
+*   every level below refines twice the vector found above it by up to
+*   ME_PYRAMID_REFINE pixels. Up to ME_PYRAMID_LEVELS levels are added until
+*   the window at the top is ME_PYRAMID_TOP_RANGE pixels or less, so a wide
+*   window costs about what a narrow full search does. An 8x8 block at
+*   level l covers 8 << l pixels of the plane, so the coarse levels match
+*   larger areas.
+*
+*   A block at the right or bottom edge runs past the coarse levels, so it
+*   is matched there by the block of the level that ends at the edge. Like
+*   the reference frame, the coarse levels of the reference are surrounded
+*   by copies of their edge pixels, so the window scaled down stays centred
+*   on the block.
+*/
+#define ME_PYRAMID_LEVELS 3
+#define ME_PYRAMID_TOP_RANGE 8
+#define ME_PYRAMID_REFINE 2
+
+struct me_pyramid
+{
+  int framenum;               // the pyramids are of this frame + 1, 0 if none
+
+  int levels[COLOR_COMPONENTS];
+  int w[COLOR_COMPONENTS][ME_PYRAMID_LEVELS + 1];
+  int h[COLOR_COMPONENTS][ME_PYRAMID_LEVELS + 1];
+
+  // level 0 is the plane itself, the levels of ref have a border, level 0
+  // that of the reference frame
+  uint8_t *orig[COLOR_COMPONENTS][ME_PYRAMID_LEVELS + 1];
+  uint8_t *ref[COLOR_COMPONENTS][ME_PYRAMID_LEVELS + 1];
+  int ref_stride[COLOR_COMPONENTS][ME_PYRAMID_LEVELS + 1];
+  int ref_border[COLOR_COMPONENTS][ME_PYRAMID_LEVELS + 1];
+
+#ifdef C63_ME_CHECK
+  // blocks checked, and worse than the full search, others [0] and those at
+  // the right and bottom edges [1], see check_pyramid()
+  int check_blocks[2];
+  int check_worse[2];
+#endif
+};
+
+/*
+*   Average the 2x2 pixels of in, w by h with rows in_stride bytes apart,
+*   into out, rows out_stride bytes apart
+*/
+static void downsample(const uint8_t *in, int in_stride, int w, int h,
+    uint8_t *out, int out_stride)
+{
+  int x, y;
+
+  for (y = 0; y < h / 2; ++y)
+  {
+    const uint8_t *a = in + 2*y*in_stride;
+    const uint8_t *b = a + in_stride;
+
+    for (x = 0; x < w / 2; ++x)
+    {
+      out[y*out_stride + x] =
+        (a[2*x] + a[2*x+1] + b[2*x] + b[2*x+1] + 2) >> 2;
+    }
+  }
+}
+
+/* A w by h plane with a border of b pixels, rows w + 2*b bytes apart */
+static uint8_t *alloc_level(int w, int h, int b)
+{
+  int stride = w + 2*b;
+  uint8_t *level = malloc(stride * (h + 2*b));
+
+  if (!level)
+  {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  return level + b*stride + b;
+}
+
+static struct me_pyramid *create_pyramid(struct c63_common *cm)
+{
+  struct me_pyramid *p = calloc(1, sizeof(*p));
+  int c, l;
+
+  if (!p)
+  {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  for (c = 0; c < COLOR_COMPONENTS; ++c)
+  {
+    int range = c > 0 ? cm->me_search_range / 2 : cm->me_search_range;
+
+    p->w[c][0] = cm->padw[c];
+    p->h[c][0] = cm->padh[c];
+    p->ref_stride[c][0] = REF_STRIDE(cm, c);
+
+    for (l = 0; l < ME_PYRAMID_LEVELS && (range >> l) > ME_PYRAMID_TOP_RANGE &&
+         p->w[c][l] / 2 >= 8 && p->h[c][l] / 2 >= 8; ++l)
+    {
+      // the window scaled down reaches (range >> l) + 1 pixels out, and a
+      // block moved back into the level up to 7 more
+      int w = p->w[c][l+1] = p->w[c][l] / 2;
+      int h = p->h[c][l+1] = p->h[c][l] / 2;
+      int b = p->ref_border[c][l+1] = (range >> (l+1)) + 8;
+
+      p->orig[c][l+1] = alloc_level(w, h, 0);
+      p->ref[c][l+1] = alloc_level(w, h, b);
+      p->ref_stride[c][l+1] = w + 2*b;
+    }
+    p->levels[c] = l;
+  }
+
+  return p;
+}
+
+/* Build the pyramids of the current frame, unless they are there */
+static void build_pyramid(struct c63_common *cm)
+{
+  struct me_pyramid *p = cm->pyramid;
+  yuv_t *orig = cm->curframe->orig;
+  yuv_t *ref = cm->refframe->recons;
+  int c, l;
+
+  if (!p) { p = cm->pyramid = create_pyramid(cm); }
+  if (p->framenum == cm->framenum + 1) { return; }
+
+#ifdef C63_ME_CHECK
+  if (p->check_blocks[0] || p->check_blocks[1])
+  {
+    fprintf(stderr, "Pyramid search: %d of %d edge blocks and %d of %d others "
+            "worse than the full search\n", p->check_worse[1],
+            p->check_blocks[1], p->check_worse[0], p->check_blocks[0]);
+    memset(p->check_blocks, 0, sizeof(p->check_blocks));
+    memset(p->check_worse, 0, sizeof(p->check_worse));
+  }
+#endif
+
+  p->orig[Y_COMPONENT][0] = orig->Y;
+  p->orig[U_COMPONENT][0] = orig->U;
+  p->orig[V_COMPONENT][0] = orig->V;
+  p->ref[Y_COMPONENT][0] = ref->Y;
+  p->ref[U_COMPONENT][0] = ref->U;
+  p->ref[V_COMPONENT][0] = ref->V;
+
+  for (c = 0; c < COLOR_COMPONENTS; ++c)
+  {
+    for (l = 0; l < p->levels[c]; ++l)
+    {
+      downsample(p->orig[c][l], p->w[c][l], p->w[c][l], p->h[c][l],
+          p->orig[c][l+1], p->w[c][l+1]);
+      downsample(p->ref[c][l], p->ref_stride[c][l], p->w[c][l], p->h[c][l],
+          p->ref[c][l+1], p->ref_stride[c][l+1]);
+
+      extend_plane(p->ref[c][l+1], p->w[c][l+1], p->h[c][l+1],
+          p->ref_stride[c][l+1], p->ref_border[c][l+1]);
+    }
+  }
+
+  p->framenum = cm->framenum + 1;
+}
+
+/*
+*   Search level l of the pyramid of color_component for the block at mx, my
+*   of that level, over the vectors mv_x0 <= mv_x <= mv_x1 and likewise for
+*   y, within win scaled down to the level. Updates the best vector and SAD.
+*   The block is moved back into the level where it runs past it, and keeps
+*   its vectors.
+*/
+static void pyramid_search(struct me_pyramid *p, int color_component, int l,
+    int mx, int my, const struct me_window *win, int mv_x0, int mv_x1,
+    int mv_y0, int mv_y1, int *best_sad, int *best_x, int *best_y)
+{
+  int w = p->w[color_component][l];
+  int rs = p->ref_stride[color_component][l];
+  int bx = MIN(mx, w - 8);
+  int by = MIN(my, p->h[color_component][l] - 8);
+  uint8_t *orig = p->orig[color_component][l] + by*w + bx;
+  uint8_t *ref = p->ref[color_component][l] + (by - my)*rs + (bx - mx);
+
+  // the window of the full search, x < right, scaled down around the block
+  int left = win->left >> l;
+  int top = win->top >> l;
+  int right = (win->right - 1) >> l;
+  int bottom = (win->bottom - 1) >> l;
+
+  int x0 = MAX(mx + mv_x0, left);
+  int x1 = MIN(mx + mv_x1, right);
+  int y0 = MAX(my + mv_y0, top);
+  int y1 = MIN(my + mv_y1, bottom);
+  int x, y;
+
+  for (y = y0; y <= y1; ++y)
+  {
+    for (x = x0; x <= x1; ++x)
+    {
+      int sad;
+      sad_block_8x8(orig, ref + y*rs + x, w, rs, &sad);
+
+      if (sad < *best_sad)
+      {
+        *best_sad = sad;
+        *best_x = x - mx;
+        *best_y = y - my;
+      }
+    }
+  }
+}
+
+#ifdef C63_ME_CHECK
+/*
+*   Built with C63_ME_CHECK, every block is searched in full as well, and
+*   counted if the vector of the pyramid search has a higher SAD. The blocks
+*   at the edges, whose coarse blocks run past the pyramid, are counted on
+*   their own. The counts of a frame are printed when the pyramid of the
+*   next one is built.
+*/
+static void check_pyramid(struct c63_common *cm, int mb_x, int mb_y,
+    uint8_t *orig, uint8_t *ref, int color_component)
+{
+  struct me_pyramid *p = cm->pyramid;
+  struct macroblock *mb =
+    &cm->curframe->mbs[color_component][mb_y*cm->padw[color_component]/8+mb_x];
+  struct macroblock pyramid_mb = *mb;
+  int w = cm->padw[color_component];
+  int rs = REF_STRIDE(cm, color_component);
+  int size = 8 << p->levels[color_component];
+  int mx = mb_x * 8;
+  int my = mb_y * 8;
+  int edge = mx + size > w || my + size > cm->padh[color_component];
+  int pyramid_sad, full_sad;
+
+  me_block_8x8(cm, mb_x, mb_y, orig, ref, color_component);
+
+  sad_block_8x8(orig + my*w + mx,
+      ref + (my + pyramid_mb.mv_y)*rs + mx + pyramid_mb.mv_x, w, rs,
+      &pyramid_sad);
+  sad_block_8x8(orig + my*w + mx, ref + (my + mb->mv_y)*rs + mx + mb->mv_x,
+      w, rs, &full_sad);
+
+  ++p->check_blocks[edge];
+  if (pyramid_sad > full_sad) { ++p->check_worse[edge]; }
+
+  *mb = pyramid_mb;
+}
+#endif
+
+/* Motion estimation for 8x8 block with the pyramid search */
+static void me_block_8x8_pyramid(struct c63_common *cm, int mb_x, int mb_y,
+    uint8_t *orig, uint8_t *ref, int color_component)
+{
+  struct me_pyramid *p = cm->pyramid;
+  int levels = p->levels[color_component];
+
+  if (levels == 0)
+  {
+    me_block_8x8(cm, mb_x, mb_y, orig, ref, color_component);
+    return;
+  }
+
+  struct macroblock *mb =
+    &cm->curframe->mbs[color_component][mb_y*cm->padw[color_component]/8+mb_x];
+
+  struct me_window win;
+  me_window(cm, mb_x, mb_y, color_component, &win);
+
+  int range = color_component > 0 ? cm->me_search_range / 2 :
+    cm->me_search_range;
+  int top_range = range >> levels;
+  int best_sad = INT_MAX;
+  int mv_x = 0, mv_y = 0;
+  int l;
+
+  pyramid_search(p, color_component, levels, (mb_x * 8) >> levels,
+      (mb_y * 8) >> levels, &win, -top_range, top_range, -top_range, top_range,
+      &best_sad, &mv_x, &mv_y);
+
+  for (l = levels - 1; l >= 0; --l)
+  {
+    int cx = 2 * mv_x;
+    int cy = 2 * mv_y;
+
+    best_sad = INT_MAX;
+    mv_x = mv_y = 0;
+
+    // the zero vector competes at the bottom
+    if (l == 0)
+    {
+      pyramid_search(p, color_component, 0, mb_x * 8, mb_y * 8, &win, 0, 0,
+          0, 0, &best_sad, &mv_x, &mv_y);
+    }
+
+    pyramid_search(p, color_component, l, (mb_x * 8) >> l, (mb_y * 8) >> l,
+        &win, cx - ME_PYRAMID_REFINE, cx + ME_PYRAMID_REFINE,
+        cy - ME_PYRAMID_REFINE, cy + ME_PYRAMID_REFINE, &best_sad, &mv_x,
+        &mv_y);
+  }
+
+  mb->mv_x = mv_x;
+  mb->mv_y = mv_y;
+  mb->use_mv = 1;
+
+#ifdef C63_ME_CHECK
+  check_pyramid(cm, mb_x, mb_y, orig, ref, color_component);
+#endif
+}
+
+/*
+*   Exact search, ME_EXACT, finds the vectors of the full search with
+*   successive elimination. The SAD of two blocks is at least the sum over
+*   their rows of the differences of the row sums, and that is at least the
+*   difference of the block sums, so a position whose bound is no better
+*   than the best SAD so far is left out. The row and block sums of every
+*   position of the reference frame and its border are found once per frame.
+*
+*   The full search keeps the first of equal SADs in raster order. The SAD
+*   of the zero vector, the best the search can end with, only leaves out
+*   positions worse than it, so a tie before the zero vector still wins.
+*/
+struct me_sums
+{
+  int framenum;               // the sums are of this frame + 1, 0 if none
+
+  // of the 8 pixels right of, and the 8x8 pixels below right of, each pixel
+  uint16_t *row[COLOR_COMPONENTS];
+  uint16_t *block[COLOR_COMPONENTS];
+};
+
+/* Sum the rows and blocks of a w by h plane, at x <= w - 8, y <= h - 8 */
+static void plane_sums(const uint8_t *plane, int w, int h, uint16_t *row,
+    uint16_t *block)
+{
+  int x, y, v;
+
+  for (y = 0; y < h; ++y)
+  {
+    const uint8_t *p = plane + y*w;
+    uint16_t *r = row + y*w;
+    int sum = 0;
+
+    for (x = 0; x < 8; ++x) { sum += p[x]; }
+    r[0] = sum;
+
+    for (x = 1; x <= w - 8; ++x)
+    {
+      sum += p[x+7] - p[x-1];
+      r[x] = sum;
+    }
+  }
+
+  for (x = 0; x <= w - 8; ++x)
+  {
+    int sum = 0;
+
+    for (v = 0; v < 8; ++v) { sum += row[v*w + x]; }
+    block[x] = sum;
+
+    for (y = 1; y <= h - 8; ++y)
+    {
+      sum += row[(y+7)*w + x] - row[(y-1)*w + x];
+      block[y*w + x] = sum;
+    }
+  }
+}
+
+/* Sum the reference frame, unless it is done for this frame */
+static void build_sums(struct c63_common *cm)
+{
+  struct me_sums *s = cm->sums;
+  uint8_t *ref[COLOR_COMPONENTS] = { cm->refframe->recons->Y,
+                                     cm->refframe->recons->U,
+                                     cm->refframe->recons->V };
+  int c;
+
+  if (!s)
+  {
+    s = cm->sums = calloc(1, sizeof(*s));
+    if (!s)
+    {
+      perror("calloc");
+      exit(EXIT_FAILURE);
+    }
+
+    for (c = 0; c < COLOR_COMPONENTS; ++c)
+    {
+      size_t size = REF_STRIDE(cm, c) * (cm->padh[c] + 2 * REF_BORDER(c)) *
+        sizeof(uint16_t);
+
+      s->row[c] = malloc(size);
+      s->block[c] = malloc(size);
+      if (!s->row[c] || !s->block[c])
+      {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+  if (s->framenum == cm->framenum + 1) { return; }
+
+  for (c = 0; c < COLOR_COMPONENTS; ++c)
+  {
+    int b = REF_BORDER(c);
+    int rs = REF_STRIDE(cm, c);
+
+    plane_sums(ref[c] - b*rs - b, rs, cm->padh[c] + 2*b, s->row[c],
+        s->block[c]);
+  }
+
+  s->framenum = cm->framenum + 1;
+}
+
+/* Motion estimation for 8x8 block with the exact search */
+static void me_block_8x8_exact(struct c63_common *cm, int mb_x, int mb_y,
+    uint8_t *orig, uint8_t *ref, int color_component)
+{
+  struct macroblock *mb =
+    &cm->curframe->mbs[color_component][mb_y*cm->padw[color_component]/8+mb_x];
+
+  struct me_window win;
+  me_window(cm, mb_x, mb_y, color_component, &win);
+
+  int w = cm->padw[color_component];
+  int b = REF_BORDER(color_component);
+  int rs = REF_STRIDE(cm, color_component);
+
+  // the sums at the top left corner of the frame, inside the border
+  uint16_t *row = cm->sums->row[color_component] + b*rs + b;
+  uint16_t *block = cm->sums->block[color_component] + b*rs + b;
+
+  int mx = mb_x * 8;
+  int my = mb_y * 8;
+  uint8_t *o = orig + my*w + mx;
+
+  int orig_row[8];
+  int orig_sum = 0;
+  int x, y, u, v;
+
+  for (v = 0; v < 8; ++v)
+  {
+    orig_row[v] = 0;
+    for (u = 0; u < 8; ++u) { orig_row[v] += o[v*w + u]; }
+    orig_sum += orig_row[v];
+  }
+
+  // positions that are not better than the zero vector can not be chosen
+  int bound = INT_MAX;
+  if (mx >= win.left && mx < win.right && my >= win.top && my < win.bottom)
+  {
+    sad_block_8x8(o, ref + my*rs + mx, w, rs, &bound);
+    ++bound;
+  }
+
+  int best_sad = INT_MAX;
+
+  for (y = win.top; y < win.bottom; ++y)
+  {
+    for (x = win.left; x < win.right; ++x)
+    {
+      int limit = MIN(best_sad, bound);
+      int sad;
+
+      if (abs(orig_sum - block[y*rs + x]) >= limit) { continue; }
+
+      sad = 0;
+      for (v = 0; v < 8; ++v)
+      {
+        sad += abs(orig_row[v] - row[(y+v)*rs + x]);
+      }
+      if (sad >= limit) { continue; }
+
+      sad_block_8x8(o, ref + y*rs + x, w, rs, &sad);
+
+      if (sad < best_sad)
+      {
+        mb->mv_x = x - mx;
+        mb->mv_y = y - my;
+        best_sad = sad;
+      }
+    }
+  }
+
+  mb->use_mv = 1;
+}
+
+/* Motion estimation for an 8x8 block with the search of cm->me_mode */
+static void me_block(struct c63_common *cm, int mb_x, int mb_y,
+    uint8_t *orig, uint8_t *ref, int color_component)
+{
+  if (cm->me_mode == ME_FAST)
+  {
+    me_block_8x8_fast(cm, mb_x, mb_y, orig, ref, color_component);
+  }
+  else if (cm->me_mode == ME_PYRAMID)
+  {
+    me_block_8x8_pyramid(cm, mb_x, mb_y, orig, ref, color_component);
+  }
+  else if (cm->me_mode == ME_EXACT)
+  {
+    me_block_8x8_exact(cm, mb_x, mb_y, orig, ref, color_component);
+  }
+  else
+  {
+    me_block_8x8(cm, mb_x, mb_y, orig, ref, color_component);
+  }
+}
+
 void c63_motion_estimate(struct c63_common *cm)
+{
+  c63_motion_estimate_rows(cm, 0, cm->mb_rows);
+}
+
+/*
+*   Motion estimation for luma macroblock rows top to bottom and the chroma
+*   rows they cover, top and bottom must be even
+*/
+void c63_motion_estimate_rows(struct c63_common *cm, int top, int bottom)
 {
   /* Compare this frame with previous reconstructed frame */
   int mb_x, mb_y;
 
+  extend_frame(cm, cm->refframe);
+
+  if (cm->me_mode == ME_FAST) { begin_seeds(cm, top); }
+  if (cm->me_mode == ME_PYRAMID) { build_pyramid(cm); }
+  if (cm->me_mode == ME_EXACT) { build_sums(cm); }
+
   /* Luma */
-  for (mb_y = 0; mb_y < cm->mb_rows; ++mb_y)
+  for (mb_y = top; mb_y < bottom; ++mb_y)
   {
     for (mb_x = 0; mb_x < cm->mb_cols; ++mb_x)
     {
-      me_block_8x8(cm, mb_x, mb_y, cm->curframe->orig->Y,
+      me_block(cm, mb_x, mb_y, cm->curframe->orig->Y,
           cm->refframe->recons->Y, Y_COMPONENT);
     }
   }
 
   /* Chroma */
-  for (mb_y = 0; mb_y < cm->mb_rows / 2; ++mb_y)
+  for (mb_y = top / 2; mb_y < bottom / 2; ++mb_y)
   {
     for (mb_x = 0; mb_x < cm->mb_cols / 2; ++mb_x)
     {
-      me_block_8x8(cm, mb_x, mb_y, cm->curframe->orig->U,
+      me_block(cm, mb_x, mb_y, cm->curframe->orig->U,
           cm->refframe->recons->U, U_COMPONENT);
-      me_block_8x8(cm, mb_x, mb_y, cm->curframe->orig->V,
+      me_block(cm, mb_x, mb_y, cm->curframe->orig->V,
           cm->refframe->recons->V, V_COMPONENT);
     }
   }
@@ -115,6 +903,7 @@ static void mc_block_8x8(struct c63_common *cm, int mb_x, int mb_y,
   int bottom = top + 8;
 
   int w = cm->padw[color_component];
+  int rs = REF_STRIDE(cm, color_component);
 
   /* Copy block from ref mandated by MV */
   int x, y;
@@ -123,17 +912,25 @@ static void mc_block_8x8(struct c63_common *cm, int mb_x, int mb_y,
   {
     for (x = left; x < right; ++x)
     {
-      predicted[y*w+x] = ref[(y + mb->mv_y) * w + (x + mb->mv_x)];
+      predicted[y*w+x] = ref[(y + mb->mv_y) * rs + (x + mb->mv_x)];
     }
   }
 }
 
 void c63_motion_compensate(struct c63_common *cm)
+{
+  c63_motion_compensate_rows(cm, 0, cm->mb_rows);
+}
+
+/* Motion compensation for the rows of c63_motion_estimate_rows() */
+void c63_motion_compensate_rows(struct c63_common *cm, int top, int bottom)
 {
   int mb_x, mb_y;
 
+  extend_frame(cm, cm->refframe);
+
   /* Luma */
-  for (mb_y = 0; mb_y < cm->mb_rows; ++mb_y)
+  for (mb_y = top; mb_y < bottom; ++mb_y)
   {
     for (mb_x = 0; mb_x < cm->mb_cols; ++mb_x)
     {
@@ -143,7 +940,7 @@ void c63_motion_compensate(struct c63_common *cm)
   }
 
   /* Chroma */
-  for (mb_y = 0; mb_y < cm->mb_rows / 2; ++mb_y)
+  for (mb_y = top / 2; mb_y < bottom / 2; ++mb_y)
   {
     for (mb_x = 0; mb_x < cm->mb_cols / 2; ++mb_x)
     {
@@ -3,9 +3,38 @@
 
 #include "c63.h"
 
+/*
+*   Motion search of me_block_8x8()
+*     - ME_FULL  every position of the search window
+*     - ME_FAST  predictive zonal search, seeded with the vectors of the
+*                left, top and top-right neighbours and of the block in the
+*                previous frame, refined with diamonds and stopped early once
+*                the SAD is low enough. Faster, and a little worse.
+*     - ME_PYRAMID coarse to fine over downsampled frames, for search ranges
+*                  too wide for the full search
+*     - ME_EXACT the vectors of ME_FULL, with successive elimination of the
+*                positions that can not be better
+*/
+enum me_mode
+{
+  ME_FULL,
+  ME_FAST,
+  ME_PYRAMID,
+  ME_EXACT,
+};
+
+// widest search range, motion vectors are int8_t and coded in up to 7 bits
+#define ME_MAX_RANGE 127
+
 // Declaration
+int me_mode_parse(const char *name, enum me_mode *mode);
+
 void c63_motion_estimate(struct c63_common *cm);
 
+void c63_motion_estimate_rows(struct c63_common *cm, int top, int bottom);
+
 void c63_motion_compensate(struct c63_common *cm);
 
+void c63_motion_compensate_rows(struct c63_common *cm, int top, int bottom);
+
 #endif  /* C63_ME_H_ */
@@ -0,0 +1,228 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "segment.h"
+
+static uint32_t align_up(uint32_t v)
+{
+  return (v + SEGMENT_ALIGN - 1) & ~(uint32_t)(SEGMENT_ALIGN - 1);
+}
+
+/* Place a region of size bytes at the aligned end of the segment so far */
+static void add_region(struct segment_region *r, uint32_t *end, uint32_t size)
+{
+  r->offset = align_up(*end);
+  r->size = size;
+  *end = r->offset + size;
+}
+
+/* Room for halo luma rows and the chroma rows they cover */
+static void add_halo(struct c63_common *cm, struct segment_region *halo,
+    uint32_t *end, uint32_t rows)
+{
+  int c;
+
+  if (rows == 0) { return; }
+
+  for (c = 0; c < COLOR_COMPONENTS; ++c)
+  {
+    add_region(&halo[c], end,
+        cm->padw[c] * (rows * cm->padh[c] / cm->padh[Y_COMPONENT]));
+  }
+}
+
+/* halo is the number of luma rows exchanged in split mode, 0 if not split */
+void image_segment_layout(struct c63_common *cm, uint32_t halo,
+    struct image_segment_header *h)
+{
+  int c;
+  uint32_t end;
+
+  memset(h, 0, sizeof(*h));
+
+  h->magic = SEGMENT_MAGIC;
+  h->version = SEGMENT_VERSION;
+  h->header_size = sizeof(*h);
+  h->width = cm->width;
+  h->height = cm->height;
+
+  end = h->header_size;
+
+  for (c = 0; c < COLOR_COMPONENTS; ++c)
+  {
+    add_region(&h->plane[c], &end, cm->padw[c] * cm->padh[c]);
+  }
+
+  add_halo(cm, h->halo, &end, halo);
+
+  h->size = end;
+}
+
+void result_segment_layout(struct c63_common *cm, enum result_format format,
+    uint32_t halo, struct result_segment_header *h)
+{
+  int c;
+  uint32_t end;
+  uint32_t capacity = 0;
+
+  memset(h, 0, sizeof(*h));
+
+  h->magic = SEGMENT_MAGIC;
+  h->version = SEGMENT_VERSION;
+  h->header_size = sizeof(*h);
+  h->format = format;
+
+  end = h->header_size;
+
+  if (format == RESULT_BITSTREAM)
+  {
+    /* Room for a frame that compresses no better than its residuals */
+    for (c = 0; c < COLOR_COMPONENTS; ++c)
+    {
+      capacity += cm->padw[c] * cm->padh[c] * sizeof(int16_t);
+    }
+
+    add_region(&h->bitstream, &end, capacity);
+    h->size = end;
+
+    return;
+  }
+
+  /* Chroma has a quarter of the macroblocks of luma, as in create_frame() */
+  add_region(&h->mbs[Y_COMPONENT], &end,
+      cm->mb_rows * cm->mb_cols * sizeof(struct macroblock));
+  add_region(&h->mbs[U_COMPONENT], &end,
+      cm->mb_rows/2 * cm->mb_cols/2 * sizeof(struct macroblock));
+  add_region(&h->mbs[V_COMPONENT], &end,
+      cm->mb_rows/2 * cm->mb_cols/2 * sizeof(struct macroblock));
+
+  if (format == RESULT_SPARSE)
+  {
+    for (c = 0; c < COLOR_COMPONENTS; ++c)
+    {
+      uint32_t blocks = cm->padw[c] * cm->padh[c] / 64;
+
+      add_region(&h->last[c], &end, blocks * sizeof(uint8_t));
+      add_region(&h->nonzero[c], &end, blocks * sizeof(uint64_t));
+      add_region(&h->start[c], &end, blocks * sizeof(uint32_t));
+
+      capacity += blocks * 64 * sizeof(int16_t);
+    }
+
+    /* Last, so only the coefficients in use need to be transferred */
+    add_region(&h->coeffs, &end, capacity);
+    h->size = end;
+
+    return;
+  }
+
+  for (c = 0; c < COLOR_COMPONENTS; ++c)
+  {
+    add_region(&h->dct[c], &end, cm->padw[c] * cm->padh[c] * sizeof(int16_t));
+  }
+
+  add_halo(cm, h->halo, &end, halo);
+
+  h->size = end;
+}
+
+/* Number of bytes that have to be transferred for the current frame */
+uint32_t result_segment_used(const struct result_segment_header *h)
+{
+  if (h->format == RESULT_BITSTREAM)
+  {
+    return h->bitstream.offset + h->bitstream_size;
+  }
+  else if (h->format == RESULT_SPARSE)
+  {
+    return h->coeffs.offset + h->ncoeffs * sizeof(int16_t);
+  }
+
+  return h->size;
+}
+
+/* Point sparse at the sparse residual regions of the segment at base */
+void result_segment_sparse(volatile struct result_segment_header *base,
+    const struct result_segment_header *h, struct sparse_residuals *sparse)
+{
+  int c;
+
+  for (c = 0; c < COLOR_COMPONENTS; ++c)
+  {
+    sparse->plane[c].last = SEGMENT_PTR(base, h->last[c]);
+    sparse->plane[c].nonzero = SEGMENT_PTR(base, h->nonzero[c]);
+    sparse->plane[c].start = SEGMENT_PTR(base, h->start[c]);
+  }
+
+  sparse->coeffs = SEGMENT_PTR(base, h->coeffs);
+  sparse->ncoeffs = 0;
+}
+
+/* Compare a received header with the layout we computed ourselves */
+static int check_header(uint32_t magic, uint16_t version, uint32_t size,
+    uint32_t expected_size, const char *name)
+{
+  if (magic != SEGMENT_MAGIC)
+  {
+    fprintf(stderr, "%s segment: bad magic 0x%08x\n", name, magic);
+    return -1;
+  }
+
+  if (version != SEGMENT_VERSION)
+  {
+    fprintf(stderr, "%s segment: version %d, expected %d\n", name, version,
+        SEGMENT_VERSION);
+    return -1;
+  }
+
+  if (size != expected_size)
+  {
+    fprintf(stderr, "%s segment: size %u, expected %u\n", name, size,
+        expected_size);
+    return -1;
+  }
+
+  return 0;
+}
+
+int image_segment_check(const struct image_segment_header *expected,
+    volatile const struct image_segment_header *h)
+{
+  return check_header(h->magic, h->version, h->size, expected->size, "Image");
+}
+
+int result_segment_check(const struct result_segment_header *expected,
+    volatile const struct result_segment_header *h)
+{
+  if (check_header(h->magic, h->version, h->size, expected->size, "Result"))
+  {
+    return -1;
+  }
+
+  if (h->format != expected->format)
+  {
+    fprintf(stderr, "Result segment: format %u, expected %u\n", h->format,
+        expected->format);
+    return -1;
+  }
+
+  if (h->format == RESULT_BITSTREAM &&
+      h->bitstream_size > expected->bitstream.size)
+  {
+    fprintf(stderr, "Result segment: bitstream of %u bytes overflows %u\n",
+        h->bitstream_size, expected->bitstream.size);
+    return -1;
+  }
+
+  if (h->format == RESULT_SPARSE &&
+      h->ncoeffs * sizeof(int16_t) > expected->coeffs.size)
+  {
+    fprintf(stderr, "Result segment: %u coefficients overflow %u bytes\n",
+        h->ncoeffs, expected->coeffs.size);
+    return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,137 @@
+#ifndef C63_SEGMENT_H_
+#define C63_SEGMENT_H_
+
+#include <inttypes.h>
+#include <stdint.h>
+
+#include "c63.h"
+
+/*
+*   Wire layout of the image and result segments shared by c63enc and
+*   c63server. Every segment starts with a header recording the version and
+*   the offset and size of each payload region. Regions are aligned to
+*   SEGMENT_ALIGN bytes and only hold real payload (bytes and int16_t), so a
+*   DMA of header->size bytes moves exactly what the frame needs.
+*/
+
+#define SEGMENT_MAGIC 0x63363353    // "S36c" in memory on little endian
+#define SEGMENT_VERSION 4
+#define SEGMENT_ALIGN 64
+
+/*
+*   What the server sends back for each frame
+*     - RESULT_RESIDUALS  macroblocks and quantized residuals, entropy coded
+*                         by the client with write_frame()
+*     - RESULT_BITSTREAM  the finished .c63 frame, entropy coded by the server
+*     - RESULT_SPARSE     macroblocks and residuals in the sparse form of
+*                         struct sparse_residuals, entropy coded by the client
+*/
+enum result_format
+{
+  RESULT_RESIDUALS,
+  RESULT_BITSTREAM,
+  RESULT_SPARSE,
+};
+
+// offset from start of segment and number of payload bytes of a region
+struct segment_region
+{
+  uint32_t offset;
+  uint32_t size;
+};
+
+/*
+*   header of the image segment, followed by the padded Y, U and V planes.
+*   In split mode the client encodes the luma rows above split itself, and
+*   the halo regions carry the client's reconstruction of luma rows halo_top
+*   to halo_top + halo_rows of the previous frame, which the server searches
+*   in. Chroma halo rows are halved like the planes.
+*/
+struct image_segment_header
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t header_size;
+  uint32_t size;              // bytes of the layout, header included
+
+  uint32_t width;
+  uint32_t height;
+
+  uint32_t split;             // first luma row encoded by the server
+  uint32_t halo_top;
+  uint32_t halo_rows;
+
+  struct segment_region plane[COLOR_COMPONENTS];
+  struct segment_region halo[COLOR_COMPONENTS];
+};
+
+/*
+*   header of the result segment, followed by macroblocks and residuals or by
+*   the bitstream, depending on format. The bitstream region has room for a
+*   frame as large as its residuals, bitstream_size says how much is used.
+*   Likewise the coeffs region of the sparse format holds ncoeffs values.
+*   In split mode only the rows from split down are encoded, the halo
+*   regions carry the server's reconstruction of luma rows split to
+*   split + halo_rows for the client, and encode_time lets the client move
+*   the split.
+*/
+struct result_segment_header
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t header_size;
+  uint32_t size;              // bytes of the layout, header included
+
+  uint32_t format;            // enum result_format
+  int32_t keyframe;
+  uint32_t bitstream_size;
+  uint32_t ncoeffs;
+
+  uint32_t split;
+  uint32_t halo_rows;
+  uint32_t encode_time;       // microseconds spent encoding the rows
+
+  struct segment_region mbs[COLOR_COMPONENTS];
+  struct segment_region dct[COLOR_COMPONENTS];
+  struct segment_region bitstream;
+  struct segment_region halo[COLOR_COMPONENTS];
+
+  // struct sparse_residuals, coeffs is the last region of the segment
+  struct segment_region last[COLOR_COMPONENTS];
+  struct segment_region nonzero[COLOR_COMPONENTS];
+  struct segment_region start[COLOR_COMPONENTS];
+  struct segment_region coeffs;
+};
+
+// pointer to the payload of region r in the segment mapped at base
+#define SEGMENT_PTR(base, r) ((void *)((uint8_t *)(base) + (r).offset))
+
+/*
+*   Segments holding a ring keep one layout per slot, each slot starting at a
+*   multiple of SEGMENT_SLOT_SIZE(size) where size is the layout size
+*/
+#define SEGMENT_SLOT_SIZE(size) \
+  (((size_t)(size) + SEGMENT_ALIGN - 1) & ~(size_t)(SEGMENT_ALIGN - 1))
+#define SEGMENT_SLOT_OFFSET(size, slot) (SEGMENT_SLOT_SIZE(size) * (slot))
+#define SEGMENT_SLOT(base, size, slot) \
+  ((void *)((uint8_t *)(base) + SEGMENT_SLOT_OFFSET(size, slot)))
+
+// Declarations
+void image_segment_layout(struct c63_common *cm, uint32_t halo,
+    struct image_segment_header *h);
+
+void result_segment_layout(struct c63_common *cm, enum result_format format,
+    uint32_t halo, struct result_segment_header *h);
+
+uint32_t result_segment_used(const struct result_segment_header *h);
+
+void result_segment_sparse(volatile struct result_segment_header *base,
+    const struct result_segment_header *h, struct sparse_residuals *sparse);
+
+int image_segment_check(const struct image_segment_header *expected,
+    volatile const struct image_segment_header *h);
+
+int result_segment_check(const struct result_segment_header *expected,
+    volatile const struct result_segment_header *h);
+
+#endif  /* C63_SEGMENT_H_ */
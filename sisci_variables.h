@@ -28,6 +28,36 @@
 #define SEGMENT_CLIENT_RESULT GET_SEGMENTID(5)
 #define SEGMENT_SERVER_RESULT GET_SEGMENTID(6)
 
+/*
+*   c63enc can drive up to MAX_SERVERS servers, server i uses channel i.
+*   CHANNEL_ID(id, channel) gives the segment or interrupt id of a channel,
+*   so the segments of different servers never collide on the client or on
+*   a host running several servers.
+*/
+#define MAX_SERVERS 8
+#define CHANNEL_ID(id, channel) ((id) | (channel) << 8)
+
+/*
+*   interrupts used as doorbells, rung after writing to the comms of the
+*   owner. All servers ring the single client doorbell.
+*/
+#define INTERRUPT_CLIENT (GROUP << 4 | 1)
+#define INTERRUPT_SERVER (GROUP << 4 | 2)
+
+
+/*
+*   depth of the image and result rings, i.e. how many frames can be in
+*   flight between client and server at the same time
+*/
+#define RING_DEFAULT_DEPTH 3
+#define RING_MAX_DEPTH 16
+
+/*
+*   small frames are shipped in batches of consecutive ring slots, one
+*   transfer and one doorbell per batch each way. The ring holds two
+*   batches, so one can be encoded while the other is in transfer.
+*/
+#define BATCH_MAX (RING_MAX_DEPTH / 2)
 
 /*
 *   cmd what the client and server uses to communicate to eachother
@@ -43,7 +73,7 @@ enum cmd
 };
 
 
-// holds CMD command
+// holds CMD command and the parameters sent by the client at start up
 struct packet
 {
   union {
@@ -51,13 +81,47 @@ struct packet
       uint8_t cmd;
       int width;
       int height;
+      int depth;
+      int format;     // enum result_format, see segment.h
+      int spin;       // doorbell spin budget, see doorbell.h
+      int halo;       // luma rows exchanged in split mode, 0 if not split
+      int band;       // MCU rows per streamed result band, 0 if not streamed
+      int batch;      // most frames per transfer
+      int me_mode;    // enum me_mode, see me.h
+      int me_range;   // search range in pixels
+      int me_in_frame; // vectors stay in the frame, for older decoders
     };
   };
 };
 
-//  used as communication segments between client and server, contains a packet.
+/*
+*   used as communication segments between client and server, contains a
+*   packet and the state of the rings. Each side only writes to the comms
+*   of the other side, and rings the doorbell of the other side after it:
+*     - seq[i] is the frame number + 1 of the frame the peer has published in
+*       ring slot i, client to server for images, server to client for results
+*     - ack is the number of frames the peer is done with, so slot
+*       (frame % depth) of every frame below ack may be reused
+*     - band_seq[i] is BAND_SEQ(frame, rows) while the server streams the
+*       result of frame into slot i, rows being the MCU rows that have
+*       landed so far. seq[i] is still set once the whole frame is there.
+*/
 struct comms {
   struct packet packet;
+  uint32_t seq[RING_MAX_DEPTH];
+  uint32_t band_seq[RING_MAX_DEPTH];
+  uint32_t ack;
 };
 
+/*
+*   frame number + 1 and MCU rows packed in one word, so a single write
+*   publishes both. The frame number wraps at 24 bits, only equality is
+*   tested. BAND_SEQ_ROWS_MAX MCU rows are 4080 luma rows.
+*/
+#define BAND_SEQ_ROWS_MAX 0xff
+#define BAND_SEQ(frame, rows) (((uint32_t)(frame) + 1) << 8 | (rows))
+#define BAND_SEQ_IS_FRAME(band_seq, frame) \
+  ((band_seq) >> 8 == (((uint32_t)(frame) + 1) & 0xffffff))
+#define BAND_SEQ_ROWS(band_seq) ((band_seq) & BAND_SEQ_ROWS_MAX)
+
 #endif  /* C63_SISCI_VARIABLES_H_ */
@@ -0,0 +1,569 @@
+#define _POSIX_C_SOURCE 200809L   // shm_open(), sem_timedwait()
+
+#include <errno.h>
+#include <fcntl.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sisci_variables.h"
+#include "transport.h"
+
+#define SHM_CONNECT_RETRY 1000    // us between attempts to connect
+
+#ifndef C63_NO_SISCI
+// SISCI is initialized once for all SISCI transports of the process
+static int sisci_users = 0;
+#endif
+
+/* Name of the shared memory object of a segment or an interrupt */
+static void shm_name(char *name, size_t len, const char *kind, unsigned int id)
+{
+  snprintf(name, len, "/c63-%s-%x", kind, id);
+}
+
+static void shm_retry(void)
+{
+  struct timespec ts = { 0, SHM_CONNECT_RETRY * 1000 };
+  nanosleep(&ts, NULL);
+}
+
+/*
+*   Map a shared memory object, or return NULL if it is not there yet.
+*
+*   The creator keeps the object open in *fd, and holds a shared lock on it
+*   from shm_ready() on, once the object is set up. The kernel drops the
+*   lock when the creator exits or is killed, so the peer only maps objects
+*   whose creator is alive and done: a peer that starts first does not pick
+*   up the objects a killed run left in /dev/shm, and waits until this run
+*   replaces them.
+*/
+static void *shm_map(const char *name, size_t size, int *fd)
+{
+  struct stat st;
+  void *addr;
+  int f;
+
+  if (fd)
+  {
+    shm_unlink(name);
+    f = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (f < 0 || ftruncate(f, size) < 0)
+    {
+      perror(name);
+      exit(EXIT_FAILURE);
+    }
+  }
+  else
+  {
+    f = shm_open(name, O_RDWR, 0);
+    if (f < 0) { return NULL; }
+
+    // the creator may not have sized it yet, or be gone
+    if (fstat(f, &st) < 0 || (size_t)st.st_size < size ||
+        flock(f, LOCK_EX | LOCK_NB) == 0)
+    {
+      close(f);
+      return NULL;
+    }
+  }
+
+  addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, f, 0);
+  if (addr == MAP_FAILED)
+  {
+    perror(name);
+    exit(EXIT_FAILURE);
+  }
+
+  if (fd) { *fd = f; }
+  else { close(f); }
+
+  return addr;
+}
+
+/* Let the peer map an object of shm_map() */
+static void shm_ready(int fd)
+{
+  if (flock(fd, LOCK_SH) < 0)
+  {
+    perror("flock");
+    exit(EXIT_FAILURE);
+  }
+}
+
+int transport_parse(const char *name, enum transport_kind *kind)
+{
+  if (strcmp(name, "sisci") == 0)
+  {
+#ifndef C63_NO_SISCI
+    *kind = TRANSPORT_SISCI;
+    return 0;
+#else
+    fprintf(stderr, "Built without SISCI, use the shm transport\n");
+    return -1;
+#endif
+  }
+  else if (strcmp(name, "shm") == 0)
+  {
+    *kind = TRANSPORT_SHM;
+    return 0;
+  }
+
+  fprintf(stderr, "Unknown transport %s\n", name);
+  return -1;
+}
+
+void transport_open(struct transport *t, enum transport_kind kind,
+    unsigned int remote_node)
+{
+  memset(t, 0, sizeof(*t));
+  t->kind = kind;
+  t->remote_node = remote_node;
+
+  if (kind == TRANSPORT_SHM) { return; }
+
+#ifndef C63_NO_SISCI
+  sci_error_t error;
+  unsigned int max_entries = 1; // max entries inside dma queue
+
+  t->adapter = 0;
+
+  /* Initialize the SISCI library */
+  if (sisci_users++ == 0)
+  {
+    SCIInitialize(NO_FLAGS, &error);
+    if (error != SCI_ERR_OK) {
+        fprintf(stderr,"SCIInitialize failed: %s\n", SCIGetErrorString(error));
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  /* Open a file descriptor */
+  SCIOpen(&t->sd,NO_FLAGS,&error);
+  if (error != SCI_ERR_OK) {
+     fprintf(stderr, "SCIOpen failed: %s (0x%x)\n",
+             SCIGetErrorString(error), error);
+     exit(error);
+  }
+
+  /*
+  *   Create a DMA queue for transfering segments to the other side
+  */
+  SCICreateDMAQueue(t->sd,
+                    &t->dq,
+                    t->adapter,
+                    max_entries,
+                    NO_FLAGS,
+                    &error
+                  );
+  if(error != SCI_ERR_OK){
+    fprintf(stderr, "SCICreateDMAQueue failed: %s - Error code: (0x%x)\n",
+            SCIGetErrorString(error), error);
+    exit(EXIT_FAILURE);
+  }
+#endif
+}
+
+void transport_close(struct transport *t)
+{
+  if (t->kind == TRANSPORT_SHM) { return; }
+
+#ifndef C63_NO_SISCI
+  sci_error_t error;
+
+  SCIRemoveDMAQueue(t->dq, NO_FLAGS, &error);
+  SCIClose(t->sd, NO_FLAGS, &error);
+
+  if (--sisci_users == 0) { SCITerminate(); }
+#endif
+}
+
+/*
+*   Create, prepare, set available and map a local segment that the other
+*   side can connect to
+*/
+volatile void *transport_create_segment(struct transport *t,
+    struct transport_segment *s, unsigned int id, size_t size)
+{
+  s->size = size;
+  s->id = id;
+
+  if (t->kind == TRANSPORT_SHM)
+  {
+    char name[64];
+    shm_name(name, sizeof(name), "seg", id);
+    s->addr = shm_map(name, size, &s->shm_fd);
+    shm_ready(s->shm_fd);
+
+    return s->addr;
+  }
+
+#ifndef C63_NO_SISCI
+  sci_error_t error;
+
+  SCICreateSegment(t->sd,
+                   &s->segment,
+                   id,
+                   size,
+                   NO_CALLBACK,
+                   NULL,
+                   NO_FLAGS,
+                   &error);
+  if(error != SCI_ERR_OK){
+   fprintf(stderr, "SCICreateSegment failed: %s - Error code: (0x%x)\n",
+           SCIGetErrorString(error), error);
+   exit(EXIT_FAILURE);
+  }
+
+  SCIPrepareSegment(s->segment, t->adapter, NO_FLAGS, &error);
+  if(error != SCI_ERR_OK){
+   fprintf(stderr, "SCIPrepareSegment failed: %s - Error code: (0x%x)\n",
+           SCIGetErrorString(error), error);
+   exit(EXIT_FAILURE);
+  }
+
+  SCISetSegmentAvailable(s->segment, t->adapter, NO_FLAGS, &error);
+  if(error != SCI_ERR_OK){
+   fprintf(stderr, "SCISetSegmentAvailable failed: %s - Error code: (0x%x)\n",
+           SCIGetErrorString(error), error);
+   exit(EXIT_FAILURE);
+  }
+
+  s->addr = SCIMapLocalSegment(s->segment,
+                               &s->map,
+                               0,
+                               size,
+                               NULL,
+                               NO_FLAGS,
+                               &error);
+  if(error != SCI_ERR_OK){
+    fprintf(stderr, "SCIMapLocalSegment failed: %s - Error code: (0x%x)\n",
+            SCIGetErrorString(error), error);
+    exit(EXIT_FAILURE);
+  }
+#endif
+
+  return s->addr;
+}
+
+void transport_remove_segment(struct transport *t,
+    struct transport_segment *s)
+{
+  if (t->kind == TRANSPORT_SHM)
+  {
+    char name[64];
+    shm_name(name, sizeof(name), "seg", s->id);
+    munmap((void *)s->addr, s->size);
+    shm_unlink(name);
+    close(s->shm_fd);
+
+    return;
+  }
+
+#ifndef C63_NO_SISCI
+  sci_error_t error;
+
+  SCIUnmapSegment(s->map, NO_FLAGS, &error);
+  SCISetSegmentUnavailable(s->segment, t->adapter, NO_FLAGS, &error);
+  SCIRemoveSegment(s->segment, NO_FLAGS, &error);
+#endif
+}
+
+/*
+*   Connect to a segment of the other side, waiting until it is available.
+*   With map set it is also mapped for pio, shared memory is always mapped.
+*/
+volatile void *transport_connect_segment(struct transport *t,
+    struct transport_remote *r, unsigned int id, size_t size, int map)
+{
+  r->size = size;
+  r->addr = NULL;
+
+  if (t->kind == TRANSPORT_SHM)
+  {
+    char name[64];
+    shm_name(name, sizeof(name), "seg", id);
+    while ((r->addr = shm_map(name, size, NULL)) == NULL) { shm_retry(); }
+
+    return r->addr;
+  }
+
+#ifndef C63_NO_SISCI
+  sci_error_t error;
+
+  do {
+      SCIConnectSegment(t->sd,
+                        &r->segment,
+                        t->remote_node,
+                        id,
+                        t->adapter,
+                        NO_CALLBACK,
+                        NULL,
+                        SCI_INFINITE_TIMEOUT,        // dont time out
+                        NO_FLAGS,
+                        &error);
+  } while (error != SCI_ERR_OK);
+
+  if (!map) { return NULL; }
+
+  r->addr = SCIMapRemoteSegment(r->segment,
+                                &r->map,
+                                0,
+                                size,
+                                NULL,
+                                NO_FLAGS,
+                                &error);
+  if(error != SCI_ERR_OK){
+    fprintf(stderr, "SCIMapRemoteSegment failed: %s - Error code: (0x%x)\n",
+            SCIGetErrorString(error), error);
+    exit(EXIT_FAILURE);
+  }
+#else
+  (void)map;
+#endif
+
+  return r->addr;
+}
+
+void transport_disconnect_segment(struct transport *t,
+    struct transport_remote *r)
+{
+  if (t->kind == TRANSPORT_SHM)
+  {
+    munmap((void *)r->addr, r->size);
+    return;
+  }
+
+#ifndef C63_NO_SISCI
+  sci_error_t error;
+
+  if (r->addr) { SCIUnmapSegment(r->map, NO_FLAGS, &error); }
+  SCIDisconnectSegment(r->segment, NO_FLAGS, &error);
+#endif
+}
+
+/*
+*   Copy size bytes from a local segment to a segment of the other side and
+*   wait until they have arrived
+*/
+void transport_copy(struct transport *t, struct transport_segment *local,
+    size_t local_offset, struct transport_remote *remote,
+    size_t remote_offset, size_t size)
+{
+  if (t->kind == TRANSPORT_SHM)
+  {
+    memcpy((uint8_t *)remote->addr + remote_offset,
+           (uint8_t *)local->addr + local_offset, size);
+    __sync_synchronize();
+
+    return;
+  }
+
+#ifndef C63_NO_SISCI
+  sci_error_t error;
+
+  SCIStartDmaTransfer(t->dq,
+                      local->segment,
+                      remote->segment,
+                      local_offset,
+                      size,
+                      remote_offset,
+                      NO_CALLBACK,
+                      NULL,
+                      NO_FLAGS,
+                      &error);
+  if(error != SCI_ERR_OK){
+    fprintf(stderr,"SCIStartDmaTransfer failed: %s - Error code: (0x%x)\n",
+            SCIGetErrorString(error), error);
+    exit(EXIT_FAILURE);
+  }
+
+  // wait for DMA transfer to finish
+  SCIWaitForDMAQueue(t->dq,
+                    SCI_INFINITE_TIMEOUT,
+                    NO_FLAGS,
+                    &error);
+  if(error != SCI_ERR_OK){
+    fprintf(stderr,"SCIWaitForDMAQueue failed: %s - Error code: (0x%x)\n",
+            SCIGetErrorString(error), error);
+    exit(EXIT_FAILURE);
+  }
+#endif
+}
+
+/* Create our interrupt with a fixed number the other side can connect to */
+void transport_create_interrupt(struct transport *t,
+    struct transport_interrupt *i, unsigned int intno)
+{
+  i->intno = intno;
+
+  if (t->kind == TRANSPORT_SHM)
+  {
+    char name[64];
+    shm_name(name, sizeof(name), "irq", intno);
+    i->sem = shm_map(name, sizeof(sem_t), &i->shm_fd);
+    if (sem_init(i->sem, 1, 0) < 0)
+    {
+      perror("sem_init");
+      exit(EXIT_FAILURE);
+    }
+    shm_ready(i->shm_fd);
+
+    return;
+  }
+
+#ifndef C63_NO_SISCI
+  sci_error_t error;
+
+  SCICreateInterrupt(t->sd,
+                     &i->local,
+                     t->adapter,
+                     &i->intno,
+                     NO_CALLBACK,
+                     NULL,
+                     SCI_FLAG_FIXED_INTNO,
+                     &error);
+  if(error != SCI_ERR_OK){
+    fprintf(stderr, "SCICreateInterrupt failed: %s - Error code: (0x%x)\n",
+            SCIGetErrorString(error), error);
+    exit(EXIT_FAILURE);
+  }
+#endif
+}
+
+/* Connect to the interrupt of the other side, waiting until it is created */
+void transport_connect_interrupt(struct transport *t,
+    struct transport_interrupt *i, unsigned int intno)
+{
+  i->intno = intno;
+
+  if (t->kind == TRANSPORT_SHM)
+  {
+    char name[64];
+    shm_name(name, sizeof(name), "irq", intno);
+    while ((i->sem = shm_map(name, sizeof(sem_t), NULL)) == NULL)
+    {
+      shm_retry();
+    }
+
+    return;
+  }
+
+#ifndef C63_NO_SISCI
+  sci_error_t error;
+
+  do {
+      SCIConnectInterrupt(t->sd,
+                          &i->remote,
+                          t->remote_node,
+                          t->adapter,
+                          intno,
+                          SCI_INFINITE_TIMEOUT,
+                          NO_FLAGS,
+                          &error);
+  } while (error != SCI_ERR_OK);
+#endif
+}
+
+void transport_trigger_interrupt(struct transport *t,
+    struct transport_interrupt *i)
+{
+  if (t->kind == TRANSPORT_SHM)
+  {
+    sem_post(i->sem);
+    return;
+  }
+
+#ifndef C63_NO_SISCI
+  sci_error_t error;
+
+  SCITriggerInterrupt(i->remote, NO_FLAGS, &error);
+  if(error != SCI_ERR_OK){
+    fprintf(stderr, "SCITriggerInterrupt failed: %s - Error code: (0x%x)\n",
+            SCIGetErrorString(error), error);
+    exit(EXIT_FAILURE);
+  }
+#endif
+}
+
+/* Wait at most timeout ms for our interrupt, returns -1 on timeout */
+int transport_wait_interrupt(struct transport *t,
+    struct transport_interrupt *i, unsigned int timeout)
+{
+  if (t->kind == TRANSPORT_SHM)
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += (long)timeout * 1000000;
+    ts.tv_sec += ts.tv_nsec / 1000000000;
+    ts.tv_nsec %= 1000000000;
+
+    while (sem_timedwait(i->sem, &ts) < 0)
+    {
+      if (errno == ETIMEDOUT) { return -1; }
+      if (errno != EINTR)
+      {
+        perror("sem_timedwait");
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    return 0;
+  }
+
+#ifndef C63_NO_SISCI
+  sci_error_t error;
+
+  SCIWaitForInterrupt(i->local, timeout, NO_FLAGS, &error);
+  if (error == SCI_ERR_TIMEOUT) { return -1; }
+  if(error != SCI_ERR_OK){
+    fprintf(stderr, "SCIWaitForInterrupt failed: %s - Error code: (0x%x)\n",
+            SCIGetErrorString(error), error);
+    exit(EXIT_FAILURE);
+  }
+#endif
+
+  return 0;
+}
+
+void transport_remove_interrupt(struct transport *t,
+    struct transport_interrupt *i)
+{
+  if (t->kind == TRANSPORT_SHM)
+  {
+    char name[64];
+    shm_name(name, sizeof(name), "irq", i->intno);
+    sem_destroy(i->sem);
+    munmap(i->sem, sizeof(sem_t));
+    shm_unlink(name);
+    close(i->shm_fd);
+
+    return;
+  }
+
+#ifndef C63_NO_SISCI
+  sci_error_t error;
+  SCIRemoveInterrupt(i->local, NO_FLAGS, &error);
+#endif
+}
+
+void transport_disconnect_interrupt(struct transport *t,
+    struct transport_interrupt *i)
+{
+  if (t->kind == TRANSPORT_SHM)
+  {
+    munmap(i->sem, sizeof(sem_t));
+    return;
+  }
+
+#ifndef C63_NO_SISCI
+  sci_error_t error;
+  SCIDisconnectInterrupt(i->remote, NO_FLAGS, &error);
+#endif
+}
@@ -0,0 +1,134 @@
+#ifndef C63_TRANSPORT_H_
+#define C63_TRANSPORT_H_
+
+#include <inttypes.h>
+#include <semaphore.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef C63_NO_SISCI
+#include <sisci_error.h>
+#include <sisci_api.h>
+#endif
+
+/*
+*   Transport between client and server. Each side creates its own segments
+*   and connects to the segments of the other side, using the ids and the
+*   layout of sisci_variables.h and segment.h whatever the transport is.
+*     - TRANSPORT_SISCI   Dolphin PCIe, segments are copied with DMA and
+*                         interrupts are SISCI interrupts
+*     - TRANSPORT_SHM     client and server on one host, segments are POSIX
+*                         shared memory and interrupts process shared
+*                         semaphores. Remote segments are always mapped, so
+*                         they can be written directly.
+*
+*   Building with C63_NO_SISCI leaves out the SISCI transport, for hosts
+*   without Dolphin adapters and libsisci.
+*/
+
+enum transport_kind
+{
+  TRANSPORT_SISCI,
+  TRANSPORT_SHM,
+};
+
+#ifndef C63_NO_SISCI
+#define TRANSPORT_DEFAULT TRANSPORT_SISCI
+#else
+#define TRANSPORT_DEFAULT TRANSPORT_SHM
+#endif
+
+struct transport
+{
+  enum transport_kind kind;
+  unsigned int remote_node;         // SISCI node id of the other side
+
+#ifndef C63_NO_SISCI
+  unsigned int adapter;
+  sci_desc_t sd;
+  sci_dma_queue_t dq;
+#endif
+};
+
+// a segment created by this side
+struct transport_segment
+{
+  volatile void *addr;
+  size_t size;
+  unsigned int id;
+  int shm_fd;                       // held open while it exists, shm only
+
+#ifndef C63_NO_SISCI
+  sci_local_segment_t segment;
+  sci_map_t map;
+#endif
+};
+
+// a segment created by the other side, addr is NULL unless mapped
+struct transport_remote
+{
+  volatile void *addr;
+  size_t size;
+
+#ifndef C63_NO_SISCI
+  sci_remote_segment_t segment;
+  sci_map_t map;
+#endif
+};
+
+// an interrupt, either our own to wait on or the peer's to trigger
+struct transport_interrupt
+{
+  unsigned int intno;
+  sem_t *sem;
+  int shm_fd;                       // of our own interrupt, shm only
+
+#ifndef C63_NO_SISCI
+  sci_local_interrupt_t local;
+  sci_remote_interrupt_t remote;
+#endif
+};
+
+// Declarations
+int transport_parse(const char *name, enum transport_kind *kind);
+
+void transport_open(struct transport *t, enum transport_kind kind,
+    unsigned int remote_node);
+
+void transport_close(struct transport *t);
+
+volatile void *transport_create_segment(struct transport *t,
+    struct transport_segment *s, unsigned int id, size_t size);
+
+void transport_remove_segment(struct transport *t,
+    struct transport_segment *s);
+
+volatile void *transport_connect_segment(struct transport *t,
+    struct transport_remote *r, unsigned int id, size_t size, int map);
+
+void transport_disconnect_segment(struct transport *t,
+    struct transport_remote *r);
+
+void transport_copy(struct transport *t, struct transport_segment *local,
+    size_t local_offset, struct transport_remote *remote,
+    size_t remote_offset, size_t size);
+
+void transport_create_interrupt(struct transport *t,
+    struct transport_interrupt *i, unsigned int intno);
+
+void transport_connect_interrupt(struct transport *t,
+    struct transport_interrupt *i, unsigned int intno);
+
+void transport_trigger_interrupt(struct transport *t,
+    struct transport_interrupt *i);
+
+int transport_wait_interrupt(struct transport *t,
+    struct transport_interrupt *i, unsigned int timeout);
+
+void transport_remove_interrupt(struct transport *t,
+    struct transport_interrupt *i);
+
+void transport_disconnect_interrupt(struct transport *t,
+    struct transport_interrupt *i);
+
+#endif  /* C63_TRANSPORT_H_ */
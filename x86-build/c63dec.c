@@ -0,0 +1 @@
+../c63dec.c
\ No newline at end of file